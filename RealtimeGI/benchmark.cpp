@@ -0,0 +1,432 @@
+// Headless benchmark, renders a synthetic scene offscreen and reports CPU and GPU frame times.
+// Runs without a window system, e.g. on Mesa's lavapipe. See the README for how to build it.
+#include "system.h"
+#include "renderer.h"
+#include "profiler.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+struct BenchmarkOptions {
+    u32 width = 1280;
+    u32 height = 720;
+    u32 frames = 500;
+    u32 warmupFrames = 30; // Not measured, covers pipeline compilation and the first uploads
+    u32 staticObjects = 10000; // Render objects, culled through the BVH and drawn from cached draws
+    u32 dynamicObjects = 1000; // Rotated and queued with DrawMesh every frame
+    bool gpuDriven = false; // Packed meshes whose DrawMesh draws are built by the compute shader, if the device supports it
+    bool cameraMotion = false; // Sways and turns the camera a little every frame
+    const char* csvPath = nullptr;
+    const char* screenshotPath = nullptr;
+    const char* gpuTracePath = nullptr;
+    const char* cpuTracePath = nullptr; // Needs a build with ENABLE_PROFILING
+};
+
+struct FrameTimeSummary {
+    u32 count;
+    r64 mean;
+    r64 min;
+    r64 median;
+    r64 p95;
+    r64 p99;
+    r64 max;
+};
+
+static void PrintUsage() {
+    printf(
+        "Usage: benchmark [options]\n"
+        "  --width <n>        Render width (1280)\n"
+        "  --height <n>       Render height (720)\n"
+        "  --frames <n>       Measured frames (500)\n"
+        "  --warmup <n>       Frames rendered before measuring (30)\n"
+        "  --static <n>       Retained render objects (10000)\n"
+        "  --dynamic <n>      Meshes drawn with DrawMesh every frame (1000)\n"
+        "  --gpu-driven       Build the DrawMesh draws on the GPU with indirect count draws\n"
+        "  --camera-motion    Sway and turn the camera a little every frame\n"
+        "  --csv <path>       Write the time of every measured frame\n"
+        "  --screenshot <path> Write the last frame as a binary PPM\n"
+        "  --gpu-trace <path> Write the GPU passes of the measured frames as Chrome trace JSON\n"
+        "  --cpu-trace <path> Write the CPU zones of the measured frames as Chrome trace JSON, needs ENABLE_PROFILING\n");
+}
+
+static bool ParseOptions(int argc, char** argv, BenchmarkOptions& outOptions) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (strcmp(arg, "--help") == 0) {
+            return false;
+        }
+        if (strcmp(arg, "--gpu-driven") == 0) {
+            outOptions.gpuDriven = true;
+            continue;
+        }
+        if (strcmp(arg, "--camera-motion") == 0) {
+            outOptions.cameraMotion = true;
+            continue;
+        }
+        if (value == nullptr) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return false;
+        }
+
+        if (strcmp(arg, "--width") == 0) {
+            outOptions.width = (u32)atoi(value);
+        }
+        else if (strcmp(arg, "--height") == 0) {
+            outOptions.height = (u32)atoi(value);
+        }
+        else if (strcmp(arg, "--frames") == 0) {
+            outOptions.frames = (u32)atoi(value);
+        }
+        else if (strcmp(arg, "--warmup") == 0) {
+            outOptions.warmupFrames = (u32)atoi(value);
+        }
+        else if (strcmp(arg, "--static") == 0) {
+            outOptions.staticObjects = (u32)atoi(value);
+        }
+        else if (strcmp(arg, "--dynamic") == 0) {
+            outOptions.dynamicObjects = (u32)atoi(value);
+        }
+        else if (strcmp(arg, "--csv") == 0) {
+            outOptions.csvPath = value;
+        }
+        else if (strcmp(arg, "--screenshot") == 0) {
+            outOptions.screenshotPath = value;
+        }
+        else if (strcmp(arg, "--gpu-trace") == 0) {
+            outOptions.gpuTracePath = value;
+        }
+        else if (strcmp(arg, "--cpu-trace") == 0) {
+#ifdef ENABLE_PROFILING
+            outOptions.cpuTracePath = value;
+#else
+            fprintf(stderr, "--cpu-trace needs a build with ENABLE_PROFILING\n");
+            return false;
+#endif
+        }
+        else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            return false;
+        }
+        i++;
+    }
+
+    if (outOptions.width == 0 || outOptions.height == 0 || outOptions.frames == 0) {
+        fprintf(stderr, "Width, height and frames have to be at least 1\n");
+        return false;
+    }
+    // GPU-driven draws skip the sort, so they aren't limited by the drawcall key
+    const u32 maxDynamicObjects = outOptions.gpuDriven ? Rendering::maxInstanceCount : Rendering::maxDrawcallCount;
+    if (outOptions.staticObjects > Rendering::maxRenderObjectCount || outOptions.dynamicObjects > maxDynamicObjects) {
+        fprintf(stderr, "At most %u static and %u dynamic objects\n", Rendering::maxRenderObjectCount, maxDynamicObjects);
+        return false;
+    }
+    return true;
+}
+
+// Nearest rank, so every reported value is a frame that actually happened
+static FrameTimeSummary Summarize(std::vector<r64> times) {
+    FrameTimeSummary summary{};
+    summary.count = (u32)times.size();
+    if (times.empty()) {
+        return summary;
+    }
+
+    std::sort(times.begin(), times.end());
+    r64 total = 0.0;
+    for (r64 time : times) {
+        total += time;
+    }
+
+    auto percentile = [&](r64 p) {
+        u32 rank = (u32)ceil(p * times.size());
+        return times[rank > 0 ? rank - 1 : 0];
+    };
+
+    summary.mean = total / times.size();
+    summary.min = times.front();
+    summary.median = percentile(0.5);
+    summary.p95 = percentile(0.95);
+    summary.p99 = percentile(0.99);
+    summary.max = times.back();
+    return summary;
+}
+
+static void PrintSummary(const char* name, const FrameTimeSummary& summary) {
+    if (summary.count == 0) {
+        printf("%-4s  not available\n", name);
+        return;
+    }
+    printf("%-4s  mean %8.3f  min %8.3f  median %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f  ms (%u frames)\n",
+        name, summary.mean, summary.min, summary.median, summary.p95, summary.p99, summary.max, summary.count);
+}
+
+static void PrintFrameStats(const Rendering::FrameStats& stats) {
+    static const char* categoryNames[Rendering::GPU_MEMORY_CATEGORY_COUNT] = {
+        "meshes", "shared geometry", "textures", "attachments", "frame data", "staging"
+    };
+
+    printf("Last frame: %u instances submitted, %u culled, %u drawn\n", stats.instancesSubmitted, stats.instancesCulled, stats.instancesDrawn);
+    printf("  %u draws, %u indirect draws, %u pipeline, %u descriptor set, %u vertex buffer and %u index buffer binds\n",
+        stats.drawcalls, stats.indirectDrawcalls, stats.pipelineBinds, stats.descriptorSetBinds, stats.vertexBufferBinds, stats.indexBufferBinds);
+    printf("  %.1f KiB of uniforms and %.1f KiB of instance data written\n", stats.uniformBytesWritten / 1024.0, stats.instanceBytesWritten / 1024.0);
+    for (u32 i = 0; i < Rendering::GPU_MEMORY_CATEGORY_COUNT; i++) {
+        printf("  %-16s %8.2f MiB\n", categoryNames[i], stats.memoryBytes[i] / (1024.0 * 1024.0));
+    }
+}
+
+static bool WriteScreenshot(const char* path, const u8* bgra, u32 width, u32 height) {
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    std::vector<u8> row(width * 3);
+    for (u32 y = 0; y < height; y++) {
+        const u8* src = bgra + (size_t)y * width * 4;
+        for (u32 x = 0; x < width; x++) {
+            row[x * 3 + 0] = src[x * 4 + 2];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 0];
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Positions on a cube shaped grid in front of the camera, the same for every run
+static glm::vec3 GridPosition(u32 index, u32 side, r32 spacing) {
+    const u32 x = index % side;
+    const u32 y = (index / side) % side;
+    const u32 z = index / (side * side);
+    const r32 offset = (side - 1) * spacing * 0.5f;
+    return { x * spacing - offset, y * spacing - offset, -(z * spacing) };
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    if (!ParseOptions(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    Rendering::Renderer renderer(options.width, options.height);
+
+    Rendering::MeshCreateInfo cubeInfo{};
+    cubeInfo.layout = options.gpuDriven ? Rendering::VERTEX_LAYOUT_PACKED : Rendering::VERTEX_LAYOUT_SEPARATE;
+    glm::vec3 cubeVerts[] = {
+        {-1,-1,-1},
+        {1,-1,-1},
+        {1,-1,1},
+        {-1,-1,1},
+        {-1,1,-1},
+        {1,1,-1},
+        {1,1,1},
+        {-1,1,1}
+    };
+    Rendering::Color cubeColors[] = {
+        {0,0,0,1},
+        {1,0,0,1},
+        {1,0,1,1},
+        {0,0,1,1},
+        {0,1,0,1},
+        {1,1,0,1},
+        {1,1,1,1},
+        {0,1,1,1}
+    };
+    cubeInfo.vertexCount = 8;
+    cubeInfo.position = cubeVerts;
+    cubeInfo.color = cubeColors;
+    Rendering::Triangle tris[] = {
+        {0,2,1},
+        {0,3,2},
+        {3,7,6},
+        {3,6,2},
+        {6,5,2},
+        {2,5,1},
+        {5,0,1},
+        {5,4,0},
+        {4,7,0},
+        {7,3,0},
+        {7,4,6},
+        {4,5,6}
+    };
+    cubeInfo.triangleCount = 12;
+    cubeInfo.triangles = tris;
+
+    Rendering::MeshHandle cubeMesh = renderer.CreateMesh("Cube", cubeInfo);
+
+    Rendering::ShaderDataLayout shaderLayout{};
+    shaderLayout.dataSize = 0;
+    shaderLayout.propertyCount = 0;
+
+    Rendering::ShaderCreateInfo shaderInfo{};
+    shaderInfo.metadata.layer = Rendering::RENDER_LAYER_OPAQUE;
+    shaderInfo.metadata.dataLayout = shaderLayout;
+    shaderInfo.vertexInputs = (Rendering::VertexAttribFlags)(Rendering::VERTEX_POSITION_BIT | Rendering::VERTEX_COLOR_BIT);
+    shaderInfo.vertexLayout = cubeInfo.layout;
+    shaderInfo.samplerCount = 0;
+    shaderInfo.vert = options.gpuDriven ? "shaders/vert_packed.spv" : "shaders/vert.spv";
+    shaderInfo.frag = "shaders/test_frag.spv";
+
+    Rendering::ShaderHandle shader = renderer.CreateShader("TestShader", shaderInfo);
+
+    Rendering::MaterialCreateInfo matInfo{};
+    matInfo.metadata.shader = shader;
+    matInfo.metadata.castShadows = true;
+
+    Rendering::MaterialHandle material = renderer.CreateMaterial("TestMat", matInfo);
+    renderer.SetGpuDrivenRendering(options.gpuDriven);
+
+    // Static objects first, the dynamic ones take the grid positions after them
+    const r32 spacing = 4.0f;
+    const u32 totalObjects = options.staticObjects + options.dynamicObjects;
+    const u32 side = (u32)ceil(cbrt((r64)(totalObjects > 0 ? totalObjects : 1)));
+
+    for (u32 i = 0; i < options.staticObjects; i++) {
+        Rendering::Transform transform = {
+            GridPosition(i, side, spacing),
+            Quaternion::AngleAxis(glm::radians((r32)(i * 37 % 360)), { 0,1,0 }),
+            {1,1,1}
+        };
+        renderer.CreateRenderObject(cubeMesh, material, transform);
+    }
+
+    std::vector<glm::vec3> dynamicPositions(options.dynamicObjects);
+    for (u32 i = 0; i < options.dynamicObjects; i++) {
+        dynamicPositions[i] = GridPosition(options.staticObjects + i, side, spacing);
+    }
+
+    const r32 gridDepth = side * spacing;
+    Rendering::Transform camTransform = {
+        {0,0,gridDepth * 0.25f + 10.0f},
+        Quaternion::Identity(),
+        {1,1,1}
+    };
+    renderer.UpdateCamera(camTransform, 60.0f, 0.1f, gridDepth * 1.5f + 20.0f);
+
+    std::vector<r64> cpuTimes;
+    std::vector<r64> gpuTimes;
+    cpuTimes.reserve(options.frames);
+    gpuTimes.reserve(options.frames);
+
+    const u32 frameCount = options.warmupFrames + options.frames;
+    auto measureStart = std::chrono::steady_clock::now();
+
+    for (u32 frame = 0; frame < frameCount; frame++) {
+        if (frame == options.warmupFrames) {
+            measureStart = std::chrono::steady_clock::now();
+            if (options.gpuTracePath != nullptr) {
+                renderer.StartGpuTrace();
+            }
+#ifdef ENABLE_PROFILING
+            if (options.cpuTracePath != nullptr) {
+                ProfilerStartCapture();
+            }
+#endif
+        }
+
+        // Fixed time step, so every run draws exactly the same frames
+        const auto frameStart = std::chrono::steady_clock::now();
+        const r32 angle = glm::radians(frame * 3.0f);
+        if (options.cameraMotion) {
+            // About 0.1 units and 0.3 degrees per frame, like a slowly walking player looking around
+            Rendering::Transform movedCamera = camTransform;
+            movedCamera.position.x += std::sin(frame * 0.02f) * 5.0f;
+            movedCamera.rotation = Quaternion::AngleAxis(std::sin(frame * 0.01f) * glm::radians(30.0f), { 0,1,0 });
+            renderer.UpdateCamera(movedCamera, 60.0f, 0.1f, gridDepth * 1.5f + 20.0f);
+        }
+        for (u32 i = 0; i < options.dynamicObjects; i++) {
+            Rendering::Transform transform = {
+                dynamicPositions[i],
+                Quaternion::AngleAxis(angle + i, { 0,1,0 }),
+                {1,1,1}
+            };
+            renderer.DrawMesh(cubeMesh, material, transform);
+        }
+        renderer.Render();
+        const auto frameEnd = std::chrono::steady_clock::now();
+
+        if (frame < options.warmupFrames) {
+            continue;
+        }
+
+        cpuTimes.push_back(std::chrono::duration<r64, std::milli>(frameEnd - frameStart).count());
+        // Lags a few frames behind, the warmup makes sure these aren't the first frames' times
+        const r64 gpuTime = renderer.GetGpuFrameMilliseconds();
+        if (gpuTime >= 0.0) {
+            gpuTimes.push_back(gpuTime);
+        }
+    }
+
+    const r64 measuredSeconds = std::chrono::duration<r64>(std::chrono::steady_clock::now() - measureStart).count();
+#ifdef ENABLE_PROFILING
+    if (options.cpuTracePath != nullptr) {
+        ProfilerStopCapture();
+    }
+#endif
+
+    printf("%ux%u, %u static + %u dynamic objects%s%s, %u frames after %u warmup\n",
+        options.width, options.height, options.staticObjects, options.dynamicObjects, options.gpuDriven ? " (GPU-driven)" : "", options.cameraMotion ? ", moving camera" : "", options.frames, options.warmupFrames);
+    PrintSummary("CPU", Summarize(cpuTimes));
+    PrintSummary("GPU", Summarize(gpuTimes));
+    printf("%.1f frames per second\n", options.frames / measuredSeconds);
+
+    // Rolling window, so these cover the last frames rather than the whole run
+    std::vector<Rendering::GpuZoneStats> zones;
+    renderer.GetGpuProfile(zones);
+    for (const Rendering::GpuZoneStats& zone : zones) {
+        printf("  %-22s mean %8.3f  median %8.3f  p95 %8.3f  p99 %8.3f  max %8.3f  ms (last %u frames)\n",
+            zone.name, zone.averageMilliseconds, zone.medianMilliseconds, zone.p95Milliseconds, zone.p99Milliseconds, zone.maxMilliseconds, zone.sampleCount);
+    }
+    PrintFrameStats(renderer.GetFrameStats());
+
+    if (options.gpuTracePath != nullptr && !renderer.StopGpuTrace(options.gpuTracePath)) {
+        fprintf(stderr, "Couldn't write %s\n", options.gpuTracePath);
+        return 1;
+    }
+#ifdef ENABLE_PROFILING
+    if (options.cpuTracePath != nullptr && !ProfilerWriteTrace(options.cpuTracePath)) {
+        fprintf(stderr, "Couldn't write %s\n", options.cpuTracePath);
+        return 1;
+    }
+#endif
+
+    if (options.csvPath != nullptr) {
+        FILE* file = fopen(options.csvPath, "w");
+        if (file == nullptr) {
+            fprintf(stderr, "Couldn't open %s\n", options.csvPath);
+            return 1;
+        }
+        // GPU times trail the CPU times by the frames in flight, they're listed in the order they came in
+        fprintf(file, "frame,cpu_ms,gpu_ms\n");
+        for (u32 i = 0; i < cpuTimes.size(); i++) {
+            if (i < gpuTimes.size()) {
+                fprintf(file, "%u,%.4f,%.4f\n", i, cpuTimes[i], gpuTimes[i]);
+            }
+            else {
+                fprintf(file, "%u,%.4f,\n", i, cpuTimes[i]);
+            }
+        }
+        fclose(file);
+    }
+
+    if (options.screenshotPath != nullptr) {
+        std::vector<u8> pixels((size_t)options.width * options.height * 4);
+        renderer.ReadbackFrame(pixels.data());
+        if (!WriteScreenshot(options.screenshotPath, pixels.data(), options.width, options.height)) {
+            fprintf(stderr, "Couldn't write %s\n", options.screenshotPath);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,430 @@
+#include "bvh.h"
+#include "system.h"
+#include "math.h"
+
+namespace Rendering {
+	static AABB Union(const AABB& a, const AABB& b) {
+		return { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+	}
+
+	// Half the surface area, enough to compare insertion costs
+	static r32 Perimeter(const AABB& bounds) {
+		const glm::vec3 d = bounds.max - bounds.min;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	static bool Contains(const AABB& outer, const AABB& inner) {
+		return glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max));
+	}
+
+	static bool Overlaps(const AABB& a, const AABB& b) {
+		return glm::all(glm::lessThanEqual(a.min, b.max)) && glm::all(glm::greaterThanEqual(a.max, b.min));
+	}
+
+	// Slab test, returns the entry distance
+	static bool IntersectRay(const AABB& bounds, const glm::vec3& origin, const glm::vec3& invDirection, r32 maxDistance, r32& outDistance) {
+		const glm::vec3 t0 = (bounds.min - origin) * invDirection;
+		const glm::vec3 t1 = (bounds.max - origin) * invDirection;
+		const glm::vec3 tMin = glm::min(t0, t1);
+		const glm::vec3 tMax = glm::max(t0, t1);
+
+		const r32 enter = MAX(MAX(tMin.x, tMin.y), MAX(tMin.z, 0.0f));
+		const r32 exit = MIN(MIN(tMax.x, tMax.y), MIN(tMax.z, maxDistance));
+		outDistance = enter;
+		return enter <= exit;
+	}
+
+	AABB TransformAABB(const AABB& bounds, const glm::mat4& transform) {
+		const glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+		const glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+
+		const glm::vec3 newCenter = glm::vec3(transform * glm::vec4(center, 1.0f));
+		const glm::mat3 absRotation = glm::mat3(glm::abs(glm::vec3(transform[0])), glm::abs(glm::vec3(transform[1])), glm::abs(glm::vec3(transform[2])));
+		const glm::vec3 newExtent = absRotation * extent;
+
+		return { newCenter - newExtent, newCenter + newExtent };
+	}
+
+	Bvh::Bvh() {
+		root = -1;
+		freeList = -1;
+		leafCount = 0;
+	}
+
+	s32 Bvh::Insert(const AABB& bounds, u32 userData) {
+		const s32 leaf = AllocateNode();
+		Node& node = nodes[leaf];
+		node.bounds = { bounds.min - glm::vec3(fatMargin), bounds.max + glm::vec3(fatMargin) };
+		node.leafBounds = bounds;
+		node.userData = userData;
+		node.height = 0;
+
+		InsertLeaf(leaf);
+		leafCount++;
+		return leaf;
+	}
+
+	void Bvh::Remove(s32 leaf) {
+		if (leaf < 0 || leaf >= (s32)nodes.size() || !nodes[leaf].IsLeaf() || nodes[leaf].height < 0) {
+			DEBUG_ERROR("Invalid BVH leaf (%d)", leaf);
+		}
+
+		RemoveLeaf(leaf);
+		FreeNode(leaf);
+		leafCount--;
+	}
+
+	bool Bvh::Update(s32 leaf, const AABB& bounds) {
+		nodes[leaf].leafBounds = bounds;
+		if (Contains(nodes[leaf].bounds, bounds)) {
+			return false;
+		}
+
+		RemoveLeaf(leaf);
+		nodes[leaf].bounds = { bounds.min - glm::vec3(fatMargin), bounds.max + glm::vec3(fatMargin) };
+		InsertLeaf(leaf);
+		return true;
+	}
+
+	void Bvh::QueryFrustum(const Frustum& frustum, std::vector<u32>& outUserData) const {
+		if (root < 0) {
+			return;
+		}
+
+		s32 stack[maxStackSize];
+		u32 stackSize = 0;
+		stack[stackSize++] = root;
+		while (stackSize > 0) {
+			const s32 index = stack[--stackSize];
+			const Node& node = nodes[index];
+
+			const FrustumTestResult result = TestFrustumAABB(frustum, node.bounds.min, node.bounds.max);
+			if (result == FRUSTUM_OUTSIDE) {
+				continue;
+			}
+
+			if (result == FRUSTUM_INSIDE || node.IsLeaf()) {
+				CollectLeaves(index, outUserData);
+			}
+			else {
+				stack[stackSize++] = node.children[0];
+				stack[stackSize++] = node.children[1];
+			}
+		}
+	}
+
+	void Bvh::QueryAABB(const AABB& bounds, std::vector<u32>& outUserData) const {
+		if (root < 0) {
+			return;
+		}
+
+		s32 stack[maxStackSize];
+		u32 stackSize = 0;
+		stack[stackSize++] = root;
+		while (stackSize > 0) {
+			const Node& node = nodes[stack[--stackSize]];
+			if (!Overlaps(node.bounds, bounds)) {
+				continue;
+			}
+
+			if (node.IsLeaf()) {
+				if (Overlaps(node.leafBounds, bounds)) {
+					outUserData.push_back(node.userData);
+				}
+			}
+			else {
+				stack[stackSize++] = node.children[0];
+				stack[stackSize++] = node.children[1];
+			}
+		}
+	}
+
+	bool Bvh::Raycast(const glm::vec3& origin, const glm::vec3& direction, r32 maxDistance, u32& outUserData, r32& outDistance) const {
+		if (root < 0) {
+			return false;
+		}
+
+		const glm::vec3 invDirection = 1.0f / direction;
+		r32 closest = maxDistance;
+		bool hit = false;
+
+		s32 stack[maxStackSize];
+		u32 stackSize = 0;
+		stack[stackSize++] = root;
+		while (stackSize > 0) {
+			const Node& node = nodes[stack[--stackSize]];
+
+			// Anything further than the closest hit so far can be skipped
+			r32 distance;
+			if (!IntersectRay(node.bounds, origin, invDirection, closest, distance)) {
+				continue;
+			}
+
+			if (node.IsLeaf()) {
+				// The fattened box only says the ray gets close
+				if (!IntersectRay(node.leafBounds, origin, invDirection, closest, distance)) {
+					continue;
+				}
+				closest = distance;
+				outUserData = node.userData;
+				hit = true;
+				continue;
+			}
+
+			// Visit the nearer child first, so that it can prune the other one
+			r32 distance0, distance1;
+			const bool hit0 = IntersectRay(nodes[node.children[0]].bounds, origin, invDirection, closest, distance0);
+			const bool hit1 = IntersectRay(nodes[node.children[1]].bounds, origin, invDirection, closest, distance1);
+			if (hit0 && hit1) {
+				const bool firstNearer = distance0 <= distance1;
+				stack[stackSize++] = node.children[firstNearer ? 1 : 0];
+				stack[stackSize++] = node.children[firstNearer ? 0 : 1];
+			}
+			else if (hit0) {
+				stack[stackSize++] = node.children[0];
+			}
+			else if (hit1) {
+				stack[stackSize++] = node.children[1];
+			}
+		}
+
+		outDistance = closest;
+		return hit;
+	}
+
+	u32 Bvh::LeafCount() const {
+		return leafCount;
+	}
+
+	s32 Bvh::Height() const {
+		return root < 0 ? 0 : nodes[root].height;
+	}
+
+	s32 Bvh::AllocateNode() {
+		if (freeList < 0) {
+			nodes.push_back({});
+			freeList = (s32)nodes.size() - 1;
+			nodes[freeList].parent = -1;
+		}
+
+		const s32 index = freeList;
+		Node& node = nodes[index];
+		freeList = node.parent;
+		node.parent = -1;
+		node.children[0] = -1;
+		node.children[1] = -1;
+		node.height = 0;
+		node.userData = 0;
+		return index;
+	}
+
+	void Bvh::FreeNode(s32 index) {
+		nodes[index].parent = freeList;
+		nodes[index].height = -1;
+		freeList = index;
+	}
+
+	void Bvh::InsertLeaf(s32 leaf) {
+		if (root < 0) {
+			root = leaf;
+			nodes[root].parent = -1;
+			return;
+		}
+
+		// Walk down to the sibling with the lowest surface area cost
+		const AABB leafBounds = nodes[leaf].bounds;
+		s32 index = root;
+		while (!nodes[index].IsLeaf()) {
+			const Node& node = nodes[index];
+			const r32 area = Perimeter(node.bounds);
+			const r32 combinedArea = Perimeter(Union(node.bounds, leafBounds));
+
+			// Cost of pairing the leaf with this node, and of pushing it further down
+			const r32 cost = 2.0f * combinedArea;
+			const r32 inheritanceCost = 2.0f * (combinedArea - area);
+
+			r32 childCosts[2];
+			for (u32 i = 0; i < 2; i++) {
+				const Node& child = nodes[node.children[i]];
+				const r32 childArea = Perimeter(Union(leafBounds, child.bounds));
+				childCosts[i] = (child.IsLeaf() ? childArea : childArea - Perimeter(child.bounds)) + inheritanceCost;
+			}
+
+			if (cost < childCosts[0] && cost < childCosts[1]) {
+				break;
+			}
+
+			index = childCosts[0] < childCosts[1] ? node.children[0] : node.children[1];
+		}
+
+		const s32 sibling = index;
+		const s32 oldParent = nodes[sibling].parent;
+		const s32 newParent = AllocateNode();
+		nodes[newParent].parent = oldParent;
+		nodes[newParent].bounds = Union(leafBounds, nodes[sibling].bounds);
+		nodes[newParent].height = nodes[sibling].height + 1;
+		nodes[newParent].children[0] = sibling;
+		nodes[newParent].children[1] = leaf;
+		nodes[sibling].parent = newParent;
+		nodes[leaf].parent = newParent;
+
+		if (oldParent >= 0) {
+			Node& parent = nodes[oldParent];
+			parent.children[parent.children[0] == sibling ? 0 : 1] = newParent;
+		}
+		else {
+			root = newParent;
+		}
+
+		RefitAncestors(nodes[leaf].parent);
+	}
+
+	void Bvh::RemoveLeaf(s32 leaf) {
+		if (leaf == root) {
+			root = -1;
+			return;
+		}
+
+		const s32 parent = nodes[leaf].parent;
+		const s32 grandParent = nodes[parent].parent;
+		const s32 sibling = nodes[parent].children[nodes[parent].children[0] == leaf ? 1 : 0];
+
+		// The sibling takes the parent's place
+		if (grandParent >= 0) {
+			Node& grandParentNode = nodes[grandParent];
+			grandParentNode.children[grandParentNode.children[0] == parent ? 0 : 1] = sibling;
+			nodes[sibling].parent = grandParent;
+			FreeNode(parent);
+			RefitAncestors(grandParent);
+		}
+		else {
+			root = sibling;
+			nodes[sibling].parent = -1;
+			FreeNode(parent);
+		}
+	}
+
+	void Bvh::RefitAncestors(s32 index) {
+		while (index >= 0) {
+			index = Balance(index);
+
+			Node& node = nodes[index];
+			const Node& child0 = nodes[node.children[0]];
+			const Node& child1 = nodes[node.children[1]];
+			node.height = 1 + MAX(child0.height, child1.height);
+			node.bounds = Union(child0.bounds, child1.bounds);
+
+			index = node.parent;
+		}
+	}
+
+	// Rotates the taller child up if the children's heights differ by more than one, returns the node now in its place
+	s32 Bvh::Balance(s32 iA) {
+		Node& a = nodes[iA];
+		if (a.IsLeaf() || a.height < 2) {
+			return iA;
+		}
+
+		const s32 iB = a.children[0];
+		const s32 iC = a.children[1];
+		Node& b = nodes[iB];
+		Node& c = nodes[iC];
+		const s32 balance = c.height - b.height;
+
+		if (balance > 1) {
+			const s32 iF = c.children[0];
+			const s32 iG = c.children[1];
+			Node& f = nodes[iF];
+			Node& g = nodes[iG];
+
+			c.children[0] = iA;
+			c.parent = a.parent;
+			a.parent = iC;
+			if (c.parent >= 0) {
+				Node& parent = nodes[c.parent];
+				parent.children[parent.children[0] == iA ? 0 : 1] = iC;
+			}
+			else {
+				root = iC;
+			}
+
+			if (f.height > g.height) {
+				c.children[1] = iF;
+				a.children[1] = iG;
+				g.parent = iA;
+				a.bounds = Union(b.bounds, g.bounds);
+				c.bounds = Union(a.bounds, f.bounds);
+				a.height = 1 + MAX(b.height, g.height);
+				c.height = 1 + MAX(a.height, f.height);
+			}
+			else {
+				c.children[1] = iG;
+				a.children[1] = iF;
+				f.parent = iA;
+				a.bounds = Union(b.bounds, f.bounds);
+				c.bounds = Union(a.bounds, g.bounds);
+				a.height = 1 + MAX(b.height, f.height);
+				c.height = 1 + MAX(a.height, g.height);
+			}
+
+			return iC;
+		}
+
+		if (balance < -1) {
+			const s32 iD = b.children[0];
+			const s32 iE = b.children[1];
+			Node& d = nodes[iD];
+			Node& e = nodes[iE];
+
+			b.children[0] = iA;
+			b.parent = a.parent;
+			a.parent = iB;
+			if (b.parent >= 0) {
+				Node& parent = nodes[b.parent];
+				parent.children[parent.children[0] == iA ? 0 : 1] = iB;
+			}
+			else {
+				root = iB;
+			}
+
+			if (d.height > e.height) {
+				b.children[1] = iD;
+				a.children[0] = iE;
+				e.parent = iA;
+				a.bounds = Union(c.bounds, e.bounds);
+				b.bounds = Union(a.bounds, d.bounds);
+				a.height = 1 + MAX(c.height, e.height);
+				b.height = 1 + MAX(a.height, d.height);
+			}
+			else {
+				b.children[1] = iE;
+				a.children[0] = iD;
+				d.parent = iA;
+				a.bounds = Union(c.bounds, d.bounds);
+				b.bounds = Union(a.bounds, e.bounds);
+				a.height = 1 + MAX(c.height, d.height);
+				b.height = 1 + MAX(a.height, e.height);
+			}
+
+			return iB;
+		}
+
+		return iA;
+	}
+
+	void Bvh::CollectLeaves(s32 index, std::vector<u32>& outUserData) const {
+		s32 stack[maxStackSize];
+		u32 stackSize = 0;
+		stack[stackSize++] = index;
+		while (stackSize > 0) {
+			const Node& node = nodes[stack[--stackSize]];
+			if (node.IsLeaf()) {
+				outUserData.push_back(node.userData);
+			}
+			else {
+				stack[stackSize++] = node.children[0];
+				stack[stackSize++] = node.children[1];
+			}
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "culling.h"
+#include <vector>
+
+namespace Rendering {
+	struct AABB {
+		glm::vec3 min;
+		glm::vec3 max;
+	};
+
+	// Bounds of the box after transforming it, still axis aligned
+	AABB TransformAABB(const AABB& bounds, const glm::mat4& transform);
+
+	// Dynamic AABB tree over objects that move, are added and removed at runtime.
+	// Leaves store a fattened box, so small movements don't touch the tree at all. Bigger ones reinsert the leaf,
+	// refitting and rebalancing its ancestors on the way back up, which keeps the tree height logarithmic.
+	class Bvh {
+	public:
+		Bvh();
+
+		s32 Insert(const AABB& bounds, u32 userData);
+		void Remove(s32 leaf);
+		// Returns true if the leaf had to be moved
+		bool Update(s32 leaf, const AABB& bounds);
+
+		// Subtrees that are fully inside are collected without testing any further
+		void QueryFrustum(const Frustum& frustum, std::vector<u32>& outUserData) const;
+		void QueryAABB(const AABB& bounds, std::vector<u32>& outUserData) const;
+		// Queries descend through the fattened boxes but only report leaves whose exact box overlaps or is hit
+		// Nearest leaf box hit by the ray, boxes that contain the origin are hit at distance 0
+		bool Raycast(const glm::vec3& origin, const glm::vec3& direction, r32 maxDistance, u32& outUserData, r32& outDistance) const;
+
+		u32 LeafCount() const;
+		s32 Height() const;
+	private:
+		static constexpr r32 fatMargin = 0.1f;
+		static constexpr u32 maxStackSize = 128; // Balanced trees stay far below this
+
+		struct Node {
+			AABB bounds; // Fattened for leaves
+			AABB leafBounds; // Exact bounds passed in, only set for leaves
+			s32 parent; // Next free node if the node is free
+			s32 children[2]; // -1 for leaves
+			s32 height; // 0 for leaves, -1 for free nodes
+			u32 userData;
+
+			bool IsLeaf() const {
+				return children[0] < 0;
+			}
+		};
+
+		s32 AllocateNode();
+		void FreeNode(s32 node);
+		void InsertLeaf(s32 leaf);
+		void RemoveLeaf(s32 leaf);
+		s32 Balance(s32 node);
+		void RefitAncestors(s32 node);
+		void CollectLeaves(s32 node, std::vector<u32>& outUserData) const;
+
+		std::vector<Node> nodes;
+		s32 root;
+		s32 freeList;
+		u32 leafCount;
+	};
+}
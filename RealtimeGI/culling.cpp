@@ -0,0 +1,139 @@
+#include "culling.h"
+#include <emmintrin.h>
+#include <cmath>
+
+namespace Rendering {
+	Frustum ExtractFrustum(const glm::mat4& viewProj) {
+		// Rows of the matrix, glm is column major
+		const glm::vec4 row0(viewProj[0][0], viewProj[1][0], viewProj[2][0], viewProj[3][0]);
+		const glm::vec4 row1(viewProj[0][1], viewProj[1][1], viewProj[2][1], viewProj[3][1]);
+		const glm::vec4 row2(viewProj[0][2], viewProj[1][2], viewProj[2][2], viewProj[3][2]);
+		const glm::vec4 row3(viewProj[0][3], viewProj[1][3], viewProj[2][3], viewProj[3][3]);
+
+		Frustum frustum;
+		frustum.planes[0] = row3 + row0;
+		frustum.planes[1] = row3 - row0;
+		frustum.planes[2] = row3 + row1;
+		frustum.planes[3] = row3 - row1;
+		frustum.planes[4] = row2;
+		frustum.planes[5] = row3 - row2;
+
+		for (u32 i = 0; i < 6; i++) {
+			frustum.planes[i] /= glm::length(glm::vec3(frustum.planes[i]));
+		}
+
+		return frustum;
+	}
+
+	MeshBounds ComputeMeshBounds(const glm::vec3* positions, u32 vertexCount) {
+		MeshBounds bounds{};
+		if (positions == nullptr || vertexCount == 0) {
+			bounds.radius = INFINITY;
+			bounds.aabbMin = glm::vec3(-INFINITY);
+			bounds.aabbMax = glm::vec3(INFINITY);
+			return bounds;
+		}
+
+		bounds.aabbMin = positions[0];
+		bounds.aabbMax = positions[0];
+		for (u32 i = 1; i < vertexCount; i++) {
+			bounds.aabbMin = glm::min(bounds.aabbMin, positions[i]);
+			bounds.aabbMax = glm::max(bounds.aabbMax, positions[i]);
+		}
+
+		// Tighter than half the diagonal for most meshes
+		bounds.center = (bounds.aabbMin + bounds.aabbMax) * 0.5f;
+		r32 radiusSqr = 0.0f;
+		for (u32 i = 0; i < vertexCount; i++) {
+			const glm::vec3 d = positions[i] - bounds.center;
+			radiusSqr = glm::max(radiusSqr, glm::dot(d, d));
+		}
+		bounds.radius = std::sqrt(radiusSqr);
+
+		return bounds;
+	}
+
+	SphereBoundsSoA AllocSphereBounds(u32 capacity) {
+		SphereBoundsSoA bounds;
+		bounds.x = (r32*)calloc(capacity, sizeof(r32));
+		bounds.y = (r32*)calloc(capacity, sizeof(r32));
+		bounds.z = (r32*)calloc(capacity, sizeof(r32));
+		bounds.radius = (r32*)calloc(capacity, sizeof(r32));
+		return bounds;
+	}
+
+	void FreeSphereBounds(SphereBoundsSoA& bounds) {
+		free(bounds.x);
+		free(bounds.y);
+		free(bounds.z);
+		free(bounds.radius);
+		bounds = {};
+	}
+
+	void CullSpheres(const Frustum& frustum, const SphereBoundsSoA& bounds, u32 count, u8* outVisible) {
+		__m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+		for (u32 p = 0; p < 6; p++) {
+			planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+			planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+			planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+			planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+		}
+
+		const u32 simdCount = count & ~3u;
+		for (u32 i = 0; i < simdCount; i += 4) {
+			const __m128 x = _mm_loadu_ps(bounds.x + i);
+			const __m128 y = _mm_loadu_ps(bounds.y + i);
+			const __m128 z = _mm_loadu_ps(bounds.z + i);
+			const __m128 negRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(bounds.radius + i));
+
+			// A sphere is culled once it's fully behind any plane
+			__m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+			for (u32 p = 0; p < 6; p++) {
+				__m128 dist = _mm_add_ps(_mm_mul_ps(x, planeX[p]), planeW[p]);
+				dist = _mm_add_ps(dist, _mm_mul_ps(y, planeY[p]));
+				dist = _mm_add_ps(dist, _mm_mul_ps(z, planeZ[p]));
+				inside = _mm_and_ps(inside, _mm_cmpge_ps(dist, negRadius));
+			}
+
+			const s32 mask = _mm_movemask_ps(inside);
+			outVisible[i] = mask & 1;
+			outVisible[i + 1] = (mask >> 1) & 1;
+			outVisible[i + 2] = (mask >> 2) & 1;
+			outVisible[i + 3] = (mask >> 3) & 1;
+		}
+
+		for (u32 i = simdCount; i < count; i++) {
+			const glm::vec3 center(bounds.x[i], bounds.y[i], bounds.z[i]);
+			u8 visible = 1;
+			for (u32 p = 0; p < 6; p++) {
+				if (glm::dot(glm::vec3(frustum.planes[p]), center) + frustum.planes[p].w < -bounds.radius[i]) {
+					visible = 0;
+					break;
+				}
+			}
+			outVisible[i] = visible;
+		}
+	}
+
+	FrustumTestResult TestFrustumAABB(const Frustum& frustum, const glm::vec3& aabbMin, const glm::vec3& aabbMax) {
+		const glm::vec3 center = (aabbMin + aabbMax) * 0.5f;
+		const glm::vec3 extent = (aabbMax - aabbMin) * 0.5f;
+
+		FrustumTestResult result = FRUSTUM_INSIDE;
+		for (u32 p = 0; p < 6; p++) {
+			const glm::vec3 normal(frustum.planes[p]);
+			const r32 dist = glm::dot(normal, center) + frustum.planes[p].w;
+			// Half the box's projection onto the plane normal
+			const r32 projectedExtent = glm::dot(extent, glm::abs(normal));
+
+			if (dist < -projectedExtent) {
+				return FRUSTUM_OUTSIDE;
+			}
+			if (dist < projectedExtent) {
+				result = FRUSTUM_INTERSECTS;
+			}
+		}
+
+		return result;
+	}
+}
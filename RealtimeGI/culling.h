@@ -0,0 +1,50 @@
+#pragma once
+#include "rendering.h"
+
+namespace Rendering {
+	// Planes point inwards and are normalized, so a point is inside when dot(plane.xyz, p) + plane.w >= 0 for all of them
+	struct Frustum {
+		glm::vec4 planes[6]; // Left, right, bottom, top, near, far
+	};
+
+	struct MeshBounds {
+		glm::vec3 center; // Center of the AABB, also the center of the sphere
+		r32 radius;
+		glm::vec3 aabbMin;
+		glm::vec3 aabbMax;
+	};
+
+	enum FrustumTestResult {
+		FRUSTUM_OUTSIDE,
+		FRUSTUM_INTERSECTS,
+		FRUSTUM_INSIDE
+	};
+
+	// Structure of arrays, so that four spheres can be tested at once
+	struct SphereBoundsSoA {
+		r32* x;
+		r32* y;
+		r32* z;
+		r32* radius;
+	};
+
+	// Expects a [0, 1] depth range
+	Frustum ExtractFrustum(const glm::mat4& viewProj);
+	// Meshes without positions get infinite bounds, so they're never culled
+	MeshBounds ComputeMeshBounds(const glm::vec3* positions, u32 vertexCount);
+
+	SphereBoundsSoA AllocSphereBounds(u32 capacity);
+	void FreeSphereBounds(SphereBoundsSoA& bounds);
+	inline void SetSphereBounds(SphereBoundsSoA& bounds, u32 index, const glm::vec3& center, r32 radius) {
+		bounds.x[index] = center.x;
+		bounds.y[index] = center.y;
+		bounds.z[index] = center.z;
+		bounds.radius[index] = radius;
+	}
+	inline SphereBoundsSoA OffsetSphereBounds(const SphereBoundsSoA& bounds, u32 offset) {
+		return { bounds.x + offset, bounds.y + offset, bounds.z + offset, bounds.radius + offset };
+	}
+	// Writes 1 for spheres that intersect the frustum and 0 for the rest
+	void CullSpheres(const Frustum& frustum, const SphereBoundsSoA& bounds, u32 count, u8* outVisible);
+	FrustumTestResult TestFrustumAABB(const Frustum& frustum, const glm::vec3& aabbMin, const glm::vec3& aabbMax);
+}
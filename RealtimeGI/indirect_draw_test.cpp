@@ -0,0 +1,252 @@
+// Renders the same DrawMesh calls through the CPU path and the GPU-driven path and checks that the compute shader
+// builds the same draws. Needs a device with drawIndirectCount, e.g. lavapipe, and skips that part otherwise.
+// Also checks that DrawMeshInstances culls the same instances as DrawMesh, which runs on any device.
+#include "renderer.h"
+#include "test_harness.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace Rendering;
+
+// Tells CTest the test was skipped, see SKIP_RETURN_CODE in CMakeLists.txt
+static constexpr int skipReturnCode = 77;
+
+struct SceneObject {
+    u32 mesh;
+    u32 material;
+    Transform transform;
+};
+
+static MeshHandle CreateCube(Renderer& renderer) {
+    VertexPos positions[] = { {-1,-1,-1}, {1,-1,-1}, {1,-1,1}, {-1,-1,1}, {-1,1,-1}, {1,1,-1}, {1,1,1}, {-1,1,1} };
+    Color colors[] = { {0,0,0,1}, {1,0,0,1}, {1,0,1,1}, {0,0,1,1}, {0,1,0,1}, {1,1,0,1}, {1,1,1,1}, {0,1,1,1} };
+    Triangle triangles[] = { {0,2,1}, {0,3,2}, {3,7,6}, {3,6,2}, {6,5,2}, {2,5,1}, {5,0,1}, {5,4,0}, {4,7,0}, {7,3,0}, {7,4,6}, {4,5,6} };
+
+    MeshCreateInfo info{};
+    info.layout = VERTEX_LAYOUT_PACKED;
+    info.vertexCount = 8;
+    info.position = positions;
+    info.color = colors;
+    info.triangleCount = 12;
+    info.triangles = triangles;
+    return renderer.CreateMesh("Cube", info);
+}
+
+static MeshHandle CreatePyramid(Renderer& renderer) {
+    VertexPos positions[] = { {-1,-1,-1}, {1,-1,-1}, {1,-1,1}, {-1,-1,1}, {0,1,0} };
+    Color colors[] = { {1,0,0,1}, {0,1,0,1}, {0,0,1,1}, {1,1,0,1}, {1,1,1,1} };
+    Triangle triangles[] = { {0,2,1}, {0,3,2}, {0,1,4}, {1,2,4}, {2,3,4}, {3,0,4} };
+
+    MeshCreateInfo info{};
+    info.layout = VERTEX_LAYOUT_PACKED;
+    info.vertexCount = 5;
+    info.position = positions;
+    info.color = colors;
+    info.triangleCount = 6;
+    info.triangles = triangles;
+    return renderer.CreateMesh("Pyramid", info);
+}
+
+// Around the camera in every direction, so a good part of them is culled
+static std::vector<SceneObject> MakeScene(u32 count) {
+    std::mt19937 rng(count);
+    std::uniform_real_distribution<r32> position(-60.0f, 60.0f);
+    std::vector<SceneObject> objects(count);
+    for (u32 i = 0; i < count; i++) {
+        // Uneven, so that every mesh and material pair ends up with its own instance count
+        objects[i].mesh = i % 3 == 0 ? 1 : 0;
+        objects[i].material = i % 5 == 0 ? 1 : 0;
+        objects[i].transform = { { position(rng), position(rng), position(rng) }, Quaternion::AngleAxis((r32)i, { 0,1,0 }), {1,1,1} };
+    }
+    // Straight ahead, so that even the smallest scene draws something
+    objects[0].transform.position = { 0, 0, -10 };
+    return objects;
+}
+
+static bool SameArguments(const VkDrawIndexedIndirectCommand& a, const VkDrawIndexedIndirectCommand& b) {
+    return a.indexCount == b.indexCount && a.instanceCount == b.instanceCount && a.firstIndex == b.firstIndex && a.vertexOffset == b.vertexOffset;
+}
+
+// The paths put instances in different places, so everything but firstInstance has to match
+static void SortByArguments(std::vector<VkDrawIndexedIndirectCommand>& commands) {
+    std::sort(commands.begin(), commands.end(), [](const VkDrawIndexedIndirectCommand& a, const VkDrawIndexedIndirectCommand& b) {
+        if (a.firstIndex != b.firstIndex) return a.firstIndex < b.firstIndex;
+        if (a.vertexOffset != b.vertexOffset) return a.vertexOffset < b.vertexOffset;
+        if (a.indexCount != b.indexCount) return a.indexCount < b.indexCount;
+        return a.instanceCount < b.instanceCount;
+    });
+}
+
+static u32 InstanceSum(const std::vector<VkDrawIndexedIndirectCommand>& commands) {
+    u32 sum = 0;
+    for (const VkDrawIndexedIndirectCommand& command : commands) {
+        sum += command.instanceCount;
+    }
+    return sum;
+}
+
+// Every command reads its own range of instance indices
+static bool DisjointInstanceRanges(std::vector<VkDrawIndexedIndirectCommand> commands) {
+    std::sort(commands.begin(), commands.end(), [](const VkDrawIndexedIndirectCommand& a, const VkDrawIndexedIndirectCommand& b) { return a.firstInstance < b.firstInstance; });
+    for (size_t i = 1; i < commands.size(); i++) {
+        if (commands[i - 1].firstInstance + commands[i - 1].instanceCount > commands[i].firstInstance) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void RenderScene(Renderer& renderer, const std::vector<SceneObject>& objects, const MeshHandle* meshes, const MaterialHandle* materials,
+    bool gpuDriven, std::vector<VkDrawIndexedIndirectCommand>& outCommands, FrameStats& outStats) {
+    renderer.SetGpuDrivenRendering(gpuDriven);
+    for (const SceneObject& object : objects) {
+        renderer.DrawMesh(meshes[object.mesh], materials[object.material], object.transform);
+    }
+    renderer.Render();
+    renderer.ReadbackDrawCommands(outCommands);
+    outStats = renderer.GetFrameStats();
+}
+
+static void CompareWithCpu(Renderer& renderer, u32 objectCount, const MeshHandle* meshes, const MaterialHandle* materials) {
+    const std::vector<SceneObject> objects = MakeScene(objectCount);
+    std::vector<VkDrawIndexedIndirectCommand> cpuCommands, gpuCommands;
+    FrameStats cpuStats, gpuStats;
+    RenderScene(renderer, objects, meshes, materials, false, cpuCommands, cpuStats);
+    RenderScene(renderer, objects, meshes, materials, true, gpuCommands, gpuStats);
+
+    TEST_CHECK(cpuStats.indirectDrawcalls == 0 && cpuStats.drawcalls > 0, "CPU frame of %u objects recorded %u CPU and %u indirect draws",
+        objectCount, cpuStats.drawcalls, cpuStats.indirectDrawcalls);
+    TEST_CHECK(gpuStats.drawcalls == 0 && gpuStats.indirectDrawcalls > 0, "GPU-driven frame of %u objects recorded %u CPU and %u indirect draws",
+        objectCount, gpuStats.drawcalls, gpuStats.indirectDrawcalls);
+    TEST_CHECK(gpuStats.instancesDrawn == cpuStats.instancesDrawn, "%u objects: %u instances drawn GPU-driven, %u on the CPU",
+        objectCount, gpuStats.instancesDrawn, cpuStats.instancesDrawn);
+    TEST_CHECK(InstanceSum(gpuCommands) == gpuStats.instancesDrawn, "%u objects: GPU commands draw %u instances, %u are visible",
+        objectCount, InstanceSum(gpuCommands), gpuStats.instancesDrawn);
+    TEST_CHECK(DisjointInstanceRanges(gpuCommands), "%u objects: GPU commands share instance indices", objectCount);
+
+    TEST_CHECK(gpuCommands.size() == cpuCommands.size(), "%u objects: %zu GPU commands, %zu CPU draws", objectCount, gpuCommands.size(), cpuCommands.size());
+    if (gpuCommands.size() == cpuCommands.size()) {
+        SortByArguments(cpuCommands);
+        SortByArguments(gpuCommands);
+        u32 mismatches = 0;
+        for (size_t i = 0; i < cpuCommands.size(); i++) {
+            mismatches += !SameArguments(cpuCommands[i], gpuCommands[i]);
+        }
+        TEST_CHECK(mismatches == 0, "%u objects: %u of %zu GPU commands differ from the CPU draws", objectCount, mismatches, cpuCommands.size());
+    }
+    printf("%6u objects: %u visible in %zu draws on both paths\n", objectCount, gpuStats.instancesDrawn, gpuCommands.size());
+}
+
+// More objects than the CPU path can sort, every one of them has to be culled or end up in a command
+static void CheckFullScene(Renderer& renderer, const MeshHandle* meshes, const MaterialHandle* materials) {
+    const u32 objectCount = 100000;
+    const std::vector<SceneObject> objects = MakeScene(objectCount);
+    std::vector<VkDrawIndexedIndirectCommand> commands;
+    FrameStats stats;
+    RenderScene(renderer, objects, meshes, materials, true, commands, stats);
+
+    TEST_CHECK(stats.instancesSubmitted == objectCount, "%u of %u objects were submitted", stats.instancesSubmitted, objectCount);
+    TEST_CHECK(stats.instancesDrawn + stats.instancesCulled == objectCount, "%u drawn and %u culled of %u objects",
+        stats.instancesDrawn, stats.instancesCulled, objectCount);
+    TEST_CHECK(InstanceSum(commands) == stats.instancesDrawn, "GPU commands draw %u instances, %u are visible", InstanceSum(commands), stats.instancesDrawn);
+    TEST_CHECK(DisjointInstanceRanges(commands), "GPU commands of %u objects share instance indices", objectCount);
+    printf("%6u objects: %u visible in %zu GPU-driven draws\n", objectCount, stats.instancesDrawn, commands.size());
+}
+
+// Each mesh gets one batch, so that culled instances have to be compacted within and across batches
+static void CheckInstanceBatches(Renderer& renderer, const MeshHandle* meshes, const MaterialHandle* materials) {
+    const u32 objectCount = 5000;
+    const std::vector<SceneObject> objects = MakeScene(objectCount);
+    std::vector<VkDrawIndexedIndirectCommand> drawMeshCommands, batchCommands;
+    FrameStats drawMeshStats, batchStats;
+    renderer.SetGpuDrivenRendering(false);
+    for (const SceneObject& object : objects) {
+        renderer.DrawMesh(meshes[object.mesh], materials[0], object.transform);
+    }
+    renderer.Render();
+    renderer.ReadbackDrawCommands(drawMeshCommands);
+    drawMeshStats = renderer.GetFrameStats();
+
+    TransformSoA transforms = AllocTransforms(objectCount);
+    for (u32 mesh = 0; mesh < 2; mesh++) {
+        u32 count = 0;
+        for (const SceneObject& object : objects) {
+            if (object.mesh == mesh) {
+                SetTransform(transforms, count++, object.transform);
+            }
+        }
+        renderer.DrawMeshInstances(meshes[mesh], materials[0], transforms, count);
+    }
+    FreeTransforms(transforms);
+    renderer.Render();
+    renderer.ReadbackDrawCommands(batchCommands);
+    batchStats = renderer.GetFrameStats();
+
+    TEST_CHECK(batchStats.instancesSubmitted == objectCount, "%u of %u batched instances were submitted", batchStats.instancesSubmitted, objectCount);
+    TEST_CHECK(batchStats.instancesCulled == drawMeshStats.instancesCulled, "%u batched instances culled, %u with DrawMesh",
+        batchStats.instancesCulled, drawMeshStats.instancesCulled);
+    TEST_CHECK(batchStats.instancesDrawn == drawMeshStats.instancesDrawn, "%u batched instances drawn, %u with DrawMesh",
+        batchStats.instancesDrawn, drawMeshStats.instancesDrawn);
+    TEST_CHECK(InstanceSum(batchCommands) == batchStats.instancesDrawn, "Batch draws cover %u instances, %u are visible",
+        InstanceSum(batchCommands), batchStats.instancesDrawn);
+    TEST_CHECK(DisjointInstanceRanges(batchCommands), "Batch draws share instance indices");
+    printf("%6u batched instances: %u visible in %zu draws\n", objectCount, batchStats.instancesDrawn, batchCommands.size());
+}
+
+// The test is built wherever the loader is found, a machine without any device skips it instead of failing
+static bool HasVulkanDevice() {
+    VkApplicationInfo appInfo{};
+    appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    appInfo.apiVersion = VK_API_VERSION_1_2;
+    VkInstanceCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    createInfo.pApplicationInfo = &appInfo;
+
+    VkInstance instance;
+    if (vkCreateInstance(&createInfo, nullptr, &instance) != VK_SUCCESS) {
+        return false;
+    }
+    u32 deviceCount = 0;
+    vkEnumeratePhysicalDevices(instance, &deviceCount, nullptr);
+    vkDestroyInstance(instance, nullptr);
+    return deviceCount > 0;
+}
+
+int main() {
+    if (!HasVulkanDevice()) {
+        printf("No Vulkan device, skipping\n");
+        return skipReturnCode;
+    }
+
+    Renderer renderer(64, 64);
+    const MeshHandle meshes[] = { CreateCube(renderer), CreatePyramid(renderer) };
+
+    ShaderCreateInfo shaderInfo{};
+    shaderInfo.metadata.layer = RENDER_LAYER_OPAQUE;
+    shaderInfo.vertexInputs = (VertexAttribFlags)(VERTEX_POSITION_BIT | VERTEX_COLOR_BIT);
+    shaderInfo.vertexLayout = VERTEX_LAYOUT_PACKED;
+    shaderInfo.vert = "shaders/vert_packed.spv";
+    shaderInfo.frag = "shaders/test_frag.spv";
+    const ShaderHandle shader = renderer.CreateShader("PackedShader", shaderInfo);
+
+    MaterialCreateInfo materialInfo{};
+    materialInfo.metadata.shader = shader;
+    const MaterialHandle materials[] = { renderer.CreateMaterial("First", materialInfo), renderer.CreateMaterial("Second", materialInfo) };
+
+    renderer.UpdateCamera({ {0,0,0}, Quaternion::Identity(), {1,1,1} }, 60.0f, 0.1f, 200.0f);
+
+    CheckInstanceBatches(renderer, meshes, materials);
+    if (!renderer.SupportsGpuDrivenRendering()) {
+        printf("The device doesn't support indirect count draws, skipping the GPU-driven checks\n");
+        return TestResult();
+    }
+
+    const u32 objectCounts[] = { 1, 100, 5000, 60000 };
+    for (u32 count : objectCounts) {
+        CompareWithCpu(renderer, count, meshes, materials);
+    }
+    CheckFullScene(renderer, meshes, materials);
+
+    return TestResult();
+}
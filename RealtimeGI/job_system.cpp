@@ -0,0 +1,214 @@
+#include "job_system.h"
+#include "profiler.h"
+
+// Which system the current thread belongs to and its index in it, -1 for threads it doesn't know
+static thread_local const JobSystem* currentSystem = nullptr;
+static thread_local s32 currentThreadIndex = -1;
+
+// Everything is sequentially consistent. The owner's store to bottom has to be ordered before its load of top
+// when it takes the last job, and with the weaker orderings that needs fences that are easy to get wrong.
+WorkStealingDeque::WorkStealingDeque() : top(0), bottom(0) {
+	for (u32 i = 0; i < capacity; i++) {
+		jobs[i].store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+bool WorkStealingDeque::Push(Job* job) {
+	const s64 b = bottom.load();
+	const s64 t = top.load();
+	if (b - t >= (s64)capacity) {
+		return false;
+	}
+
+	jobs[b & (capacity - 1)].store(job);
+	bottom.store(b + 1);
+	return true;
+}
+
+Job* WorkStealingDeque::Pop() {
+	// Claim the bottom job first, so that thieves see it's taken
+	const s64 b = bottom.load() - 1;
+	bottom.store(b);
+	s64 t = top.load();
+
+	if (t > b) {
+		// Was already empty
+		bottom.store(b + 1);
+		return nullptr;
+	}
+
+	Job* job = jobs[b & (capacity - 1)].load();
+	if (t == b) {
+		// Last job, a thief might be taking it at the same time
+		if (!top.compare_exchange_strong(t, t + 1)) {
+			job = nullptr;
+		}
+		bottom.store(b + 1);
+	}
+	return job;
+}
+
+Job* WorkStealingDeque::Steal() {
+	s64 t = top.load();
+	const s64 b = bottom.load();
+	if (t >= b) {
+		return nullptr;
+	}
+
+	Job* job = jobs[t & (capacity - 1)].load();
+	// Lost to the owner or another thief
+	if (!top.compare_exchange_strong(t, t + 1)) {
+		return nullptr;
+	}
+	return job;
+}
+
+JobSystem::JobSystem(u32 workerCount) : threadCount(workerCount + 1), queuedJobs(0), stopping(false) {
+	threads = new ThreadData[threadCount];
+	for (u32 i = 0; i < threadCount; i++) {
+		threads[i].stealSeed = 0x9E3779B9u * (i + 1);
+	}
+
+	currentSystem = this;
+	currentThreadIndex = 0;
+	for (u32 i = 1; i < threadCount; i++) {
+		workers.emplace_back(&JobSystem::WorkerLoop, this, i);
+	}
+}
+
+JobSystem::~JobSystem() {
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	wakeCondition.notify_all();
+	for (std::thread& worker : workers) {
+		worker.join();
+	}
+
+	if (currentSystem == this) {
+		currentSystem = nullptr;
+		currentThreadIndex = -1;
+	}
+	delete[] threads;
+}
+
+u32 JobSystem::DefaultWorkerCount() {
+	const u32 hardwareThreads = std::thread::hardware_concurrency();
+	return hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+}
+
+u32 JobSystem::ThreadCount() const {
+	return threadCount;
+}
+
+void JobSystem::ParallelFor(u32 count, u32 grainSize, const std::function<void(u32, u32)>& function) {
+	if (count == 0) {
+		return;
+	}
+
+	const s32 threadIndex = CurrentThreadIndex();
+	grainSize = grainSize > 0 ? grainSize : 1;
+	u32 jobCount = (count + grainSize - 1) / grainSize;
+	const u32 maxJobCount = threadCount * maxJobsPerThread < maxJobsPerCall ? threadCount * maxJobsPerThread : maxJobsPerCall;
+	jobCount = jobCount < maxJobCount ? jobCount : maxJobCount;
+	if (threadIndex < 0 || jobCount < 2) {
+		function(0, count);
+		return;
+	}
+
+	// The first range is run right here, the rest goes to this thread's deque for anyone to take.
+	// Nested calls started by jobs this thread runs while it waits push on top, so the deque can fill up,
+	// the jobs that don't fit are run right away.
+	ThreadData& data = threads[threadIndex];
+	Job jobs[maxJobsPerCall];
+	std::atomic<u32> pending(jobCount - 1);
+	for (u32 i = 1; i < jobCount; i++) {
+		Job& job = jobs[i];
+		job.function = &function;
+		job.begin = (u32)((u64)count * i / jobCount);
+		job.end = (u32)((u64)count * (i + 1) / jobCount);
+		job.pending = &pending;
+
+		queuedJobs.fetch_add(1);
+		if (!data.deque.Push(&job)) {
+			queuedJobs.fetch_sub(1);
+			Execute(job);
+		}
+	}
+
+	// Taking the lock makes sure no worker is between checking queuedJobs and going to sleep
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	wakeCondition.notify_all();
+
+	function(0, (u32)((u64)count / jobCount));
+
+	// Help out until every range is done, this may run jobs of other ParallelFor calls too
+	while (pending.load(std::memory_order_acquire) > 0) {
+		Job* job = FindJob(threadIndex);
+		if (job != nullptr) {
+			Execute(*job);
+		}
+		else {
+			std::this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::WorkerLoop(u32 threadIndex) {
+	currentSystem = this;
+	currentThreadIndex = (s32)threadIndex;
+	PROFILE_THREAD("Job worker");
+
+	while (true) {
+		Job* job = FindJob(threadIndex);
+		if (job != nullptr) {
+			Execute(*job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		wakeCondition.wait(lock, [this] { return stopping || queuedJobs.load() > 0; });
+		if (stopping) {
+			return;
+		}
+	}
+}
+
+Job* JobSystem::FindJob(u32 threadIndex) {
+	ThreadData& data = threads[threadIndex];
+	Job* job = data.deque.Pop();
+
+	if (job == nullptr && threadCount > 1) {
+		// Start at a random victim, so that idle threads don't all fight over the same deque
+		u32& seed = data.stealSeed;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		const u32 first = seed % threadCount;
+		for (u32 i = 0; i < threadCount && job == nullptr; i++) {
+			const u32 victim = (first + i) % threadCount;
+			if (victim != threadIndex) {
+				job = threads[victim].deque.Steal();
+			}
+		}
+	}
+
+	if (job != nullptr) {
+		queuedJobs.fetch_sub(1);
+	}
+	return job;
+}
+
+void JobSystem::Execute(const Job& job) {
+	// Copied out, the waiting thread returns and frees the job as soon as pending drops
+	std::atomic<u32>* pending = job.pending;
+	(*job.function)(job.begin, job.end);
+	pending->fetch_sub(1, std::memory_order_release);
+}
+
+s32 JobSystem::CurrentThreadIndex() const {
+	return currentSystem == this ? currentThreadIndex : -1;
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include "typedef.h"
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+struct Job {
+	const std::function<void(u32, u32)>* function;
+	u32 begin;
+	u32 end;
+	std::atomic<u32>* pending; // Decremented once the job has run, owned by whoever waits for it
+};
+
+// Chase-Lev deque. The owning thread pushes and pops at the bottom, other threads steal from the top,
+// so the owner works on its newest jobs while thieves take the oldest, largest ranges.
+class WorkStealingDeque
+{
+public:
+	static constexpr u32 capacity = 1024;
+
+	WorkStealingDeque();
+	// Owner only, fails when the deque is full
+	bool Push(Job* job);
+	// Owner only
+	Job* Pop();
+	// Any thread
+	Job* Steal();
+private:
+	alignas(64) std::atomic<s64> top;
+	alignas(64) std::atomic<s64> bottom;
+	std::atomic<Job*> jobs[capacity];
+};
+
+// Worker threads with one deque each. Jobs are pushed to the deque of the thread that creates them,
+// idle threads steal from the others and sleep when nothing is queued anywhere.
+// The thread that constructs the system is thread 0 and works on jobs while it waits for them.
+class JobSystem
+{
+public:
+	explicit JobSystem(u32 workerCount = DefaultWorkerCount());
+	~JobSystem();
+	JobSystem(const JobSystem&) = delete;
+	JobSystem& operator=(const JobSystem&) = delete;
+
+	// One less than the hardware threads, the constructing thread makes up the difference
+	static u32 DefaultWorkerCount();
+	// Workers plus the constructing thread
+	u32 ThreadCount() const;
+
+	// Splits [0, count) into ranges of at least grainSize and calls function(begin, end) once for each, then returns when all have run.
+	// Can be nested inside a job. Threads that don't belong to the system run the whole range themselves.
+	void ParallelFor(u32 count, u32 grainSize, const std::function<void(u32, u32)>& function);
+private:
+	// Enough that ranges can be stolen to even out uneven work without drowning in tiny jobs
+	static constexpr u32 maxJobsPerThread = 8;
+	// A call's jobs live on its stack frame, which stays put until every one of them has run
+	static constexpr u32 maxJobsPerCall = 256;
+
+	struct alignas(64) ThreadData {
+		WorkStealingDeque deque;
+		u32 stealSeed;
+	};
+
+	void WorkerLoop(u32 threadIndex);
+	Job* FindJob(u32 threadIndex);
+	static void Execute(const Job& job);
+	s32 CurrentThreadIndex() const;
+
+	u32 threadCount;
+	ThreadData* threads;
+	std::vector<std::thread> workers;
+
+	std::atomic<u32> queuedJobs;
+	std::mutex sleepMutex;
+	std::condition_variable wakeCondition;
+	bool stopping;
+};
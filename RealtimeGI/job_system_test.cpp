@@ -0,0 +1,119 @@
+// Stress tests ParallelFor with nested and oversubscribed calls and measures how it scales with the thread count.
+#include "job_system.h"
+#include "test_harness.h"
+#include <cmath>
+#include <memory>
+#include <vector>
+
+static constexpr u32 outerCount = 64;
+static constexpr u32 innerCount = 1000;
+
+// Every index of a ParallelFor inside a ParallelFor has to run exactly once
+static void CheckNested(JobSystem& jobs, u32 repeats) {
+    std::unique_ptr<std::atomic<u32>[]> visits(new std::atomic<u32>[outerCount * innerCount]);
+    for (u32 repeat = 0; repeat < repeats; repeat++) {
+        for (u32 i = 0; i < outerCount * innerCount; i++) {
+            visits[i].store(0, std::memory_order_relaxed);
+        }
+
+        jobs.ParallelFor(outerCount, 1, [&](u32 outerBegin, u32 outerEnd) {
+            for (u32 outer = outerBegin; outer < outerEnd; outer++) {
+                jobs.ParallelFor(innerCount, 10, [&, outer](u32 begin, u32 end) {
+                    for (u32 inner = begin; inner < end; inner++) {
+                        visits[outer * innerCount + inner].fetch_add(1, std::memory_order_relaxed);
+                    }
+                });
+            }
+        });
+
+        u32 wrong = 0;
+        for (u32 i = 0; i < outerCount * innerCount; i++) {
+            wrong += visits[i].load(std::memory_order_relaxed) != 1;
+        }
+        TEST_CHECK(wrong == 0, "%u of %u nested indices didn't run exactly once, %u threads, repeat %u",
+            wrong, outerCount * innerCount, jobs.ThreadCount(), repeat);
+        if (wrong != 0) {
+            return;
+        }
+    }
+}
+
+// A chain of calls nested inside each other's first range. Each level leaves its other ranges queued on the
+// same thread, so deep enough chains hold more jobs at once than a deque fits.
+static void NestedChain(JobSystem& jobs, u32 depth, std::atomic<u32>& visited) {
+    jobs.ParallelFor(outerCount, 1, [&](u32 begin, u32 end) {
+        visited.fetch_add(end - begin, std::memory_order_relaxed);
+        if (begin == 0 && depth > 1) {
+            NestedChain(jobs, depth - 1, visited);
+        }
+    });
+}
+
+static void CheckDeepNesting(JobSystem& jobs, u32 repeats) {
+    const u32 depth = 2 * WorkStealingDeque::capacity / outerCount;
+    for (u32 repeat = 0; repeat < repeats; repeat++) {
+        std::atomic<u32> visited(0);
+        NestedChain(jobs, depth, visited);
+        TEST_CHECK(visited.load() == depth * outerCount, "Nested chain ran %u of %u indices, %u threads",
+            visited.load(), depth * outerCount, jobs.ThreadCount());
+    }
+}
+
+// Threads the system doesn't know about run the whole range themselves
+static void CheckForeignThread(JobSystem& jobs) {
+    u32 calls = 0;
+    u32 covered = 0;
+    std::thread thread([&] {
+        jobs.ParallelFor(1000, 1, [&](u32 begin, u32 end) {
+            calls++;
+            covered += end - begin;
+        });
+    });
+    thread.join();
+    TEST_CHECK(calls == 1 && covered == 1000, "ParallelFor from a foreign thread ran %u calls covering %u indices", calls, covered);
+}
+
+// Some math per element, so the time isn't only memory bandwidth
+static void Work(std::vector<r32>& values, u32 begin, u32 end) {
+    for (u32 i = begin; i < end; i++) {
+        r32 value = (r32)i;
+        for (u32 j = 0; j < 16; j++) {
+            value = std::sqrt(value * 1.0001f + 1.0f);
+        }
+        values[i] = value;
+    }
+}
+
+static void TimeScaling() {
+    const u32 count = 1 << 20;
+    std::vector<r32> values(count);
+
+    const r64 serial = TimeBestOf(10, [&] { Work(values, 0, count); DoNotOptimize(values[0]); });
+    printf("%u elements, hardware threads %u\n", count, std::thread::hardware_concurrency());
+    printf("  serial              %8.3f ms\n", serial);
+
+    const u32 workerCounts[] = { 0, 1, 3, 7, 15 };
+    for (u32 workerCount : workerCounts) {
+        JobSystem jobs(workerCount);
+        const r64 time = TimeBestOf(10, [&] {
+            jobs.ParallelFor(count, 4096, [&](u32 begin, u32 end) { Work(values, begin, end); });
+            DoNotOptimize(values[0]);
+        });
+        printf("  %2u threads          %8.3f ms  (%.2fx serial)\n", jobs.ThreadCount(), time, serial / time);
+    }
+}
+
+int main() {
+    // More threads than cores, so workers get preempted in the middle of jobs
+    const u32 oversubscribed[] = { 1, 3, 7, 4 * JobSystem::DefaultWorkerCount() + 3 };
+    for (u32 workerCount : oversubscribed) {
+        JobSystem jobs(workerCount);
+        CheckNested(jobs, 100);
+        CheckDeepNesting(jobs, 100);
+        CheckForeignThread(jobs);
+    }
+
+    TimeScaling();
+
+    return TestResult();
+}
@@ -48,7 +48,8 @@ namespace Rendering {
 
     struct ShaderCreateInfo {
         ShaderMetadata metadata;
-        VertexAttribFlags vertexInputs;
+        VertexAttribFlags vertexInputs; // Ignored for the packed layout, which always has every attribute
+        VertexLayout vertexLayout;
         u32 samplerCount;
         const char* vert, * frag;
     };
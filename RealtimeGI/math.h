@@ -16,4 +16,14 @@ T clamp(T val, T min, T max)
 {
     const T t = val < min ? min : val;
     return t > max ? max : t;
+}
+
+// Maps a unit vector onto the octahedron, unfolded into [-1, 1]^2
+inline glm::vec2 OctEncode(glm::vec3 n) {
+    n /= glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+    if (n.z < 0.0f) {
+        const glm::vec2 signs(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+        return (1.0f - glm::abs(glm::vec2(n.y, n.x))) * signs;
+    }
+    return glm::vec2(n.x, n.y);
 }
\ No newline at end of file
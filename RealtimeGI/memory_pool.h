@@ -1,59 +1,145 @@
 #pragma once
 #include "typedef.h"
+#include "system.h"
+#include <cstdlib>
+
+// Handles pack a slot index in the low bits and a generation in the high bits.
+// The generation is bumped whenever a slot is freed, so a stale handle never aliases an object that reuses the slot.
+// The top bit is never set, so handles stay positive and -1 can still be used as the invalid handle.
+constexpr u32 poolHandleIndexBits = 16;
+constexpr u32 poolHandleGenerationBits = 15;
+constexpr u32 poolMaxCapacity = 1 << poolHandleIndexBits;
+
+inline u32 PoolHandleIndex(s32 handle) {
+	return (u32)handle & (poolMaxCapacity - 1);
+}
+inline u32 PoolHandleGeneration(s32 handle) {
+	return ((u32)handle >> poolHandleIndexBits) & ((1 << poolHandleGenerationBits) - 1);
+}
 
 template<class T>
 class MemoryPool
 {
 private:
-	T* objs;
-	s32* handles;
-	u32 size;
+	T* objs; // Densely packed, the first count objects are alive
+	u32* slots; // Slot of each dense object, followed by the free slots
+	u32* denseIndices; // Reverse of slots, dense index of each slot
+	u16* generations;
+	u32 capacity;
+	u32 maxCapacity;
 	u32 count;
+
+	s32 MakeHandle(u32 slot) const {
+		return (s32)(((u32)generations[slot] << poolHandleIndexBits) | slot);
+	}
+	bool Grow() {
+		if (capacity >= maxCapacity) {
+			return false;
+		}
+
+		u32 newCapacity = capacity == 0 ? 16 : capacity * 2;
+		if (newCapacity > maxCapacity) {
+			newCapacity = maxCapacity;
+		}
+
+		objs = (T*)realloc(objs, newCapacity * sizeof(T));
+		slots = (u32*)realloc(slots, newCapacity * sizeof(u32));
+		denseIndices = (u32*)realloc(denseIndices, newCapacity * sizeof(u32));
+		generations = (u16*)realloc(generations, newCapacity * sizeof(u16));
+
+		for (u32 i = capacity; i < newCapacity; i++)
+		{
+			slots[i] = i;
+			denseIndices[i] = i;
+			generations[i] = 0;
+		}
+
+		capacity = newCapacity;
+		return true;
+	}
 public:
 	MemoryPool() {
 		Init(0);
 	}
-	MemoryPool(u32 s) {
-		Init(s);
+	MemoryPool(u32 s, u32 maxS = poolMaxCapacity) {
+		Init(s, maxS);
 	}
 	~MemoryPool() {
 		free(objs);
-		free(handles);
+		free(slots);
+		free(denseIndices);
+		free(generations);
 	}
-	void Init(u32 s) {
-		size = s;
-		count = 0;
+	MemoryPool(const MemoryPool&) = delete;
+	MemoryPool& operator=(const MemoryPool&) = delete;
 
-		objs = (T*)calloc(size, sizeof(T));
-		handles = (s32*)calloc(size, sizeof(s32));
+	// Initial capacity, the pool grows up to maxS objects when it runs out of room
+	void Init(u32 s, u32 maxS = poolMaxCapacity) {
+		objs = nullptr;
+		slots = nullptr;
+		denseIndices = nullptr;
+		generations = nullptr;
+		capacity = 0;
+		maxCapacity = maxS < poolMaxCapacity ? maxS : poolMaxCapacity;
+		count = 0;
 
-		for (u32 i = 0; i < size; i++)
-		{
-			handles[i] = i;
+		if (s > maxCapacity) {
+			s = maxCapacity;
+		}
+		if (s > 0) {
+			objs = (T*)calloc(s, sizeof(T));
+			slots = (u32*)calloc(s, sizeof(u32));
+			denseIndices = (u32*)calloc(s, sizeof(u32));
+			generations = (u16*)calloc(s, sizeof(u16));
+			for (u32 i = 0; i < s; i++)
+			{
+				slots[i] = i;
+				denseIndices[i] = i;
+			}
+			capacity = s;
 		}
 	}
 	s32 Add(const T& obj) {
-		if (count >= size) {
+		if (count >= capacity && !Grow()) {
 			return -1;
 		}
 
-		s32 handle = handles[count++];
-		objs[handle] = obj;
-		return handle;
+		u32 denseIndex = count++;
+		objs[denseIndex] = obj;
+		return MakeHandle(slots[denseIndex]);
+	}
+	bool Contains(s32 handle) const {
+		if (handle < 0) {
+			return false;
+		}
+		u32 slot = PoolHandleIndex(handle);
+		return slot < capacity && denseIndices[slot] < count && generations[slot] == PoolHandleGeneration(handle);
 	}
 	T& operator[](s32 handle) {
-		return objs[handle];
+		if (!Contains(handle)) {
+			DEBUG_ERROR("Invalid or stale handle %d", handle);
+		}
+		return objs[denseIndices[PoolHandleIndex(handle)]];
 	}
+	// Swaps the last object into the freed spot, so references to pool objects are invalidated
 	bool Remove(const s32 handle) {
-		// TODO: Smart find algorithm if this gets slow
-		for (u32 i = 0; i < count; i++) {
-			if (handles[i] == handle) {
-				handles[i] = handles[--count];
-				handles[count] = handle;
-				return true;
-			}
+		if (!Contains(handle)) {
+			return false;
 		}
-		return false;
+
+		u32 slot = PoolHandleIndex(handle);
+		u32 denseIndex = denseIndices[slot];
+		u32 lastIndex = --count;
+		u32 lastSlot = slots[lastIndex];
+
+		objs[denseIndex] = objs[lastIndex];
+		slots[denseIndex] = lastSlot;
+		denseIndices[lastSlot] = denseIndex;
+		slots[lastIndex] = slot;
+		denseIndices[slot] = lastIndex;
+
+		generations[slot] = (generations[slot] + 1) & ((1 << poolHandleGenerationBits) - 1);
+		return true;
 	}
 	u32 Count() const {
 		return count;
@@ -62,6 +148,14 @@ public:
 		if (index >= count) {
 			return -1;
 		}
-		return handles[index];
+		return MakeHandle(slots[index]);
+	}
+
+	// Dense iteration over live objects
+	T* begin() {
+		return objs;
+	}
+	T* end() {
+		return objs + count;
 	}
-};
\ No newline at end of file
+};
@@ -0,0 +1,236 @@
+#include "mesh_optimize.h"
+#include "math.h"
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace Rendering {
+	static constexpr u32 vertexCacheSize = 32;
+	static constexpr u32 valenceScoreTableSize = 32;
+	// FIFO size used to find cluster boundaries, close to what hardware has
+	static constexpr u32 overdrawCacheSize = 16;
+
+	struct VertexScoreTables {
+		r32 cachePosition[vertexCacheSize];
+		r32 valence[valenceScoreTableSize];
+
+		VertexScoreTables() {
+			for (u32 i = 0; i < vertexCacheSize; i++) {
+				// The last triangle's vertices get a fixed, lower score, which avoids long thin strips
+				cachePosition[i] = i < 3 ? 0.75f : std::pow(1.0f - (i - 3) / (r32)(vertexCacheSize - 3), 1.5f);
+			}
+			valence[0] = 0.0f;
+			for (u32 i = 1; i < valenceScoreTableSize; i++) {
+				// Vertices with few triangles left are boosted, so they get finished off instead of left behind
+				valence[i] = 2.0f / std::sqrt((r32)i);
+			}
+		}
+
+		r32 Score(s32 cachePos, u32 remainingTriangles) const {
+			if (remainingTriangles == 0) {
+				return -1.0f;
+			}
+
+			r32 score = cachePos >= 0 ? cachePosition[cachePos] : 0.0f;
+			score += remainingTriangles < valenceScoreTableSize ? valence[remainingTriangles] : 2.0f / std::sqrt((r32)remainingTriangles);
+			return score;
+		}
+	};
+
+	void OptimizeVertexCache(u32* indices, u32 indexCount, u32 vertexCount) {
+		const u32 triangleCount = indexCount / 3;
+		if (triangleCount == 0) {
+			return;
+		}
+
+		static const VertexScoreTables scoreTables;
+
+		// Triangles of each vertex, the first remainingTriangles[v] of them are the ones not emitted yet
+		std::vector<u32> remainingTriangles(vertexCount, 0);
+		for (u32 i = 0; i < triangleCount * 3; i++) {
+			remainingTriangles[indices[i]]++;
+		}
+		std::vector<u32> adjacencyOffsets(vertexCount + 1, 0);
+		for (u32 v = 0; v < vertexCount; v++) {
+			adjacencyOffsets[v + 1] = adjacencyOffsets[v] + remainingTriangles[v];
+		}
+		std::vector<u32> adjacency(triangleCount * 3);
+		std::vector<u32> adjacencyFill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+		for (u32 i = 0; i < triangleCount * 3; i++) {
+			adjacency[adjacencyFill[indices[i]]++] = i / 3;
+		}
+
+		std::vector<s32> cachePositions(vertexCount, -1);
+		std::vector<r32> vertexScores(vertexCount);
+		for (u32 v = 0; v < vertexCount; v++) {
+			vertexScores[v] = scoreTables.Score(-1, remainingTriangles[v]);
+		}
+
+		std::vector<r32> triangleScores(triangleCount);
+		std::vector<bool> emitted(triangleCount, false);
+		s32 bestTriangle = -1;
+		r32 bestScore = -1.0f;
+		for (u32 t = 0; t < triangleCount; t++) {
+			const u32* tri = &indices[t * 3];
+			triangleScores[t] = vertexScores[tri[0]] + vertexScores[tri[1]] + vertexScores[tri[2]];
+			if (triangleScores[t] > bestScore) {
+				bestScore = triangleScores[t];
+				bestTriangle = t;
+			}
+		}
+
+		std::vector<u32> output(triangleCount * 3);
+		u32 cache[vertexCacheSize + 3];
+		u32 cacheCount = 0;
+		u32 nextUnemitted = 0;
+
+		for (u32 emittedCount = 0; emittedCount < triangleCount; emittedCount++) {
+			if (bestTriangle < 0) {
+				// Nothing in the cache has triangles left, carry on from the first triangle that's left
+				while (emitted[nextUnemitted]) {
+					nextUnemitted++;
+				}
+				bestTriangle = nextUnemitted;
+			}
+
+			const u32 t = bestTriangle;
+			const u32* tri = &indices[t * 3];
+			emitted[t] = true;
+			memcpy(&output[emittedCount * 3], tri, sizeof(u32) * 3);
+
+			// Remove the triangle from its vertices
+			for (u32 k = 0; k < 3; k++) {
+				const u32 v = tri[k];
+				u32* triangles = &adjacency[adjacencyOffsets[v]];
+				const u32 count = remainingTriangles[v];
+				for (u32 i = 0; i < count; i++) {
+					if (triangles[i] == t) {
+						triangles[i] = triangles[count - 1];
+						triangles[count - 1] = t;
+						remainingTriangles[v]--;
+						break;
+					}
+				}
+			}
+
+			// Move the triangle's vertices to the front of the LRU cache, the ones pushed past the end get evicted
+			u32 newCache[vertexCacheSize + 3];
+			u32 newCacheCount = 0;
+			for (u32 k = 0; k < 3; k++) {
+				if (std::find(newCache, newCache + newCacheCount, tri[k]) == newCache + newCacheCount) {
+					newCache[newCacheCount++] = tri[k];
+				}
+			}
+			for (u32 i = 0; i < cacheCount; i++) {
+				if (std::find(newCache, newCache + newCacheCount, cache[i]) == newCache + newCacheCount) {
+					newCache[newCacheCount++] = cache[i];
+				}
+			}
+
+			cacheCount = MIN(newCacheCount, vertexCacheSize);
+			for (u32 i = 0; i < newCacheCount; i++) {
+				const u32 v = newCache[i];
+				cachePositions[v] = i < cacheCount ? (s32)i : -1;
+				vertexScores[v] = scoreTables.Score(cachePositions[v], remainingTriangles[v]);
+			}
+			memcpy(cache, newCache, sizeof(u32) * cacheCount);
+
+			// Only triangles touching the cache can change score, the best one among them goes next
+			bestTriangle = -1;
+			bestScore = -1.0f;
+			for (u32 i = 0; i < newCacheCount; i++) {
+				const u32 v = newCache[i];
+				const u32* triangles = &adjacency[adjacencyOffsets[v]];
+				for (u32 j = 0; j < remainingTriangles[v]; j++) {
+					const u32 tt = triangles[j];
+					const u32* ttri = &indices[tt * 3];
+					triangleScores[tt] = vertexScores[ttri[0]] + vertexScores[ttri[1]] + vertexScores[ttri[2]];
+					if (i < cacheCount && triangleScores[tt] > bestScore) {
+						bestScore = triangleScores[tt];
+						bestTriangle = tt;
+					}
+				}
+			}
+		}
+
+		memcpy(indices, output.data(), sizeof(u32) * triangleCount * 3);
+	}
+
+	void OptimizeOverdraw(u32* indices, u32 indexCount, const glm::vec3* positions, u32 vertexCount) {
+		const u32 triangleCount = indexCount / 3;
+		if (triangleCount == 0 || positions == nullptr) {
+			return;
+		}
+
+		// A triangle that misses the cache with all of its vertices starts a new cluster,
+		// so reordering clusters doesn't cost any extra cache misses
+		std::vector<u32> clusterStarts;
+		std::vector<u32> cacheTimestamps(vertexCount, 0);
+		u32 time = overdrawCacheSize + 1;
+		for (u32 t = 0; t < triangleCount; t++) {
+			u32 misses = 0;
+			for (u32 k = 0; k < 3; k++) {
+				const u32 v = indices[t * 3 + k];
+				if (time - cacheTimestamps[v] > overdrawCacheSize) {
+					cacheTimestamps[v] = time++;
+					misses++;
+				}
+			}
+			if (misses == 3 || t == 0) {
+				clusterStarts.push_back(t);
+			}
+		}
+		const u32 clusterCount = (u32)clusterStarts.size();
+		clusterStarts.push_back(triangleCount);
+
+		// Area weighted centroids and normals
+		glm::vec3 meshCentroid(0.0f);
+		r32 meshArea = 0.0f;
+		std::vector<glm::vec3> clusterCentroids(clusterCount, glm::vec3(0.0f));
+		std::vector<glm::vec3> clusterNormals(clusterCount, glm::vec3(0.0f));
+		for (u32 c = 0; c < clusterCount; c++) {
+			r32 clusterArea = 0.0f;
+			for (u32 t = clusterStarts[c]; t < clusterStarts[c + 1]; t++) {
+				const glm::vec3& p0 = positions[indices[t * 3]];
+				const glm::vec3& p1 = positions[indices[t * 3 + 1]];
+				const glm::vec3& p2 = positions[indices[t * 3 + 2]];
+				const glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+				const r32 area = glm::length(normal);
+				const glm::vec3 centroid = (p0 + p1 + p2) / 3.0f;
+
+				clusterCentroids[c] += centroid * area;
+				clusterNormals[c] += normal;
+				clusterArea += area;
+			}
+
+			meshCentroid += clusterCentroids[c];
+			meshArea += clusterArea;
+			if (clusterArea > 0.0f) {
+				clusterCentroids[c] /= clusterArea;
+			}
+		}
+		if (meshArea > 0.0f) {
+			meshCentroid /= meshArea;
+		}
+
+		// Clusters facing away from the middle of the mesh are the likeliest occluders, so they go first
+		std::vector<r32> clusterSortKeys(clusterCount);
+		std::vector<u32> clusterOrder(clusterCount);
+		for (u32 c = 0; c < clusterCount; c++) {
+			const r32 normalLength = glm::length(clusterNormals[c]);
+			const glm::vec3 normal = normalLength > 0.0f ? clusterNormals[c] / normalLength : glm::vec3(0.0f);
+			clusterSortKeys[c] = glm::dot(clusterCentroids[c] - meshCentroid, normal);
+			clusterOrder[c] = c;
+		}
+		std::stable_sort(clusterOrder.begin(), clusterOrder.end(), [&](u32 a, u32 b) { return clusterSortKeys[a] > clusterSortKeys[b]; });
+
+		std::vector<u32> output;
+		output.reserve(triangleCount * 3);
+		for (u32 c : clusterOrder) {
+			output.insert(output.end(), indices + clusterStarts[c] * 3, indices + clusterStarts[c + 1] * 3);
+		}
+
+		memcpy(indices, output.data(), sizeof(u32) * triangleCount * 3);
+	}
+}
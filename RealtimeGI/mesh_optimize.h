@@ -0,0 +1,11 @@
+#pragma once
+#include "rendering.h"
+
+namespace Rendering {
+	// Reorders triangles for the post-transform vertex cache, using Tom Forsyth's linear-speed vertex cache optimization.
+	void OptimizeVertexCache(u32* indices, u32 indexCount, u32 vertexCount);
+
+	// Splits cache-optimized triangles into clusters where the cache would have been flushed anyway,
+	// then draws outward facing clusters first, so that they occlude the rest of the mesh (Sander et al. 2007).
+	void OptimizeOverdraw(u32* indices, u32 indexCount, const glm::vec3* positions, u32 vertexCount);
+}
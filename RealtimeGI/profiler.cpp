@@ -0,0 +1,142 @@
+#include "profiler.h"
+#ifdef ENABLE_PROFILING
+#include "system.h"
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+struct ProfileEvent {
+	const char* name; // Null for frame markers
+	u64 start;
+	u64 end;
+	u32 frame;
+};
+
+// Only the owning thread writes. Events go into chunks that are allocated as the buffer fills up and kept for later captures.
+// The owner publishes an event by storing count with release, so the exporter can read everything below count without locking.
+static constexpr u32 profileChunkEventCount = 16384;
+static constexpr u32 maxProfileChunks = 256; // About four million events per thread and capture
+struct ProfileThreadBuffer {
+	const char* name;
+	u32 threadId;
+	std::atomic<u32> count;
+	std::atomic<u32> dropped;
+	ProfileEvent* chunks[maxProfileChunks];
+};
+
+std::atomic<bool> profilerCapturing(false);
+
+static std::mutex registryMutex;
+static std::vector<ProfileThreadBuffer*> threadBuffers; // Never freed, threads may still be writing when they exit
+static u64 captureStart;
+static u32 frameNumber;
+static thread_local ProfileThreadBuffer* threadBuffer = nullptr;
+
+static ProfileThreadBuffer* GetThreadBuffer() {
+	if (threadBuffer == nullptr) {
+		ProfileThreadBuffer* buffer = (ProfileThreadBuffer*)calloc(1, sizeof(ProfileThreadBuffer));
+		buffer->name = nullptr;
+		buffer->count.store(0, std::memory_order_relaxed);
+		buffer->dropped.store(0, std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(registryMutex);
+		buffer->threadId = (u32)threadBuffers.size() + 1;
+		threadBuffers.push_back(buffer);
+		threadBuffer = buffer;
+	}
+	return threadBuffer;
+}
+
+static void PushEvent(const ProfileEvent& event) {
+	ProfileThreadBuffer* buffer = GetThreadBuffer();
+	const u32 index = buffer->count.load(std::memory_order_relaxed);
+	const u32 chunk = index / profileChunkEventCount;
+	if (chunk >= maxProfileChunks) {
+		buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	if (buffer->chunks[chunk] == nullptr) {
+		buffer->chunks[chunk] = (ProfileEvent*)malloc(sizeof(ProfileEvent) * profileChunkEventCount);
+	}
+
+	buffer->chunks[chunk][index % profileChunkEventCount] = event;
+	buffer->count.store(index + 1, std::memory_order_release);
+}
+
+u64 ProfilerNow() {
+	return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ProfilerRecordZone(const char* name, u64 start, u64 end) {
+	PushEvent({ name, start, end, 0 });
+}
+
+void ProfilerMarkFrame() {
+	if (!profilerCapturing.load(std::memory_order_relaxed)) {
+		return;
+	}
+	const u64 now = ProfilerNow();
+	PushEvent({ nullptr, now, now, frameNumber++ });
+}
+
+void ProfilerSetThreadName(const char* name) {
+	ProfileThreadBuffer* buffer = GetThreadBuffer();
+	std::lock_guard<std::mutex> lock(registryMutex);
+	buffer->name = name;
+}
+
+void ProfilerStartCapture() {
+	std::lock_guard<std::mutex> lock(registryMutex);
+	for (ProfileThreadBuffer* buffer : threadBuffers) {
+		buffer->count.store(0, std::memory_order_relaxed);
+		buffer->dropped.store(0, std::memory_order_relaxed);
+	}
+	frameNumber = 0;
+	captureStart = ProfilerNow();
+	profilerCapturing.store(true);
+}
+
+void ProfilerStopCapture() {
+	profilerCapturing.store(false);
+}
+
+// Complete events per thread, frame markers as global instant events, times in microseconds since the capture started
+bool ProfilerWriteTrace(const char* path) {
+	std::lock_guard<std::mutex> lock(registryMutex);
+
+	std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	json += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"CPU\"}}";
+	char event[256];
+	for (ProfileThreadBuffer* buffer : threadBuffers) {
+		if (buffer->name != nullptr) {
+			snprintf(event, sizeof(event), ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", buffer->threadId, buffer->name);
+			json += event;
+		}
+
+		const u32 count = buffer->count.load(std::memory_order_acquire);
+		for (u32 i = 0; i < count; i++) {
+			const ProfileEvent& e = buffer->chunks[i / profileChunkEventCount][i % profileChunkEventCount];
+			const r64 start = (e.start - captureStart) / 1000.0;
+			if (e.name == nullptr) {
+				snprintf(event, sizeof(event), ",\n{\"name\":\"Frame\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"args\":{\"frame\":%u}}",
+					buffer->threadId, start, e.frame);
+			}
+			else {
+				snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+					e.name, buffer->threadId, start, (e.end - e.start) / 1000.0);
+			}
+			json += event;
+		}
+
+		const u32 dropped = buffer->dropped.load(std::memory_order_relaxed);
+		if (dropped > 0) {
+			DEBUG_LOG("Thread %u ran out of profiler memory, %u events were dropped", buffer->threadId, dropped);
+		}
+	}
+	json += "\n]}\n";
+
+	return WriteFileBytes(path, json.data(), (u32)json.size());
+}
+#endif
@@ -0,0 +1,48 @@
+#pragma once
+#include "typedef.h"
+
+// Scoped CPU zones, exported as Chrome trace JSON that chrome://tracing and Perfetto open.
+// Compiled in with ENABLE_PROFILING, without it the macros expand to nothing and no profiler code is built.
+// Zones are only recorded between ProfilerStartCapture and ProfilerStopCapture, each thread into its own buffer.
+#ifdef ENABLE_PROFILING
+#include <atomic>
+
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+// Times the rest of the enclosing scope. The name has to stay valid until the trace is written, it's meant to be a string literal.
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_FRAME() ProfilerMarkFrame()
+#define PROFILE_THREAD(name) ProfilerSetThreadName(name)
+
+extern std::atomic<bool> profilerCapturing;
+
+u64 ProfilerNow();
+void ProfilerRecordZone(const char* name, u64 start, u64 end);
+void ProfilerMarkFrame();
+void ProfilerSetThreadName(const char* name);
+// Start and stop between frames, while no jobs are running. Starting again drops the previous capture.
+void ProfilerStartCapture();
+void ProfilerStopCapture();
+bool ProfilerWriteTrace(const char* path);
+
+class ProfileZone
+{
+public:
+	explicit ProfileZone(const char* name) : name(name), start(profilerCapturing.load(std::memory_order_relaxed) ? ProfilerNow() : 0) {}
+	~ProfileZone() {
+		// Zones that began outside of a capture aren't recorded, even if one started in between
+		if (start != 0) {
+			ProfilerRecordZone(name, start, ProfilerNow());
+		}
+	}
+	ProfileZone(const ProfileZone&) = delete;
+	ProfileZone& operator=(const ProfileZone&) = delete;
+private:
+	const char* name;
+	u64 start;
+};
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_FRAME()
+#define PROFILE_THREAD(name)
+#endif
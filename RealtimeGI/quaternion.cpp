@@ -0,0 +1,151 @@
+#include "quaternion.h"
+
+// Polynomial approximation of sin(t * theta) / sin(theta) in terms of cos(theta), from David Eberly's
+// "A Fast and Accurate Algorithm for Computing SLERP". Only multiplies and adds, so four slerps run side by side.
+// The last term is scaled by mu to make up for the truncated series, fitted for twelve terms to a maximum error of about 7e-7.
+static constexpr u32 slerpTermCount = 12;
+static constexpr r32 slerpMu = 1.8938f;
+static constexpr r32 slerpU[slerpTermCount] = {
+    1.0f / (1 * 3), 1.0f / (2 * 5), 1.0f / (3 * 7), 1.0f / (4 * 9), 1.0f / (5 * 11), 1.0f / (6 * 13),
+    1.0f / (7 * 15), 1.0f / (8 * 17), 1.0f / (9 * 19), 1.0f / (10 * 21), 1.0f / (11 * 23), slerpMu / (12 * 25)
+};
+static constexpr r32 slerpV[slerpTermCount] = {
+    1.0f / 3, 2.0f / 5, 3.0f / 7, 4.0f / 9, 5.0f / 11, 6.0f / 13,
+    7.0f / 15, 8.0f / 17, 9.0f / 19, 10.0f / 21, 11.0f / 23, slerpMu * 12 / 25
+};
+
+// The parts that only depend on t are the same for every element
+static void SlerpCoefficients(r32 t, r32* outCoefficients)
+{
+    const r32 tSqr = t * t;
+    for (u32 i = 0; i < slerpTermCount; i++)
+    {
+        outCoefficients[i] = slerpU[i] * tSqr - slerpV[i];
+    }
+}
+
+// Expects cosTheta >= 0
+static r32 SlerpWeight(const r32* coefficients, r32 t, r32 cosTheta)
+{
+    const r32 xm1 = cosTheta - 1.0f;
+    r32 weight = 1.0f;
+    for (s32 i = slerpTermCount - 1; i >= 0; i--)
+    {
+        weight = 1.0f + coefficients[i] * xm1 * weight;
+    }
+    return t * weight;
+}
+
+static __m128 SlerpWeight(const r32* coefficients, r32 t, __m128 xm1)
+{
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 weight = one;
+    for (s32 i = slerpTermCount - 1; i >= 0; i--)
+    {
+        weight = _mm_add_ps(one, _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(coefficients[i]), xm1), weight));
+    }
+    return _mm_mul_ps(_mm_set1_ps(t), weight);
+}
+
+void RotateVectors(const Quaternion* rotations, const glm::vec3* vectors, glm::vec3* outVectors, u32 count)
+{
+    const u32 simdCount = count & ~3u;
+    for (u32 i = 0; i < simdCount; i += 4)
+    {
+        // One component of four quaternions per register
+        __m128 qx = _mm_loadu_ps(&rotations[i].x);
+        __m128 qy = _mm_loadu_ps(&rotations[i + 1].x);
+        __m128 qz = _mm_loadu_ps(&rotations[i + 2].x);
+        __m128 qw = _mm_loadu_ps(&rotations[i + 3].x);
+        _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+
+        const __m128 vx = _mm_setr_ps(vectors[i].x, vectors[i + 1].x, vectors[i + 2].x, vectors[i + 3].x);
+        const __m128 vy = _mm_setr_ps(vectors[i].y, vectors[i + 1].y, vectors[i + 2].y, vectors[i + 3].y);
+        const __m128 vz = _mm_setr_ps(vectors[i].z, vectors[i + 1].z, vectors[i + 2].z, vectors[i + 3].z);
+
+        // Same formula as operator*(Quaternion, vec3)
+        const __m128 two = _mm_set1_ps(2.0f);
+        const __m128 tx = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qy, vz), _mm_mul_ps(qz, vy)));
+        const __m128 ty = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qz, vx), _mm_mul_ps(qx, vz)));
+        const __m128 tz = _mm_mul_ps(two, _mm_sub_ps(_mm_mul_ps(qx, vy), _mm_mul_ps(qy, vx)));
+
+        alignas(16) r32 rx[4], ry[4], rz[4];
+        _mm_store_ps(rx, _mm_add_ps(_mm_add_ps(vx, _mm_mul_ps(qw, tx)), _mm_sub_ps(_mm_mul_ps(qy, tz), _mm_mul_ps(qz, ty))));
+        _mm_store_ps(ry, _mm_add_ps(_mm_add_ps(vy, _mm_mul_ps(qw, ty)), _mm_sub_ps(_mm_mul_ps(qz, tx), _mm_mul_ps(qx, tz))));
+        _mm_store_ps(rz, _mm_add_ps(_mm_add_ps(vz, _mm_mul_ps(qw, tz)), _mm_sub_ps(_mm_mul_ps(qx, ty), _mm_mul_ps(qy, tx))));
+
+        for (u32 j = 0; j < 4; j++)
+        {
+            outVectors[i + j] = glm::vec3(rx[j], ry[j], rz[j]);
+        }
+    }
+
+    for (u32 i = simdCount; i < count; i++)
+    {
+        outVectors[i] = rotations[i] * vectors[i];
+    }
+}
+
+void Slerp(const Quaternion* from, const Quaternion* to, r32 t, Quaternion* outRotations, u32 count)
+{
+    r32 toCoefficients[slerpTermCount];
+    r32 fromCoefficients[slerpTermCount];
+    SlerpCoefficients(t, toCoefficients);
+    SlerpCoefficients(1.0f - t, fromCoefficients);
+
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    const u32 simdCount = count & ~3u;
+    for (u32 i = 0; i < simdCount; i += 4)
+    {
+        __m128 ax = _mm_loadu_ps(&from[i].x);
+        __m128 ay = _mm_loadu_ps(&from[i + 1].x);
+        __m128 az = _mm_loadu_ps(&from[i + 2].x);
+        __m128 aw = _mm_loadu_ps(&from[i + 3].x);
+        _MM_TRANSPOSE4_PS(ax, ay, az, aw);
+        __m128 bx = _mm_loadu_ps(&to[i].x);
+        __m128 by = _mm_loadu_ps(&to[i + 1].x);
+        __m128 bz = _mm_loadu_ps(&to[i + 2].x);
+        __m128 bw = _mm_loadu_ps(&to[i + 3].x);
+        _MM_TRANSPOSE4_PS(bx, by, bz, bw);
+
+        __m128 cosTheta = _mm_mul_ps(ax, bx);
+        cosTheta = _mm_add_ps(cosTheta, _mm_mul_ps(ay, by));
+        cosTheta = _mm_add_ps(cosTheta, _mm_mul_ps(az, bz));
+        cosTheta = _mm_add_ps(cosTheta, _mm_mul_ps(aw, bw));
+
+        // Take the shorter arc by flipping the target's sign along with the cosine's
+        const __m128 sign = _mm_and_ps(cosTheta, signMask);
+        const __m128 xm1 = _mm_sub_ps(_mm_xor_ps(cosTheta, sign), one);
+        const __m128 fromWeight = SlerpWeight(fromCoefficients, 1.0f - t, xm1);
+        const __m128 toWeight = _mm_xor_ps(SlerpWeight(toCoefficients, t, xm1), sign);
+
+        __m128 rx = _mm_add_ps(_mm_mul_ps(ax, fromWeight), _mm_mul_ps(bx, toWeight));
+        __m128 ry = _mm_add_ps(_mm_mul_ps(ay, fromWeight), _mm_mul_ps(by, toWeight));
+        __m128 rz = _mm_add_ps(_mm_mul_ps(az, fromWeight), _mm_mul_ps(bz, toWeight));
+        __m128 rw = _mm_add_ps(_mm_mul_ps(aw, fromWeight), _mm_mul_ps(bw, toWeight));
+        _MM_TRANSPOSE4_PS(rx, ry, rz, rw);
+
+        _mm_storeu_ps(&outRotations[i].x, rx);
+        _mm_storeu_ps(&outRotations[i + 1].x, ry);
+        _mm_storeu_ps(&outRotations[i + 2].x, rz);
+        _mm_storeu_ps(&outRotations[i + 3].x, rw);
+    }
+
+    for (u32 i = simdCount; i < count; i++)
+    {
+        r32 cosTheta = from[i].Dot(to[i]);
+        r32 sign = 1.0f;
+        if (cosTheta < 0.0f)
+        {
+            cosTheta = -cosTheta;
+            sign = -1.0f;
+        }
+
+        const r32 fromWeight = SlerpWeight(fromCoefficients, 1.0f - t, cosTheta);
+        const r32 toWeight = SlerpWeight(toCoefficients, t, cosTheta) * sign;
+        const __m128 result = _mm_add_ps(_mm_mul_ps(from[i].Simd(), _mm_set1_ps(fromWeight)), _mm_mul_ps(to[i].Simd(), _mm_set1_ps(toWeight)));
+        outRotations[i] = Quaternion(result);
+    }
+}
@@ -2,15 +2,27 @@
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEPTH_ZERO_TO_ONE
 #include <glm/glm.hpp>
+#include <emmintrin.h>
+#include <cmath>
 #include "typedef.h"
 
-class Quaternion
+// Stored as one SSE register, so products and interpolation work on all four components at once
+class alignas(16) Quaternion
 {
 public:
     r32 x, y, z, w;
 
-    Quaternion() : x(0), y(0), z(0), w(0) {}
+    Quaternion() : x(0), y(0), z(0), w(1) {}
     Quaternion(r32 x, r32 y, r32 z, r32 w) : x(x), y(y), z(z), w(w) {}
+    explicit Quaternion(__m128 v)
+    {
+        _mm_store_ps(&x, v);
+    }
+    inline __m128 Simd() const
+    {
+        return _mm_load_ps(&x);
+    }
+
     inline static Quaternion AngleAxis(r32 angle, glm::vec3 axis)
     {
         Quaternion result;
@@ -26,6 +38,36 @@ public:
     {
         return Quaternion(-x, -y, -z, w);
     }
+    inline r32 Dot(const Quaternion& other) const
+    {
+        return x * other.x + y * other.y + z * other.z + w * other.w;
+    }
+    inline r32 Length() const
+    {
+        return std::sqrt(Dot(*this));
+    }
+    inline Quaternion Normalized() const
+    {
+        return Quaternion(_mm_mul_ps(Simd(), _mm_set1_ps(1.0f / Length())));
+    }
+    inline void Normalize()
+    {
+        *this = Normalized();
+    }
+    // Rotation matrix of a unit quaternion, without going through a 4x4 product
+    inline glm::mat3 ToMat3() const
+    {
+        const r32 x2 = x + x, y2 = y + y, z2 = z + z;
+        const r32 xx = x * x2, yy = y * y2, zz = z * z2;
+        const r32 xy = x * y2, xz = x * z2, yz = y * z2;
+        const r32 wx = w * x2, wy = w * y2, wz = w * z2;
+
+        // glm is column major
+        return glm::mat3(
+            1.0f - yy - zz, xy + wz, xz - wy,
+            xy - wz, 1.0f - xx - zz, yz + wx,
+            xz + wy, yz - wx, 1.0f - xx - yy);
+    }
 
     inline static Quaternion Identity()
     {
@@ -36,6 +78,9 @@ public:
     {
         return Euler({ x,y,z });
     }
+    // Both interpolate along the shorter arc. Nlerp is cheaper but doesn't keep a constant angular speed.
+    inline static Quaternion Nlerp(const Quaternion& a, const Quaternion& b, r32 t);
+    inline static Quaternion Slerp(const Quaternion& a, const Quaternion& b, r32 t);
 };
 
 inline bool operator==(const Quaternion& a, const Quaternion& b)
@@ -48,11 +93,18 @@ inline bool operator!=(const Quaternion& a, const Quaternion& b)
 }
 inline Quaternion operator*(const Quaternion& a, const Quaternion& b)
 {
-    //This is called a Hamilton product
-    return Quaternion(a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
-        a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
-        a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
-        a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z);
+    //This is called a Hamilton product.
+    //Each component of a scales a signed permutation of b.
+    const __m128 bv = b.Simd();
+    const __m128 wzyx = _mm_mul_ps(_mm_shuffle_ps(bv, bv, _MM_SHUFFLE(0, 1, 2, 3)), _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f));
+    const __m128 zwxy = _mm_mul_ps(_mm_shuffle_ps(bv, bv, _MM_SHUFFLE(1, 0, 3, 2)), _mm_setr_ps(1.0f, 1.0f, -1.0f, -1.0f));
+    const __m128 yxwz = _mm_mul_ps(_mm_shuffle_ps(bv, bv, _MM_SHUFFLE(2, 3, 0, 1)), _mm_setr_ps(-1.0f, 1.0f, 1.0f, -1.0f));
+
+    __m128 result = _mm_mul_ps(_mm_set1_ps(a.w), bv);
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(a.x), wzyx));
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(a.y), zwxy));
+    result = _mm_add_ps(result, _mm_mul_ps(_mm_set1_ps(a.z), yxwz));
+    return Quaternion(result);
 }
 inline Quaternion& operator*=(Quaternion& a, const Quaternion& b)
 {
@@ -61,15 +113,49 @@ inline Quaternion& operator*=(Quaternion& a, const Quaternion& b)
 }
 inline glm::vec3 operator*(const Quaternion& q, const glm::vec3& v)
 {
-    // A vector3 is a quaternion with no real component, so we can do this:
-    Quaternion vQuat = { v.x, v.y, v.z, 0.0f };
-
-    Quaternion qResult = (q * vQuat) * q.Conjugate();
-    return { qResult.x, qResult.y, qResult.z };
+    // Expanded q * v * q^-1 for unit quaternions, two cross products instead of two Hamilton products
+    const glm::vec3 axis(q.x, q.y, q.z);
+    const glm::vec3 t = 2.0f * glm::cross(axis, v);
+    return v + q.w * t + glm::cross(axis, t);
 }
 
 inline Quaternion Quaternion::Euler(glm::vec3 angles)
 {
     //rotation order ZYX
     return AngleAxis(angles.x, { 1,0,0 }) * AngleAxis(angles.y, { 0,1,0 }) * AngleAxis(angles.z, { 0,0,1 });
-}
\ No newline at end of file
+}
+
+inline Quaternion Quaternion::Nlerp(const Quaternion& a, const Quaternion& b, r32 t)
+{
+    const r32 bWeight = a.Dot(b) < 0.0f ? -t : t;
+    const __m128 result = _mm_add_ps(_mm_mul_ps(a.Simd(), _mm_set1_ps(1.0f - t)), _mm_mul_ps(b.Simd(), _mm_set1_ps(bWeight)));
+    return Quaternion(result).Normalized();
+}
+
+inline Quaternion Quaternion::Slerp(const Quaternion& a, const Quaternion& b, r32 t)
+{
+    r32 cosTheta = a.Dot(b);
+    r32 sign = 1.0f;
+    if (cosTheta < 0.0f)
+    {
+        cosTheta = -cosTheta;
+        sign = -1.0f;
+    }
+
+    // Nearly parallel, sin(theta) would divide by almost zero
+    if (cosTheta > 0.9995f)
+    {
+        return Nlerp(a, b, t);
+    }
+
+    const r32 theta = std::acos(cosTheta);
+    const r32 invSinTheta = 1.0f / std::sin(theta);
+    const r32 aWeight = std::sin((1.0f - t) * theta) * invSinTheta;
+    const r32 bWeight = std::sin(t * theta) * invSinTheta * sign;
+    return Quaternion(_mm_add_ps(_mm_mul_ps(a.Simd(), _mm_set1_ps(aWeight)), _mm_mul_ps(b.Simd(), _mm_set1_ps(bWeight))));
+}
+
+// Batch versions, four elements per iteration. Quaternions have to be normalized.
+void RotateVectors(const Quaternion* rotations, const glm::vec3* vectors, glm::vec3* outVectors, u32 count);
+// Uses a polynomial estimate of the slerp weights instead of acos and sin, accurate to about 1e-6
+void Slerp(const Quaternion* from, const Quaternion* to, r32 t, Quaternion* outRotations, u32 count);
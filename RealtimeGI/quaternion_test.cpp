@@ -0,0 +1,190 @@
+// Checks the SSE quaternion math against a plain double precision version and measures its throughput.
+#include "quaternion.h"
+#include "test_harness.h"
+#include <random>
+#include <vector>
+
+struct QuaternionD {
+    r64 x, y, z, w;
+};
+
+struct Vector3D {
+    r64 x, y, z;
+};
+
+static QuaternionD ToDouble(const Quaternion& q) {
+    return { q.x, q.y, q.z, q.w };
+}
+
+// Hamilton product written out term by term
+static QuaternionD Multiply(const QuaternionD& a, const QuaternionD& b) {
+    return {
+        a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+        a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+        a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+        a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z
+    };
+}
+
+// q * v * q^-1 with two full products
+static Vector3D Rotate(const QuaternionD& q, const glm::vec3& v) {
+    const QuaternionD result = Multiply(Multiply(q, { v.x, v.y, v.z, 0.0 }), { -q.x, -q.y, -q.z, q.w });
+    return { result.x, result.y, result.z };
+}
+
+static QuaternionD Slerp(const QuaternionD& a, QuaternionD b, r64 t) {
+    r64 cosTheta = a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+    if (cosTheta < 0.0) {
+        cosTheta = -cosTheta;
+        b = { -b.x, -b.y, -b.z, -b.w };
+    }
+    if (cosTheta > 1.0 - 1e-12) {
+        return a;
+    }
+    const r64 theta = std::acos(cosTheta);
+    const r64 aWeight = std::sin((1.0 - t) * theta) / std::sin(theta);
+    const r64 bWeight = std::sin(t * theta) / std::sin(theta);
+    return { a.x * aWeight + b.x * bWeight, a.y * aWeight + b.y * bWeight, a.z * aWeight + b.z * bWeight, a.w * aWeight + b.w * bWeight };
+}
+
+static r64 Difference(const Quaternion& a, const QuaternionD& b) {
+    return std::fmax(std::fmax(std::fabs(a.x - b.x), std::fabs(a.y - b.y)), std::fmax(std::fabs(a.z - b.z), std::fabs(a.w - b.w)));
+}
+
+static r64 Difference(const glm::vec3& a, const Vector3D& b) {
+    return std::fmax(std::fmax(std::fabs(a.x - b.x), std::fabs(a.y - b.y)), std::fabs(a.z - b.z));
+}
+
+static std::vector<Quaternion> MakeRotations(u32 count, u32 seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<r32> unit(-1.0f, 1.0f);
+    std::vector<Quaternion> rotations(count);
+    for (Quaternion& rotation : rotations) {
+        rotation = Quaternion(unit(rng), unit(rng), unit(rng), unit(rng)).Normalized();
+    }
+    // Includes the cases where slerp falls back to nlerp or has to flip one side
+    rotations[0] = Quaternion::Identity();
+    rotations[1] = Quaternion::AngleAxis(1e-4f, { 0, 1, 0 });
+    rotations[2] = Quaternion::AngleAxis(3.1f, { 1, 1, 0 });
+    return rotations;
+}
+
+static std::vector<glm::vec3> MakeVectors(u32 count) {
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<r32> unit(-1.0f, 1.0f);
+    std::vector<glm::vec3> vectors(count);
+    for (glm::vec3& vector : vectors) {
+        vector = glm::vec3(unit(rng), unit(rng), unit(rng)) * 10.0f;
+    }
+    return vectors;
+}
+
+static void CheckAccuracy() {
+    // Not a multiple of four, so the batch functions run their scalar tails too
+    const u32 count = 4099;
+    const std::vector<Quaternion> a = MakeRotations(count, 1);
+    const std::vector<Quaternion> b = MakeRotations(count, 2);
+    const std::vector<glm::vec3> vectors = MakeVectors(count);
+
+    r64 worstProduct = 0.0, worstRotation = 0.0, worstBatchRotation = 0.0;
+    std::vector<glm::vec3> rotated(count);
+    RotateVectors(a.data(), vectors.data(), rotated.data(), count);
+    for (u32 i = 0; i < count; i++) {
+        worstProduct = std::fmax(worstProduct, Difference(a[i] * b[i], Multiply(ToDouble(a[i]), ToDouble(b[i]))));
+        const Vector3D expected = Rotate(ToDouble(a[i]), vectors[i]);
+        worstRotation = std::fmax(worstRotation, Difference(a[i] * vectors[i], expected));
+        worstBatchRotation = std::fmax(worstBatchRotation, Difference(rotated[i], expected));
+    }
+    // Unit quaternions, so the product stays within a few ulps of 1. Vectors are up to 17 long.
+    TEST_CHECK(worstProduct <= 1e-6, "Quaternion product is off by %g", worstProduct);
+    TEST_CHECK(worstRotation <= 1e-5, "Quaternion * vec3 is off by %g", worstRotation);
+    TEST_CHECK(worstBatchRotation <= 1e-5, "RotateVectors is off by %g", worstBatchRotation);
+    printf("Largest error: product %g, rotation %g, RotateVectors %g\n", worstProduct, worstRotation, worstBatchRotation);
+
+    const r32 ts[] = { 0.0f, 0.1f, 0.5f, 0.77f, 1.0f };
+    r64 worstSlerp = 0.0, worstBatchSlerp = 0.0;
+    std::vector<Quaternion> slerped(count);
+    for (r32 t : ts) {
+        Slerp(a.data(), b.data(), t, slerped.data(), count);
+        for (u32 i = 0; i < count; i++) {
+            const QuaternionD expected = Slerp(ToDouble(a[i]), ToDouble(b[i]), t);
+            worstSlerp = std::fmax(worstSlerp, Difference(Quaternion::Slerp(a[i], b[i], t), expected));
+            worstBatchSlerp = std::fmax(worstBatchSlerp, Difference(slerped[i], expected));
+        }
+    }
+    // The batch version's polynomial is good to about 1e-6, float rounding adds a little
+    TEST_CHECK(worstSlerp <= 1e-5, "Quaternion::Slerp is off by %g", worstSlerp);
+    TEST_CHECK(worstBatchSlerp <= 1e-5, "Batch Slerp is off by %g", worstBatchSlerp);
+    printf("Largest error: Quaternion::Slerp %g, batch Slerp %g\n", worstSlerp, worstBatchSlerp);
+}
+
+// Scalar float versions of the same operations, what the code did before SSE
+static Quaternion MultiplyScalar(const Quaternion& a, const Quaternion& b) {
+    return Quaternion(
+        a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+        a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+        a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+        a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z);
+}
+
+static glm::vec3 RotateScalar(const Quaternion& q, const glm::vec3& v) {
+    const Quaternion result = MultiplyScalar(MultiplyScalar(q, Quaternion(v.x, v.y, v.z, 0.0f)), q.Conjugate());
+    return { result.x, result.y, result.z };
+}
+
+static void TimeThroughput() {
+    const u32 count = 65536;
+    const std::vector<Quaternion> a = MakeRotations(count, 1);
+    const std::vector<Quaternion> b = MakeRotations(count, 2);
+    const std::vector<glm::vec3> vectors = MakeVectors(count);
+    std::vector<Quaternion> outRotations(count);
+    std::vector<glm::vec3> outVectors(count);
+    const u32 runs = 50;
+
+    const r64 productScalar = TimeBestOf(runs, [&] {
+        for (u32 i = 0; i < count; i++) {
+            outRotations[i] = MultiplyScalar(a[i], b[i]);
+        }
+        DoNotOptimize(outRotations[0]);
+    });
+    const r64 product = TimeBestOf(runs, [&] {
+        for (u32 i = 0; i < count; i++) {
+            outRotations[i] = a[i] * b[i];
+        }
+        DoNotOptimize(outRotations[0]);
+    });
+
+    const r64 rotateScalar = TimeBestOf(runs, [&] {
+        for (u32 i = 0; i < count; i++) {
+            outVectors[i] = RotateScalar(a[i], vectors[i]);
+        }
+        DoNotOptimize(outVectors[0]);
+    });
+    const r64 rotate = TimeBestOf(runs, [&] {
+        for (u32 i = 0; i < count; i++) {
+            outVectors[i] = a[i] * vectors[i];
+        }
+        DoNotOptimize(outVectors[0]);
+    });
+    const r64 rotateBatch = TimeBestOf(runs, [&] { RotateVectors(a.data(), vectors.data(), outVectors.data(), count); DoNotOptimize(outVectors[0]); });
+
+    const r64 slerp = TimeBestOf(runs, [&] {
+        for (u32 i = 0; i < count; i++) {
+            outRotations[i] = Quaternion::Slerp(a[i], b[i], 0.3f);
+        }
+        DoNotOptimize(outRotations[0]);
+    });
+    const r64 slerpBatch = TimeBestOf(runs, [&] { Slerp(a.data(), b.data(), 0.3f, outRotations.data(), count); DoNotOptimize(outRotations[0]); });
+
+    printf("%u elements, best of %u runs, millions per second\n", count, runs);
+    printf("  product: scalar %7.1f  SSE %7.1f\n", count / productScalar / 1000.0, count / product / 1000.0);
+    printf("  rotate:  two products %7.1f  operator* %7.1f  RotateVectors %7.1f\n",
+        count / rotateScalar / 1000.0, count / rotate / 1000.0, count / rotateBatch / 1000.0);
+    printf("  slerp:   Quaternion::Slerp %7.1f  batch Slerp %7.1f\n", count / slerp / 1000.0, count / slerpBatch / 1000.0);
+}
+
+int main() {
+    CheckAccuracy();
+    TimeThroughput();
+    return TestResult();
+}
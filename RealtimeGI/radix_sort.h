@@ -0,0 +1,149 @@
+#pragma once
+#include "typedef.h"
+#include "job_system.h"
+#include <vector>
+#include <cstring>
+
+// Stable LSD radix sort over the 64-bit value returned by T::Key(), 8 bits per pass.
+// All byte histograms are built in one read pass, and bytes that are identical in every key are skipped,
+// so only the key bits that are actually in use cost a pass.
+// scratch must have room for count elements. The sorted result always ends up in items.
+template<class T>
+void RadixSort(T* items, T* scratch, u32 count) {
+	if (count < 2) {
+		return;
+	}
+
+	u32 histograms[8][256] = {};
+	u64 keyOr = 0;
+	u64 keyAnd = ~0ull;
+	for (u32 i = 0; i < count; i++) {
+		const u64 key = items[i].Key();
+		keyOr |= key;
+		keyAnd &= key;
+		for (u32 b = 0; b < 8; b++) {
+			histograms[b][(key >> (b * 8)) & 0xFF]++;
+		}
+	}
+	const u64 varyingBits = keyOr ^ keyAnd;
+
+	T* src = items;
+	T* dst = scratch;
+	for (u32 b = 0; b < 8; b++) {
+		const u32 shift = b * 8;
+		if (((varyingBits >> shift) & 0xFF) == 0) {
+			continue;
+		}
+
+		// Histogram to starting offsets
+		u32* offsets = histograms[b];
+		u32 offset = 0;
+		for (u32 d = 0; d < 256; d++) {
+			const u32 digitCount = offsets[d];
+			offsets[d] = offset;
+			offset += digitCount;
+		}
+
+		for (u32 i = 0; i < count; i++) {
+			const u32 digit = (src[i].Key() >> shift) & 0xFF;
+			dst[offsets[digit]++] = src[i];
+		}
+
+		T* temp = src;
+		src = dst;
+		dst = temp;
+	}
+
+	if (src != items) {
+		for (u32 i = 0; i < count; i++) {
+			items[i] = src[i];
+		}
+	}
+}
+
+// Same sort split over the job system's threads, for large arrays. Each thread counts and scatters its own chunk of the input,
+// chunks get consecutive output ranges within each digit, so the result is still stable.
+// Chunks change with every pass, so unlike the serial version each pass counts its byte again.
+static constexpr u32 minParallelRadixSortChunk = 8192;
+
+template<class T>
+void ParallelRadixSort(JobSystem& jobs, T* items, T* scratch, u32 count) {
+	const u32 maxChunkCount = count / minParallelRadixSortChunk;
+	const u32 chunkCount = jobs.ThreadCount() < maxChunkCount ? jobs.ThreadCount() : maxChunkCount;
+	if (chunkCount < 2) {
+		RadixSort(items, scratch, count);
+		return;
+	}
+
+	auto chunkBegin = [&](u32 chunk) { return (u32)((u64)count * chunk / chunkCount); };
+	std::vector<u64> keyOrs(chunkCount, 0);
+	std::vector<u64> keyAnds(chunkCount, ~0ull);
+	jobs.ParallelFor(chunkCount, 1, [&](u32 begin, u32 end) {
+		for (u32 c = begin; c < end; c++) {
+			for (u32 i = chunkBegin(c); i < chunkBegin(c + 1); i++) {
+				const u64 key = items[i].Key();
+				keyOrs[c] |= key;
+				keyAnds[c] &= key;
+			}
+		}
+	});
+	u64 keyOr = 0;
+	u64 keyAnd = ~0ull;
+	for (u32 c = 0; c < chunkCount; c++) {
+		keyOr |= keyOrs[c];
+		keyAnd &= keyAnds[c];
+	}
+	const u64 varyingBits = keyOr ^ keyAnd;
+
+	std::vector<u32> offsets(chunkCount * 256);
+	T* src = items;
+	T* dst = scratch;
+	for (u32 b = 0; b < 8; b++) {
+		const u32 shift = b * 8;
+		if (((varyingBits >> shift) & 0xFF) == 0) {
+			continue;
+		}
+
+		jobs.ParallelFor(chunkCount, 1, [&](u32 begin, u32 end) {
+			for (u32 c = begin; c < end; c++) {
+				u32* histogram = &offsets[c * 256];
+				memset(histogram, 0, sizeof(u32) * 256);
+				for (u32 i = chunkBegin(c); i < chunkBegin(c + 1); i++) {
+					histogram[(src[i].Key() >> shift) & 0xFF]++;
+				}
+			}
+		});
+
+		// Digit major, chunk minor
+		u32 offset = 0;
+		for (u32 d = 0; d < 256; d++) {
+			for (u32 c = 0; c < chunkCount; c++) {
+				const u32 digitCount = offsets[c * 256 + d];
+				offsets[c * 256 + d] = offset;
+				offset += digitCount;
+			}
+		}
+
+		jobs.ParallelFor(chunkCount, 1, [&](u32 begin, u32 end) {
+			for (u32 c = begin; c < end; c++) {
+				u32* chunkOffsets = &offsets[c * 256];
+				for (u32 i = chunkBegin(c); i < chunkBegin(c + 1); i++) {
+					const u32 digit = (src[i].Key() >> shift) & 0xFF;
+					dst[chunkOffsets[digit]++] = src[i];
+				}
+			}
+		});
+
+		T* temp = src;
+		src = dst;
+		dst = temp;
+	}
+
+	if (src != items) {
+		jobs.ParallelFor(count, minParallelRadixSortChunk, [&](u32 begin, u32 end) {
+			for (u32 i = begin; i < end; i++) {
+				items[i] = src[i];
+			}
+		});
+	}
+}
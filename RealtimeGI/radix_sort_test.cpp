@@ -0,0 +1,109 @@
+// Checks RadixSort and ParallelRadixSort against std::stable_sort and compares their speed with std::sort.
+#include "radix_sort.h"
+#include "test_harness.h"
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// Same shape as a Drawcall: the key, plus where the item started so stability can be checked
+struct SortItem {
+    u64 key;
+    u32 original;
+
+    u64 Key() const {
+        return key;
+    }
+};
+
+enum KeyPattern {
+    KEYS_DRAWCALLS, // Layer, 14-bit depth, few pipelines, materials and meshes, unique data index
+    KEYS_FEW_UNIQUE, // Lots of equal keys, stability matters
+    KEYS_RANDOM, // Every bit in use, the worst case with all eight passes
+};
+
+static const char* patternNames[] = { "drawcall keys", "few unique keys", "random 64-bit keys" };
+
+static std::vector<SortItem> MakeItems(u32 count, KeyPattern pattern, u32 seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<SortItem> items(count);
+    for (u32 i = 0; i < count; i++) {
+        u64 key = 0;
+        switch (pattern) {
+        case KEYS_DRAWCALLS:
+            key = (rng() % 3) << 62 | (rng() & 0x3FFF) << 48 | (rng() % 8) << 40 | (rng() % 64) << 28 | (rng() % 32) << 16 | (i & 0xFFFF);
+            break;
+        case KEYS_FEW_UNIQUE:
+            key = rng() % 16;
+            break;
+        case KEYS_RANDOM:
+            key = rng();
+            break;
+        }
+        items[i] = { key, i };
+    }
+    return items;
+}
+
+static bool SameOrder(const std::vector<SortItem>& a, const std::vector<SortItem>& b) {
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].key != b[i].key || a[i].original != b[i].original) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void CheckSorts(JobSystem& jobs, u32 count, KeyPattern pattern) {
+    const std::vector<SortItem> input = MakeItems(count, pattern, count * 3 + pattern);
+    std::vector<SortItem> expected = input;
+    std::stable_sort(expected.begin(), expected.end(), [](const SortItem& a, const SortItem& b) { return a.key < b.key; });
+
+    std::vector<SortItem> items = input;
+    std::vector<SortItem> scratch(count);
+    RadixSort(items.data(), scratch.data(), count);
+    TEST_CHECK(SameOrder(items, expected), "RadixSort differs from std::stable_sort, %u %s", count, patternNames[pattern]);
+
+    items = input;
+    ParallelRadixSort(jobs, items.data(), scratch.data(), count);
+    TEST_CHECK(SameOrder(items, expected), "ParallelRadixSort differs from std::stable_sort, %u %s", count, patternNames[pattern]);
+}
+
+static void TimeSorts(JobSystem& jobs, u32 count, KeyPattern pattern) {
+    const std::vector<SortItem> input = MakeItems(count, pattern, 7);
+    std::vector<SortItem> items(count);
+    std::vector<SortItem> scratch(count);
+    const u32 runs = count < 16384 ? 200 : 20;
+    auto less = [](const SortItem& a, const SortItem& b) { return a.key < b.key; };
+
+    // The copy back to unsorted input is part of every measurement, so the times are comparable
+    const r64 radix = TimeBestOf(runs, [&] { items = input; RadixSort(items.data(), scratch.data(), count); DoNotOptimize(items[0]); });
+    const r64 parallel = TimeBestOf(runs, [&] { items = input; ParallelRadixSort(jobs, items.data(), scratch.data(), count); DoNotOptimize(items[0]); });
+    const r64 sort = TimeBestOf(runs, [&] { items = input; std::sort(items.begin(), items.end(), less); DoNotOptimize(items[0]); });
+    const r64 stable = TimeBestOf(runs, [&] { items = input; std::stable_sort(items.begin(), items.end(), less); DoNotOptimize(items[0]); });
+
+    printf("%6u %-20s radix %8.3f  parallel radix %8.3f  std::sort %8.3f  std::stable_sort %8.3f ms  (%.1fx std::sort)\n",
+        count, patternNames[pattern], radix, parallel, sort, stable, sort / radix);
+}
+
+int main() {
+    // At least four threads, so the parallel sort splits even on small machines
+    const u32 workerCount = JobSystem::DefaultWorkerCount() > 3 ? JobSystem::DefaultWorkerCount() : 3;
+    JobSystem jobs(workerCount);
+
+    const u32 checkCounts[] = { 0, 1, 2, 3, 255, 256, 1000, 16384, 65536, 100000 };
+    for (u32 count : checkCounts) {
+        for (u32 pattern = 0; pattern < 3; pattern++) {
+            CheckSorts(jobs, count, (KeyPattern)pattern);
+        }
+    }
+
+    printf("Best of several runs, %u threads\n", jobs.ThreadCount());
+    const u32 timeCounts[] = { 1024, 16384, 65536 };
+    for (u32 count : timeCounts) {
+        for (u32 pattern = 0; pattern < 3; pattern++) {
+            TimeSorts(jobs, count, (KeyPattern)pattern);
+        }
+    }
+
+    return TestResult();
+}
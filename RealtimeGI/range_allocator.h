@@ -0,0 +1,105 @@
+#pragma once
+#include "typedef.h"
+#include <vector>
+
+// First-fit allocator for ranges of a fixed capacity, such as vertices in a shared vertex buffer.
+// Free ranges are kept sorted by offset, so that freed ranges merge back with their neighbours.
+class RangeAllocator
+{
+private:
+	struct Range {
+		u32 offset;
+		u32 count;
+	};
+
+	std::vector<Range> freeRanges;
+	u32 capacity;
+	u32 allocatedCount;
+public:
+	RangeAllocator() {
+		Init(0);
+	}
+	RangeAllocator(u32 c) {
+		Init(c);
+	}
+
+	void Init(u32 c) {
+		freeRanges.clear();
+		if (c > 0) {
+			freeRanges.push_back({ 0, c });
+		}
+		capacity = c;
+		allocatedCount = 0;
+	}
+	// Returns false if no free range is big enough
+	bool Allocate(u32 count, u32& outOffset) {
+		if (count == 0) {
+			return false;
+		}
+
+		for (u32 i = 0; i < freeRanges.size(); i++) {
+			Range& range = freeRanges[i];
+			if (range.count < count) {
+				continue;
+			}
+
+			outOffset = range.offset;
+			range.offset += count;
+			range.count -= count;
+			if (range.count == 0) {
+				freeRanges.erase(freeRanges.begin() + i);
+			}
+
+			allocatedCount += count;
+			return true;
+		}
+
+		return false;
+	}
+	void Free(u32 offset, u32 count) {
+		if (count == 0) {
+			return;
+		}
+
+		u32 i = 0;
+		while (i < freeRanges.size() && freeRanges[i].offset < offset) {
+			i++;
+		}
+
+		const bool mergePrev = i > 0 && freeRanges[i - 1].offset + freeRanges[i - 1].count == offset;
+		const bool mergeNext = i < freeRanges.size() && offset + count == freeRanges[i].offset;
+
+		if (mergePrev && mergeNext) {
+			freeRanges[i - 1].count += count + freeRanges[i].count;
+			freeRanges.erase(freeRanges.begin() + i);
+		}
+		else if (mergePrev) {
+			freeRanges[i - 1].count += count;
+		}
+		else if (mergeNext) {
+			freeRanges[i].offset = offset;
+			freeRanges[i].count += count;
+		}
+		else {
+			freeRanges.insert(freeRanges.begin() + i, { offset, count });
+		}
+
+		allocatedCount -= count;
+	}
+
+	u32 Capacity() const {
+		return capacity;
+	}
+	u32 AllocatedCount() const {
+		return allocatedCount;
+	}
+	u32 LargestFreeRange() const {
+		u32 largest = 0;
+		for (const Range& range : freeRanges) {
+			if (range.count > largest) {
+				largest = range.count;
+			}
+		}
+		return largest;
+	}
+};
@@ -1,16 +1,68 @@
 #include "renderer.h"
 #include "system.h"
-#include <algorithm>
+#include "math.h"
+#include "radix_sort.h"
+#include "profiler.h"
 
 namespace Rendering {
+	static constexpr u32 meshShift = Drawcall::indexBits;
+	static constexpr u32 materialShift = meshShift + Drawcall::meshBits;
+	static constexpr u32 pipelineShift = materialShift + Drawcall::materialBits;
+	static constexpr u32 depthShift = pipelineShift + Drawcall::pipelineBits;
+	static constexpr u32 layerShift = depthShift + Drawcall::depthBits;
+	static_assert(layerShift + Drawcall::layerBits == 64, "Drawcall key has to use exactly 64 bits");
+
+	// Only the slot index of a handle goes into the key, make sure live handles can never alias each other
+	static_assert(maxDrawcallCount <= (1u << Drawcall::indexBits));
+	static_assert(maxVertexBufferCount <= (1u << Drawcall::meshBits));
+	static_assert(maxMaterialCount <= (1u << Drawcall::materialBits));
+	static_assert(maxShaderCount <= (1u << Drawcall::pipelineBits));
+	static_assert(maxRenderObjectCount <= (1u << Drawcall::indexBits));
+
+	static_assert(maxRenderObjectCount <= maxDrawcallCount, "Retained draws are sorted with the render queue's scratch");
+	// Retained, instanced and immediate draws
+	static constexpr u32 maxForwardDrawCount = maxRenderObjectCount + maxDrawcallCount * 2;
+	// Smallest ranges handed to other threads, multiples of four so that only the last range has a scalar tail
+	static constexpr u32 cullGrainSize = 4096;
+	static constexpr u32 composeGrainSize = 1024;
+	// How far the camera can move, in world units, and turn, in radians, before the retained draws are culled again.
+	// Objects this close outside the view are drawn anyway and clipped by the GPU.
+	static constexpr r32 retainedCullMoveTolerance = 0.5f;
+	static constexpr r32 retainedCullTurnTolerance = 0.0349066f; // 2 degrees
+
+	static constexpr u64 KeyMask(u32 bits) {
+		return (1ull << bits) - 1;
+	}
+
+	// Moves the visible ones of count transforms from first on down to dstOffset, which may not be past first.
+	// Returns how many were visible.
+	static u32 CompactTransforms(TransformSoA& transforms, u32 first, u32 count, const u8* visible, u32 dstOffset) {
+		r32* const components[] = {
+			transforms.posX, transforms.posY, transforms.posZ,
+			transforms.rotX, transforms.rotY, transforms.rotZ, transforms.rotW,
+			transforms.scaleX, transforms.scaleY, transforms.scaleZ
+		};
+		u32 visibleCount = 0;
+		for (r32* component : components) {
+			visibleCount = 0;
+			for (u32 i = 0; i < count; i++) {
+				component[dstOffset + visibleCount] = component[first + i];
+				visibleCount += visible[i];
+			}
+		}
+		return visibleCount;
+	}
+
 	Drawcall::Drawcall(): id(0) {}
 	Drawcall::Drawcall(const Drawcall& other) : id(other.id) {}
-	Drawcall::Drawcall(u16 dataIndex, MeshHandle mesh, MaterialHandle mat, RenderLayer layer) {
+	Drawcall::Drawcall(u32 dataIndex, MeshHandle mesh, MaterialHandle mat, ShaderHandle shader, u16 depth, RenderLayer layer) {
 		id = 0;
-		id += (u64)(dataIndex % 0x1000);
-		id += (u64)mesh << 12;
-		id += (u64)mat << 20;
-		id += (u64)layer << 56;
+		id |= (u64)dataIndex & KeyMask(indexBits);
+		id |= ((u64)PoolHandleIndex(mesh) & KeyMask(meshBits)) << meshShift;
+		id |= ((u64)PoolHandleIndex(mat) & KeyMask(materialBits)) << materialShift;
+		id |= ((u64)PoolHandleIndex(shader) & KeyMask(pipelineBits)) << pipelineShift;
+		id |= ((u64)depth & KeyMask(depthBits)) << depthShift;
+		id |= ((u64)layer & KeyMask(layerBits)) << layerShift;
 	}
 
 	std::strong_ordering Drawcall::operator<=>(const Drawcall& other) const {
@@ -19,27 +71,86 @@ namespace Rendering {
 		else return std::strong_ordering::equal;
 	}
 
-	RenderLayer Drawcall::Layer() const {
-		return (RenderLayer)(id >> 56);
+	// Drawcalls that only differ by data index can be drawn with one instanced draw.
+	// Depth is part of the comparison, so transparent draws are only merged within the same depth bucket.
+	bool Drawcall::SameBatch(const Drawcall& other) const {
+		return (id >> meshShift) == (other.id >> meshShift);
+	}
+
+	u64 Drawcall::Key() const {
+		return id;
 	}
-	MaterialHandle Drawcall::Material() const {
-		return (MaterialHandle)((id >> 20) % 0x1000);
+
+	RenderLayer Drawcall::Layer() const {
+		return (RenderLayer)((id >> layerShift) & KeyMask(layerBits));
 	}
-	MeshHandle Drawcall::Mesh() const {
-		return (MeshHandle)((id >> 12) % 0x100);
+	u16 Drawcall::Depth() const {
+		return (u16)((id >> depthShift) & KeyMask(depthBits));
 	}
-	u16 Drawcall::DataIndex() const {
-		return (u16)(id % 0x1000);
+	u32 Drawcall::DataIndex() const {
+		return (u32)(id & KeyMask(indexBits));
 	}
 
 
-	Renderer::Renderer(HINSTANCE hInst, HWND hWindow): vulkan(hInst, hWindow) {
-		drawcallData = (DrawcallData*)calloc(maxDrawcallCount, sizeof(DrawcallData));
-		instanceData = (PerInstanceData*)calloc(maxInstanceCount, sizeof(PerInstanceData));
+#ifdef _WIN32
+	Renderer::Renderer(HINSTANCE hInst, HWND hWindow): jobs(), vulkan(hInst, hWindow, jobs) {
+		Initialize();
+	}
+#endif
+	Renderer::Renderer(u32 width, u32 height): jobs(), vulkan(width, height, jobs) {
+		Initialize();
+	}
 
+	void Renderer::Initialize() {
+		PROFILE_THREAD("Render");
+		drawcallData = (DrawcallData*)calloc(maxDrawcallCount, sizeof(DrawcallData));
 		renderQueue = (Drawcall*)calloc(maxDrawcallCount, sizeof(Drawcall));
+		renderQueueScratch = (Drawcall*)calloc(maxDrawcallCount, sizeof(Drawcall));
 		drawcallCount = 0;
-		instanceCount = 0;
+		submittedDrawCount = 0;
+
+		forwardDraws = (MeshDraw*)calloc(maxForwardDrawCount, sizeof(MeshDraw));
+		forwardDrawCount = 0;
+		sortedInstanceData = (PerInstanceData*)calloc(maxInstanceCount, sizeof(PerInstanceData));
+		immediateInstanceIndices = (u32*)calloc(maxInstanceCount, sizeof(u32));
+		instanceBatches = (InstanceBatch*)calloc(maxDrawcallCount, sizeof(InstanceBatch));
+		instanceBatchCount = 0;
+		batchTransforms = AllocTransforms(maxInstanceCount);
+		batchBounds = AllocSphereBounds(maxInstanceCount);
+		batchTransformCount = 0;
+		for (u32 i = 0; i < maxInstanceCount; i++) {
+			immediateInstanceIndices[i] = immediateInstanceOffset + i;
+		}
+
+		meshBounds = (MeshBounds*)calloc(maxVertexBufferCount, sizeof(MeshBounds));
+		drawcallBounds = AllocSphereBounds(maxDrawcallCount);
+		indirectObjectBounds = AllocSphereBounds(maxInstanceCount);
+		cullVisibility = (u8*)calloc(maxInstanceCount, sizeof(u8));
+
+		renderObjectHandles = (RenderObjectHandle*)calloc(maxRenderObjectCount, sizeof(RenderObjectHandle));
+		retainedDrawsDirty = true;
+		retainedQueue = (Drawcall*)calloc(maxRenderObjectCount, sizeof(Drawcall));
+		retainedDraws = (MeshDraw*)calloc(maxRenderObjectCount, sizeof(MeshDraw));
+		retainedDrawCount = 0;
+		retainedInstanceIndices = (u32*)calloc(maxRenderObjectCount, sizeof(u32));
+		retainedInstanceCount = 0;
+		retainedVisibleCount = 0;
+		retainedCullCamera = {};
+		retainedCullAspect = 0.0f;
+		retainedDrawsVersion = 1;
+		for (u32 i = 0; i < COMMAND_BUFFER_COUNT; i++) {
+			uploadedRetainedVersion[i] = 0;
+		}
+
+		gpuDrivenRendering = false;
+		frameIndex = 1;
+		indirectDrawSlots = (IndirectDrawSlot*)calloc(maxMaterialCount * maxVertexBufferCount, sizeof(IndirectDrawSlot));
+		indirectDraws = (IndirectDraw*)calloc(maxInstanceCount, sizeof(IndirectDraw));
+		indirectDrawCount = 0;
+		indirectObjects = (IndirectObject*)calloc(maxInstanceCount, sizeof(IndirectObject));
+		indirectInstanceData = (PerInstanceData*)calloc(maxInstanceCount, sizeof(PerInstanceData));
+		indirectObjectCount = 0;
+		frameStats = {};
 
 		mainCamera = Camera{};
 		lightingData = LightingData{};
@@ -47,26 +158,49 @@ namespace Rendering {
 
 	Renderer::~Renderer() {
 		free(drawcallData);
-		free(instanceData);
 		free(renderQueue);
+		free(renderQueueScratch);
+		free(forwardDraws);
+		free(meshBounds);
+		FreeSphereBounds(drawcallBounds);
+		FreeSphereBounds(indirectObjectBounds);
+		free(cullVisibility);
+		free(renderObjectHandles);
+		free(retainedQueue);
+		free(retainedDraws);
+		free(retainedInstanceIndices);
+		free(indirectDrawSlots);
+		free(indirectDraws);
+		free(indirectObjects);
+		free(indirectInstanceData);
+		free(sortedInstanceData);
+		free(immediateInstanceIndices);
+		free(instanceBatches);
+		FreeTransforms(batchTransforms);
+		FreeSphereBounds(batchBounds);
 	}
 
 	MeshHandle Renderer::CreateMesh(std::string name, const MeshCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateMesh");
 		if (meshNameMap.contains(name)) {
 			DEBUG_LOG("Mesh with name %s already exists", name.c_str());
 			return -1;
 		}
 
-		if (info.triangles == nullptr) {
+		if (info.triangles == nullptr && info.triangles32 == nullptr) {
 			DEBUG_ERROR("Triangles cannot be null");
 		}
 
 		auto handle = vulkan.CreateMesh(info);
 		meshNameMap[name] = handle;
+		if (handle >= 0) {
+			meshBounds[PoolHandleIndex(handle)] = ComputeMeshBounds(info.position, info.vertexCount);
+		}
 		return handle;
 	}
 
 	TextureHandle Renderer::CreateTexture(std::string name, const TextureCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateTexture");
 		if (textureNameMap.contains(name)) {
 			DEBUG_LOG("Texture with name %s already exists", name.c_str());
 			return -1;
@@ -77,7 +211,54 @@ namespace Rendering {
 		return handle;
 	}
 
+	MeshHandle Renderer::CreateMeshAsync(std::string name, const MeshCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateMeshAsync");
+		if (meshNameMap.contains(name)) {
+			DEBUG_LOG("Mesh with name %s already exists", name.c_str());
+			return -1;
+		}
+
+		if (info.triangles == nullptr && info.triangles32 == nullptr) {
+			DEBUG_ERROR("Triangles cannot be null");
+		}
+
+		auto handle = vulkan.CreateMeshAsync(info);
+		meshNameMap[name] = handle;
+		if (handle >= 0) {
+			meshBounds[PoolHandleIndex(handle)] = ComputeMeshBounds(info.position, info.vertexCount);
+		}
+		return handle;
+	}
+
+	TextureHandle Renderer::CreateTextureAsync(std::string name, const TextureCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateTextureAsync");
+		if (textureNameMap.contains(name)) {
+			DEBUG_LOG("Texture with name %s already exists", name.c_str());
+			return -1;
+		}
+
+		auto handle = vulkan.CreateTextureAsync(info);
+		textureNameMap[name] = handle;
+		return handle;
+	}
+
+	bool Renderer::IsMeshReady(MeshHandle mesh) {
+		return vulkan.IsMeshReady(mesh);
+	}
+
+	bool Renderer::IsTextureReady(TextureHandle texture) {
+		return vulkan.IsTextureReady(texture);
+	}
+
 	ShaderHandle Renderer::CreateShader(std::string name, const ShaderCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateShader");
+		ShaderHandle handle = CreateShaderAsync(name, info);
+		vulkan.CompilePendingShaders();
+		return handle;
+	}
+
+	ShaderHandle Renderer::CreateShaderAsync(std::string name, const ShaderCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateShaderAsync");
 		if (shaderNameMap.contains(name)) {
 			DEBUG_LOG("Shader with name %s already exists", name.c_str());
 			return -1;
@@ -87,13 +268,21 @@ namespace Rendering {
 			DEBUG_ERROR("Data size too large");
 		}
 
-		auto handle = vulkan.CreateShader(info);
-		meshNameMap[name] = handle;
+		auto handle = vulkan.CreateShaderAsync(info);
+		if (handle < 0) {
+			return -1;
+		}
+		shaderNameMap[name] = handle;
 		shaderMetadataMap[handle] = info.metadata;
 		return handle;
 	}
 
+	bool Renderer::IsShaderReady(ShaderHandle shader) {
+		return vulkan.IsShaderReady(shader);
+	}
+
 	MaterialHandle Renderer::CreateMaterial(std::string name, const MaterialCreateInfo& info) {
+		PROFILE_ZONE("Renderer::CreateMaterial");
 		if (materialNameMap.contains(name)) {
 			DEBUG_LOG("Material with name %s already exists", name.c_str());
 			return -1;
@@ -127,47 +316,429 @@ namespace Rendering {
 	}
 
 	void Renderer::DrawMesh(MeshHandle mesh, MaterialHandle material, const Transform& transform) {
-		u16 instanceOffset = instanceCount++;
-		u16 callIndex = drawcallCount++;
+		PROFILE_ZONE("Renderer::DrawMesh");
+		const glm::mat4 model = GetTransformMatrix(transform);
+		glm::vec3 worldCenter;
+		r32 worldRadius;
+		GetWorldBounds(mesh, model, transform.scale, worldCenter, worldRadius);
+
+		submittedDrawCount++;
+		QueueDraw(mesh, material, model, worldCenter, worldRadius);
+	}
+
+	void Renderer::DrawMeshInstances(MeshHandle mesh, MaterialHandle material, const TransformSoA& transforms, u32 count) {
+		PROFILE_ZONE("Renderer::DrawMeshInstances");
+		if (count == 0) {
+			return;
+		}
+
+		if (instanceBatchCount >= maxDrawcallCount || drawcallCount + indirectObjectCount + batchTransformCount + count > maxInstanceCount) {
+			DEBUG_LOG("Render queue full, skipping instances");
+			return;
+		}
+
+		ShaderHandle shader = materialMetadataMap[material].shader;
+		if (!vulkan.IsMeshReady(mesh) || !vulkan.IsShaderReady(shader)) {
+			return;
+		}
+
+		if (shaderMetadataMap[shader].layer == RENDER_LAYER_TRANSPARENT) {
+			DEBUG_LOG("Instanced transparent meshes aren't supported, they can't be sorted");
+			return;
+		}
+
+		CopyTransforms(transforms, 0, batchTransforms, batchTransformCount, count);
+		const MeshBounds& bounds = meshBounds[PoolHandleIndex(mesh)];
+		for (u32 i = 0; i < count; i++) {
+			const glm::vec3 scale(transforms.scaleX[i], transforms.scaleY[i], transforms.scaleZ[i]);
+			const Quaternion rotation(transforms.rotX[i], transforms.rotY[i], transforms.rotZ[i], transforms.rotW[i]);
+			const glm::vec3 center = glm::vec3(transforms.posX[i], transforms.posY[i], transforms.posZ[i]) + rotation * (bounds.center * scale);
+			const glm::vec3 absScale = glm::abs(scale);
+			SetSphereBounds(batchBounds, batchTransformCount + i, center, bounds.radius * MAX(absScale.x, MAX(absScale.y, absScale.z)));
+		}
+		instanceBatches[instanceBatchCount++] = { mesh, material, batchTransformCount, count };
+		batchTransformCount += count;
+	}
 
-		DrawcallData data = { 1, instanceOffset };
+	RenderObjectHandle Renderer::CreateRenderObject(MeshHandle mesh, MaterialHandle material, const Transform& transform) {
+		PROFILE_ZONE("Renderer::CreateRenderObject");
+		RenderObject object{};
+		object.mesh = mesh;
+		object.material = material;
+		object.model = GetTransformMatrix(transform);
+		GetWorldBounds(mesh, object.model, transform.scale, object.worldCenter, object.worldRadius);
+
+		RenderObjectHandle handle = renderObjects.Add(object);
+		if (handle < 0) {
+			DEBUG_LOG("Too many render objects");
+			return -1;
+		}
 
-		drawcallData[callIndex] = data;
-		
-		instanceData[instanceOffset] = { GetTransformMatrix(transform) };
+		const MeshBounds& bounds = meshBounds[PoolHandleIndex(mesh)];
+		renderObjects[handle].bvhLeaf = sceneBvh.Insert(TransformAABB({ bounds.aabbMin, bounds.aabbMax }, object.model), (u32)handle);
+		renderObjectHandles[PoolHandleIndex(handle)] = handle;
+		MarkRenderObjectDirty(handle);
+		retainedDrawsDirty = true;
+		return handle;
+	}
 
-		RenderLayer layer = shaderMetadataMap[materialMetadataMap[material].shader].layer;
-		Drawcall call(callIndex, mesh, material, layer);
+	void Renderer::UpdateRenderObject(RenderObjectHandle handle, const Transform& transform) {
+		PROFILE_ZONE("Renderer::UpdateRenderObject");
+		if (!renderObjects.Contains(handle)) {
+			DEBUG_LOG("Invalid render object handle");
+			return;
+		}
+
+		RenderObject& object = renderObjects[handle];
+		object.model = GetTransformMatrix(transform);
+		GetWorldBounds(object.mesh, object.model, transform.scale, object.worldCenter, object.worldRadius);
+		MarkRenderObjectDirty(handle);
+
+		// Visibility is tested against the fattened boxes, it can only change when the leaf moves
+		const MeshBounds& bounds = meshBounds[PoolHandleIndex(object.mesh)];
+		if (sceneBvh.Update(object.bvhLeaf, TransformAABB({ bounds.aabbMin, bounds.aabbMax }, object.model))) {
+			retainedDrawsDirty = true;
+		}
+	}
+
+	void Renderer::SetRenderObjectMaterial(RenderObjectHandle handle, MaterialHandle material) {
+		if (!renderObjects.Contains(handle)) {
+			DEBUG_LOG("Invalid render object handle");
+			return;
+		}
+
+		RenderObject& object = renderObjects[handle];
+		if (object.material != material) {
+			object.material = material;
+			retainedDrawsDirty = true;
+		}
+	}
+
+	void Renderer::FreeRenderObject(RenderObjectHandle handle) {
+		if (!renderObjects.Contains(handle)) {
+			DEBUG_LOG("Invalid render object handle");
+			return;
+		}
+
+		sceneBvh.Remove(renderObjects[handle].bvhLeaf);
+		renderObjects.Remove(handle);
+		retainedDrawsDirty = true;
+	}
+
+	void Renderer::MarkRenderObjectDirty(RenderObjectHandle handle) {
+		RenderObject& object = renderObjects[handle];
+		if (object.dirtyFrames == 0) {
+			dirtyObjects.push_back(handle);
+		}
+		object.dirtyFrames = COMMAND_BUFFER_COUNT;
+	}
+
+	void Renderer::RebuildRetainedDraws(const Frustum& frustum) {
+		PROFILE_ZONE("Renderer::RebuildRetainedDraws");
+		queryResults.clear();
+		sceneBvh.QueryFrustum(frustum, queryResults);
+		retainedVisibleCount = (u32)queryResults.size();
+		retainedCullCamera = mainCamera;
+		retainedCullAspect = vulkan.GetSurfaceAspect();
+
+		bool pendingResources = false;
+		u32 queuedCount = 0;
+		retainedTransparentObjects.clear();
+		for (u32 handle : queryResults) {
+			const RenderObject& object = renderObjects[(RenderObjectHandle)handle];
+			ShaderHandle shader = materialMetadataMap[object.material].shader;
+			if (!vulkan.IsMeshReady(object.mesh) || !vulkan.IsShaderReady(shader)) {
+				pendingResources = true;
+				continue;
+			}
+
+			RenderLayer layer = shaderMetadataMap[shader].layer;
+			if (layer == RENDER_LAYER_TRANSPARENT) {
+				retainedTransparentObjects.push_back((RenderObjectHandle)handle);
+				continue;
+			}
+
+			retainedQueue[queuedCount++] = Drawcall(PoolHandleIndex((RenderObjectHandle)handle), object.mesh, object.material, shader, 0, layer);
+		}
+
+		ParallelRadixSort(jobs, retainedQueue, renderQueueScratch, queuedCount);
+
+		// Same merge as the immediate draws, but the instances are referenced by slot instead of copied
+		retainedDrawCount = 0;
+		for (u32 i = 0; i < queuedCount; i++) {
+			const Drawcall& call = retainedQueue[i];
+			const RenderObject& object = renderObjects[renderObjectHandles[call.DataIndex()]];
+			if (i == 0 || !call.SameBatch(retainedQueue[i - 1])) {
+				retainedDraws[retainedDrawCount++] = { object.mesh, materialMetadataMap[object.material].shader, object.material, i, 0 };
+			}
+			retainedDraws[retainedDrawCount - 1].instanceCount++;
+			retainedInstanceIndices[i] = call.DataIndex();
+		}
+		retainedInstanceCount = queuedCount;
+		retainedDrawsVersion++;
+
+		// Objects left out are added once their meshes finish uploading and their pipelines are compiled
+		retainedDrawsDirty = pendingResources;
+	}
+
+	void Renderer::UploadRetainedData() {
+		PROFILE_ZONE("Renderer::UploadRetainedData");
+		// Each frame writes its own region, so a transform is written once per region and then left alone
+		dirtySlots.clear();
+		dirtyInstanceData.clear();
+		u32 stillDirtyCount = 0;
+		for (RenderObjectHandle handle : dirtyObjects) {
+			if (!renderObjects.Contains(handle)) {
+				continue;
+			}
+
+			RenderObject& object = renderObjects[handle];
+			dirtySlots.push_back(PoolHandleIndex(handle));
+			dirtyInstanceData.push_back(ToInstanceData(object.model));
+			if (--object.dirtyFrames > 0) {
+				dirtyObjects[stillDirtyCount++] = handle;
+			}
+		}
+		dirtyObjects.resize(stillDirtyCount);
+		vulkan.SetObjectInstanceData(dirtySlots.data(), dirtyInstanceData.data(), (u32)dirtySlots.size());
+
+		const u32 frameSlot = vulkan.GetFrameSlot();
+		if (uploadedRetainedVersion[frameSlot] != retainedDrawsVersion) {
+			vulkan.SetInstanceIndices(retainedInstanceIndices, 0, retainedInstanceCount);
+			uploadedRetainedVersion[frameSlot] = retainedDrawsVersion;
+		}
+	}
+
+	void Renderer::CullSpheresParallel(const Frustum& frustum, const SphereBoundsSoA& bounds, u32 count, u8* outVisible) {
+		PROFILE_ZONE("Renderer::CullSpheresParallel");
+		jobs.ParallelFor((count + 3) / 4, cullGrainSize / 4, [&](u32 begin, u32 end) {
+			const u32 first = begin * 4;
+			const u32 last = MIN(end * 4, count);
+			CullSpheres(frustum, OffsetSphereBounds(bounds, first), last - first, outVisible + first);
+		});
+	}
+
+	void Renderer::QueryRenderObjects(const AABB& bounds, std::vector<RenderObjectHandle>& outObjects) {
+		queryResults.clear();
+		sceneBvh.QueryAABB(bounds, queryResults);
+		for (u32 handle : queryResults) {
+			outObjects.push_back((RenderObjectHandle)handle);
+		}
+	}
+
+	bool Renderer::Raycast(const glm::vec3& origin, const glm::vec3& direction, r32 maxDistance, RenderObjectHandle& outObject, r32& outDistance) {
+		u32 handle;
+		if (!sceneBvh.Raycast(origin, direction, maxDistance, handle, outDistance)) {
+			return false;
+		}
+
+		outObject = (RenderObjectHandle)handle;
+		return true;
+	}
+
+	void Renderer::GetWorldBounds(MeshHandle mesh, const glm::mat4& model, const glm::vec3& scale, glm::vec3& outCenter, r32& outRadius) const {
+		const MeshBounds& bounds = meshBounds[PoolHandleIndex(mesh)];
+		const glm::vec3 absScale = glm::abs(scale);
+		outCenter = glm::vec3(model * glm::vec4(bounds.center, 1.0f));
+		outRadius = bounds.radius * MAX(absScale.x, MAX(absScale.y, absScale.z));
+	}
+
+	void Renderer::QueueDraw(MeshHandle mesh, MaterialHandle material, const glm::mat4& model, const glm::vec3& worldCenter, r32 worldRadius) {
+		if (drawcallCount >= maxDrawcallCount || drawcallCount + indirectObjectCount + batchTransformCount >= maxInstanceCount) {
+			DEBUG_LOG("Render queue full, skipping drawcall");
+			return;
+		}
+
+		// Drawing a mesh that's still uploading would stall the frame until the upload is done
+		ShaderHandle shader = materialMetadataMap[material].shader;
+		if (!vulkan.IsMeshReady(mesh) || !vulkan.IsShaderReady(shader)) {
+			return;
+		}
+
+		RenderLayer layer = shaderMetadataMap[shader].layer;
+
+		// Opaque draws don't depend on order, so they can be grouped on the GPU without sorting
+		if (gpuDrivenRendering && layer == RENDER_LAYER_OPAQUE && vulkan.CanDrawIndirect(mesh)) {
+			IndirectDrawSlot& slot = indirectDrawSlots[PoolHandleIndex(material) * maxVertexBufferCount + PoolHandleIndex(mesh)];
+			if (slot.frameIndex != frameIndex) {
+				slot.frameIndex = frameIndex;
+				slot.drawIndex = indirectDrawCount++;
+				indirectDraws[slot.drawIndex] = { mesh, shader, material, 0 };
+			}
+
+			indirectDraws[slot.drawIndex].maxInstanceCount++;
+			SetSphereBounds(indirectObjectBounds, indirectObjectCount, worldCenter, worldRadius);
+			indirectInstanceData[indirectObjectCount] = ToInstanceData(model);
+			indirectObjects[indirectObjectCount++].drawIndex = slot.drawIndex;
+			return;
+		}
+
+		u32 callIndex = drawcallCount++;
+
+		drawcallData[callIndex] = { mesh, material, ToInstanceData(model) };
+		SetSphereBounds(drawcallBounds, callIndex, worldCenter, worldRadius);
+
+		// Opaque geometry is sorted by state only, so that instances can be merged.
+		// Transparent geometry has to be drawn back to front.
+		u16 depth = 0;
+		if (layer == RENDER_LAYER_TRANSPARENT) {
+			glm::vec4 viewPos = mainCamera.data.view * model[3];
+			r32 normalizedDepth = clamp(-viewPos.z / mainCamera.farClip, 0.0f, 1.0f);
+			depth = (u16)((1.0f - normalizedDepth) * KeyMask(Drawcall::depthBits));
+		}
+
+		Drawcall call(callIndex, mesh, material, shader, depth, layer);
 
 		renderQueue[callIndex] = call;
 	}
 
 	void Renderer::Render() {
+		PROFILE_ZONE("Renderer::Render");
+		// Pipelines of shaders created since the last frame are compiled together, their draws start next frame
+		vulkan.CompilePendingShaders();
+
+		// Frustum culling, culled draws never get sorted or written to instance data
+		const Frustum frustum = ExtractFrustum(mainCamera.data.proj * mainCamera.data.view);
+
+		// Retained objects are culled hierarchically with some slack, the sorted draws of the survivors are reused until
+		// the camera leaves it or the objects change.
+		// Transparent ones still need a depth sort, so they're queued like any other draw.
+		if (retainedDrawsDirty) {
+			RebuildRetainedDraws(GetRetainedCullFrustum());
+		}
+		for (RenderObjectHandle handle : retainedTransparentObjects) {
+			const RenderObject& object = renderObjects[handle];
+			QueueDraw(object.mesh, object.material, object.model, object.worldCenter, object.worldRadius);
+		}
+
+		const u32 queuedDrawCount = drawcallCount;
+		const u32 queuedObjectCount = indirectObjectCount;
+
+		// The queue is still in submission order, so entry i belongs to drawcallData[i]
+		CullSpheresParallel(frustum, drawcallBounds, drawcallCount, cullVisibility);
+		u32 visibleCount = 0;
+		for (u32 i = 0; i < drawcallCount; i++) {
+			if (cullVisibility[i]) {
+				renderQueue[visibleCount++] = renderQueue[i];
+			}
+		}
+		drawcallCount = visibleCount;
+
+		CullSpheresParallel(frustum, indirectObjectBounds, indirectObjectCount, cullVisibility);
+		u32 visibleObjectCount = 0;
+		for (u32 i = 0; i < indirectObjectCount; i++) {
+			if (cullVisibility[i]) {
+				indirectInstanceData[visibleObjectCount] = indirectInstanceData[i];
+				indirectObjects[visibleObjectCount++] = indirectObjects[i];
+			}
+			else {
+				// Draws left without objects get no command from the compute shader
+				indirectDraws[indirectObjects[i].drawIndex].maxInstanceCount--;
+			}
+		}
+		indirectObjectCount = visibleObjectCount;
+
+		// Visible instances move to the front, each batch keeps a contiguous range and empty ones are dropped
+		const u32 queuedTransformCount = batchTransformCount;
+		CullSpheresParallel(frustum, batchBounds, batchTransformCount, cullVisibility);
+		u32 visibleTransformCount = 0;
+		u32 visibleBatchCount = 0;
+		for (u32 i = 0; i < instanceBatchCount; i++) {
+			const InstanceBatch batch = instanceBatches[i];
+			const u32 batchVisibleCount = CompactTransforms(batchTransforms, batch.firstTransform, batch.count, cullVisibility + batch.firstTransform, visibleTransformCount);
+			if (batchVisibleCount > 0) {
+				instanceBatches[visibleBatchCount++] = { batch.mesh, batch.material, visibleTransformCount, batchVisibleCount };
+				visibleTransformCount += batchVisibleCount;
+			}
+		}
+		batchTransformCount = visibleTransformCount;
+		instanceBatchCount = visibleBatchCount;
+
+		// Transparent render objects were queued above, so they're already in the draw counts
+		frameStats.instancesSubmitted = submittedDrawCount + renderObjects.Count() + queuedTransformCount;
+		frameStats.instancesCulled = (renderObjects.Count() - retainedVisibleCount) + (queuedDrawCount - drawcallCount) + (queuedObjectCount - indirectObjectCount) +
+			(queuedTransformCount - batchTransformCount);
+		frameStats.instancesDrawn = retainedInstanceCount + drawcallCount + indirectObjectCount + batchTransformCount;
+
 		// Sort drawcalls
-		std::sort(&renderQueue[0], &renderQueue[drawcallCount]);
+		{
+			PROFILE_ZONE("Sort");
+			ParallelRadixSort(jobs, renderQueue, renderQueueScratch, drawcallCount);
+		}
 
-		vulkan.SetInstanceData(instanceData, instanceCount);
-		vulkan.SetCameraData(mainCamera.data);
-		vulkan.SetLightingData(lightingData);
+		// Instance indices start with the retained draws, followed by the immediate ones, the indirect objects and the batches.
+		// Retained and batched draws are opaque, so they go before the sorted queue and its transparent draws.
+		const u32 batchInstanceOffset = drawcallCount + indirectObjectCount;
+		memcpy(forwardDraws, retainedDraws, sizeof(MeshDraw) * retainedDrawCount);
+		forwardDrawCount = retainedDrawCount;
+		for (u32 i = 0; i < instanceBatchCount; i++) {
+			const InstanceBatch& batch = instanceBatches[i];
+			forwardDraws[forwardDrawCount++] = { batch.mesh, materialMetadataMap[batch.material].shader, batch.material, retainedInstanceCount + batchInstanceOffset + batch.firstTransform, batch.count };
+		}
 
-		vulkan.BeginRenderCommands();
-		vulkan.BeginForwardRenderPass();
+		// Merge neighbouring drawcalls with the same layer, material and mesh into instanced draws.
+		// Instance data is gathered in sorted order, so that each draw reads a contiguous range.
 		for (u32 i = 0; i < drawcallCount; i++) {
 			const Drawcall& call = renderQueue[i];
-			MeshHandle meshHandle = call.Mesh();
-			MaterialHandle matHandle = call.Material();
-			MaterialMetadata matData = materialMetadataMap[matHandle];
-			u16 dataIndex = call.DataIndex();
-			DrawcallData data = drawcallData[dataIndex];
-			vulkan.DrawMesh(meshHandle, matData.shader, matHandle, data.instanceOffset, data.instanceCount);
+			const DrawcallData& data = drawcallData[call.DataIndex()];
+			if (i == 0 || !call.SameBatch(renderQueue[i - 1])) {
+				forwardDraws[forwardDrawCount++] = { data.mesh, materialMetadataMap[data.material].shader, data.material, retainedInstanceCount + i, 0 };
+			}
+			forwardDraws[forwardDrawCount - 1].instanceCount++;
+			sortedInstanceData[i] = data.instance;
+		}
+
+		// Instance data of the indirect objects goes right behind, the compute shader writes their indices
+		memcpy(sortedInstanceData + drawcallCount, indirectInstanceData, sizeof(PerInstanceData) * indirectObjectCount);
+		for (u32 i = 0; i < indirectObjectCount; i++) {
+			indirectObjects[i].instanceIndex = immediateInstanceIndices[drawcallCount + i];
 		}
+
+		// Per-frame data can only be written once the previous use of this command buffer has finished
+		vulkan.BeginRenderCommands();
+		UploadRetainedData();
+		vulkan.SetInstanceData(sortedInstanceData, drawcallCount + indirectObjectCount);
+		vulkan.SetInstanceIndices(immediateInstanceIndices, retainedInstanceCount, drawcallCount);
+		// Batched instances come last, their matrices are written in place
+		PerInstanceData* batchInstances = vulkan.GetInstanceDataRange(batchInstanceOffset, batchTransformCount);
+		jobs.ParallelFor((batchTransformCount + 3) / 4, composeGrainSize / 4, [&](u32 begin, u32 end) {
+			const u32 first = begin * 4;
+			const u32 last = MIN(end * 4, batchTransformCount);
+			ComposeInstanceData(OffsetTransforms(batchTransforms, first), last - first, batchInstances + first);
+		});
+		vulkan.SetInstanceIndices(immediateInstanceIndices + batchInstanceOffset, retainedInstanceCount + batchInstanceOffset, batchTransformCount);
+		vulkan.SetIndirectDrawData(indirectDraws, indirectDrawCount, indirectObjects, indirectObjectCount, retainedInstanceCount + drawcallCount);
+		vulkan.SetCameraData(mainCamera.data);
+		vulkan.SetLightingData(lightingData);
+		vulkan.BuildIndirectDraws();
+
+		vulkan.BeginForwardRenderPass();
+		vulkan.DrawIndirect();
+		vulkan.DrawMeshes(forwardDraws, forwardDrawCount);
 		vulkan.EndRenderPass();
 		vulkan.DoFinalBlit();
 		vulkan.EndRenderCommands();
 
 		// Clear render queue
 		drawcallCount = 0;
-		instanceCount = 0;
+		submittedDrawCount = 0;
+		indirectDrawCount = 0;
+		indirectObjectCount = 0;
+		instanceBatchCount = 0;
+		batchTransformCount = 0;
+		frameIndex++;
+		PROFILE_FRAME();
+	}
+
+	void Renderer::SetGpuDrivenRendering(bool enabled) {
+		if (enabled && !vulkan.SupportsIndirectDraws()) {
+			DEBUG_LOG("GPU-driven rendering isn't supported on this device");
+		}
+		gpuDrivenRendering = enabled && vulkan.SupportsIndirectDraws();
+	}
+
+	bool Renderer::SupportsGpuDrivenRendering() const {
+		return vulkan.SupportsIndirectDraws();
 	}
 
 	void Renderer::ResizeSurface() {
@@ -176,24 +747,84 @@ namespace Rendering {
 		RecalculateCameraMatrices();
 	}
 
+	void Renderer::ReadbackFrame(u8* outPixels) {
+		vulkan.ReadbackFrame(outPixels);
+	}
+
+	void Renderer::ReadbackDrawCommands(std::vector<VkDrawIndexedIndirectCommand>& outCommands) {
+		outCommands.clear();
+		vulkan.ReadbackDrawCommands(forwardDraws, forwardDrawCount, outCommands);
+	}
+
+	r64 Renderer::GetGpuFrameMilliseconds() const {
+		return vulkan.GetGpuFrameMilliseconds();
+	}
+
+	void Renderer::GetGpuProfile(std::vector<GpuZoneStats>& outZones) const {
+		vulkan.GetGpuProfile(outZones);
+	}
+
+	void Renderer::StartGpuTrace() {
+		vulkan.StartGpuTrace();
+	}
+
+	bool Renderer::StopGpuTrace(const char* path) {
+		return vulkan.StopGpuTrace(path);
+	}
+
+	FrameStats Renderer::GetFrameStats() const {
+		FrameStats stats = vulkan.GetFrameStats();
+		stats.instancesSubmitted = frameStats.instancesSubmitted;
+		stats.instancesCulled = frameStats.instancesCulled;
+		stats.instancesDrawn = frameStats.instancesDrawn;
+		return stats;
+	}
+
 	glm::mat4x4 Renderer::GetTransformMatrix(const Transform& transform) const {
-		glm::mat4 translation = glm::translate(glm::mat4(1.0f), transform.position);
-		const Quaternion& rot = transform.rotation;
-		glm::mat4 rotation = {
-			1 - 2 * rot.y * rot.y - 2 * rot.z * rot.z, 2 * rot.x * rot.y + 2 * rot.z * rot.w, 2 * rot.x * rot.z - 2 * rot.y * rot.w, 0,
-			2 * rot.x * rot.y - 2 * rot.z * rot.w, 1 - 2 * rot.x * rot.x - 2 * rot.z * rot.z, 2 * rot.y * rot.z + 2 * rot.x * rot.w, 0,
-			2 * rot.x * rot.z + 2 * rot.y * rot.w, 2 * rot.y * rot.z - 2 * rot.x * rot.w, 1 - 2 * rot.x * rot.x - 2 * rot.y * rot.y, 0,
-			0, 0, 0, 1
-		};
-		glm::mat4 scale = glm::scale(glm::mat4(1.0f), transform.scale);
-		return translation * rotation * scale;
+		return ComposeTransform(transform);
 	}
 
+	Frustum Renderer::GetRetainedCullFrustum() const {
+		// Turning by up to the tolerance keeps the new view inside one that is that much wider on every side
+		const r32 aspect = vulkan.GetSurfaceAspect();
+		const r32 tanHalfFov = std::tan(glm::radians(mainCamera.fov) * 0.5f);
+		const r32 halfFov = std::atan(tanHalfFov) + retainedCullTurnTolerance;
+		const r32 halfFovX = std::atan(tanHalfFov * aspect) + retainedCullTurnTolerance;
+		const r32 wideTanHalfFov = std::tan(halfFov);
+		const r32 wideAspect = std::tan(halfFovX) / wideTanHalfFov;
+
+		// A point at the far plane of the turned view can be this much deeper along the old view direction
+		const r32 tanHalfDiagonal = tanHalfFov * std::sqrt(1.0f + aspect * aspect);
+		const r32 farScale = std::cos(retainedCullTurnTolerance) + std::sin(retainedCullTurnTolerance) * tanHalfDiagonal;
+		const glm::mat4 wideProj = glm::perspective(halfFov * 2.0f, wideAspect, mainCamera.nearClip, mainCamera.farClip * farScale);
+		Frustum frustum = ExtractFrustum(wideProj * mainCamera.data.view);
+
+		// Moving shifts each plane by at most the distance moved. The near plane is dropped, the side planes
+		// already meet behind the camera.
+		for (u32 i = 0; i < 6; i++) {
+			frustum.planes[i].w += retainedCullMoveTolerance;
+		}
+		frustum.planes[4].w += mainCamera.nearClip;
+		return frustum;
+	}
+
+	// The retained draws only depend on which objects are visible, so they're culled again once the camera
+	// has moved or turned further than the slack in GetRetainedCullFrustum or its projection changed.
 	void Renderer::RecalculateCameraMatrices() {
 		glm::mat4 transMat = GetTransformMatrix(mainCamera.transform);
 		mainCamera.data.view = glm::inverse(transMat);
 		r32 aspect = vulkan.GetSurfaceAspect();
 		mainCamera.data.proj = glm::perspective(glm::radians(mainCamera.fov), aspect, mainCamera.nearClip, mainCamera.farClip);
 		mainCamera.data.pos = mainCamera.transform.position;
+
+		const Camera& cullCamera = retainedCullCamera;
+		const bool moved = glm::length(mainCamera.transform.position - cullCamera.transform.position) > retainedCullMoveTolerance;
+		// The angle between two rotations is 2 * acos(|dot|)
+		const bool turned = std::fabs(mainCamera.transform.rotation.Dot(cullCamera.transform.rotation)) < std::cos(retainedCullTurnTolerance * 0.5f);
+		const bool projectionChanged = mainCamera.fov != cullCamera.fov || mainCamera.nearClip != cullCamera.nearClip ||
+			mainCamera.farClip != cullCamera.farClip || aspect != retainedCullAspect;
+		if (moved || turned || projectionChanged) {
+			retainedDrawsDirty = true;
+		}
 	}
 }
\ No newline at end of file
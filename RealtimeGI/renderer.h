@@ -1,60 +1,201 @@
 #pragma once
 #include "vulkan.h"
+#include "culling.h"
+#include "bvh.h"
+#include "transform_batch.h"
 #include <string>
 #include <unordered_map>
 #include <compare>
 
 namespace Rendering {
+	// Sort key, from most to least significant bits:
+	// layer (2) | depth (14) | pipeline (8) | material (12) | mesh (12) | data index (16)
 	class Drawcall {
 		u64 id;
 	public:
+		static constexpr u32 indexBits = 16;
+		static constexpr u32 meshBits = 12;
+		static constexpr u32 materialBits = 12;
+		static constexpr u32 pipelineBits = 8;
+		static constexpr u32 depthBits = 14;
+		static constexpr u32 layerBits = 2;
+
 		Drawcall();
 		Drawcall(const Drawcall& other);
-		Drawcall(u16 dataIndex, MeshHandle mesh, MaterialHandle mat, RenderLayer layer);
+		Drawcall(u32 dataIndex, MeshHandle mesh, MaterialHandle mat, ShaderHandle shader, u16 depth, RenderLayer layer);
 
+		Drawcall& operator=(const Drawcall& other) = default;
 		std::strong_ordering operator<=>(const Drawcall& other) const;
+		bool SameBatch(const Drawcall& other) const;
+		u64 Key() const;
 
 		RenderLayer Layer() const;
-		MaterialHandle Material() const;
-		MeshHandle Mesh() const;
-		u16 DataIndex() const;
+		u16 Depth() const;
+		u32 DataIndex() const;
 	};
 
 	class Renderer {
 	public:
+#ifdef _WIN32
 		Renderer(HINSTANCE hInst, HWND hWindow);
+#endif
+		// Offscreen rendering without a window, for benchmarks and tests. Frames are read back with ReadbackFrame.
+		Renderer(u32 width, u32 height);
 		~Renderer();
 
 		MeshHandle CreateMesh(std::string name, const MeshCreateInfo& data);
 		TextureHandle CreateTexture(std::string name, const TextureCreateInfo& info);
+		// Return without waiting for the GPU copy, meshes are skipped by DrawMesh until they're ready
+		MeshHandle CreateMeshAsync(std::string name, const MeshCreateInfo& data);
+		TextureHandle CreateTextureAsync(std::string name, const TextureCreateInfo& info);
+		bool IsMeshReady(MeshHandle mesh);
+		bool IsTextureReady(TextureHandle texture);
 		ShaderHandle CreateShader(std::string name, const ShaderCreateInfo& info);
+		// The pipeline is compiled at the start of the next Render, along with every other pending one, on all worker threads.
+		// Draws using it are skipped until then.
+		ShaderHandle CreateShaderAsync(std::string name, const ShaderCreateInfo& info);
+		bool IsShaderReady(ShaderHandle shader);
 		MaterialHandle CreateMaterial(std::string name, const MaterialCreateInfo& info);
 
 		void UpdateCamera(const Transform& transform, r32 fov = 35.0f, r32 nearClip = 0.01f, r32 farClip = 100.0f);
 		void UpdateMainLight(const Transform& transform, const Color& color);
 		void UpdateAmbientLight(const Color& color);
 		void DrawMesh(MeshHandle mesh, MaterialHandle material, const Transform& transform);
+		// One instanced draw for many copies of an opaque mesh, their matrices are built in batches straight into GPU memory.
+		// Meant for large sets like foliage or debris. Instances are culled one by one but never sorted.
+		void DrawMeshInstances(MeshHandle mesh, MaterialHandle material, const TransformSoA& transforms, u32 count);
+		// Opaque meshes drawn with DrawMesh from the shared geometry buffers skip the sort and are grouped into indirect draws on the GPU.
+		// Render objects keep using their cached draws. Ignored if the device doesn't support it.
+		void SetGpuDrivenRendering(bool enabled);
+		bool SupportsGpuDrivenRendering() const;
+
+		// Retained objects are kept in a BVH and drawn every frame without calling DrawMesh.
+		// Their instance data stays on the GPU and is only rewritten after an update, and their opaque draws
+		// are only sorted again when objects, materials or their visibility change. Stale or freed handles are ignored.
+		RenderObjectHandle CreateRenderObject(MeshHandle mesh, MaterialHandle material, const Transform& transform);
+		void UpdateRenderObject(RenderObjectHandle handle, const Transform& transform);
+		void SetRenderObjectMaterial(RenderObjectHandle handle, MaterialHandle material);
+		void FreeRenderObject(RenderObjectHandle handle);
+		// Tested against the objects' bounding boxes
+		void QueryRenderObjects(const AABB& bounds, std::vector<RenderObjectHandle>& outObjects);
+		bool Raycast(const glm::vec3& origin, const glm::vec3& direction, r32 maxDistance, RenderObjectHandle& outObject, r32& outDistance);
 
 		void Render();
 		void ResizeSurface();
+		// Tightly packed BGRA8, width * height * 4 bytes. Headless only, waits for the GPU.
+		void ReadbackFrame(u8* outPixels);
+		// Arguments of every draw the last Render issued, recorded on the CPU or built by the GPU-driven path. Waits for the GPU.
+		void ReadbackDrawCommands(std::vector<VkDrawIndexedIndirectCommand>& outCommands);
+		// Of a frame a few calls to Render back, negative if there isn't one yet
+		r64 GetGpuFrameMilliseconds() const;
+		// Per pass GPU timings, averages and percentiles over the last frames. Results trail Render by the frames in flight.
+		void GetGpuProfile(std::vector<GpuZoneStats>& outZones) const;
+		void StartGpuTrace();
+		// Writes the GPU zones of every frame since StartGpuTrace as Chrome trace JSON
+		bool StopGpuTrace(const char* path);
+		// Of the last Render. Memory is what's allocated right now.
+		FrameStats GetFrameStats() const;
 	private:
+		void Initialize();
 
 		glm::mat4x4 GetTransformMatrix(const Transform& transform) const;
 		void RecalculateCameraMatrices();
+		void GetWorldBounds(MeshHandle mesh, const glm::mat4& model, const glm::vec3& scale, glm::vec3& outCenter, r32& outRadius) const;
+		void QueueDraw(MeshHandle mesh, MaterialHandle material, const glm::mat4& model, const glm::vec3& worldCenter, r32 worldRadius);
+		void MarkRenderObjectDirty(RenderObjectHandle handle);
+		// The camera's frustum widened by the movement it can make before the retained draws have to be culled again
+		Frustum GetRetainedCullFrustum() const;
+		void RebuildRetainedDraws(const Frustum& frustum);
+		void UploadRetainedData();
+		void CullSpheresParallel(const Frustum& frustum, const SphereBoundsSoA& bounds, u32 count, u8* outVisible);
 
 		Camera mainCamera;
 		LightingData lightingData;
-		PerInstanceData *instanceData;
 
+		// Filled by DrawMesh, one per call
 		struct DrawcallData {
-			u16 instanceCount;
-			u16 instanceOffset;
+			MeshHandle mesh;
+			MaterialHandle material;
+			PerInstanceData instance;
 		} *drawcallData;
-
 		Drawcall* renderQueue;
-		u16 drawcallCount;
-		u16 instanceCount;
+		Drawcall* renderQueueScratch;
+		u32 drawcallCount;
+		u32 submittedDrawCount; // DrawMesh calls since the last Render, including skipped ones
+
+		// Built by Render after sorting, retained draws first, then instanced batches and the immediate draws.
+		// Recorded in parallel, so it's all handed to Vulkan at once.
+		MeshDraw* forwardDraws;
+		u32 forwardDrawCount;
+		PerInstanceData* sortedInstanceData; // Drawn from immediateInstanceOffset on
+		// Filled by DrawMeshInstances, converted to instance data during Render
+		struct InstanceBatch {
+			MeshHandle mesh;
+			MaterialHandle material;
+			u32 firstTransform;
+			u32 count;
+		} *instanceBatches;
+		u32 instanceBatchCount;
+		TransformSoA batchTransforms;
+		SphereBoundsSoA batchBounds;
+		u32 batchTransformCount;
+		u32* immediateInstanceIndices; // Always immediateInstanceOffset + i, copied in front of the immediate draws
+
+		MeshBounds* meshBounds; // By mesh slot
+		// World space bounds of everything queued by DrawMesh, culled at the start of Render
+		SphereBoundsSoA drawcallBounds;
+		SphereBoundsSoA indirectObjectBounds;
+		u8* cullVisibility;
+
+		// Instance data of each object lives in the slot matching its handle
+		struct RenderObject {
+			MeshHandle mesh;
+			MaterialHandle material;
+			glm::mat4 model;
+			glm::vec3 worldCenter;
+			r32 worldRadius;
+			s32 bvhLeaf;
+			u32 dirtyFrames; // Frame regions that still have an old transform
+		};
+		MemoryPool<RenderObject> renderObjects = MemoryPool<RenderObject>(64, maxRenderObjectCount);
+		Bvh sceneBvh;
+		std::vector<u32> queryResults;
+		RenderObjectHandle* renderObjectHandles; // By slot
+		std::vector<RenderObjectHandle> dirtyObjects;
+		std::vector<u32> dirtySlots;
+		std::vector<PerInstanceData> dirtyInstanceData;
+
+		// Sorted draws of the visible opaque objects, kept until the visible set or a material changes
+		bool retainedDrawsDirty;
+		Drawcall* retainedQueue; // Data index is the object's slot
+		MeshDraw* retainedDraws;
+		u32 retainedDrawCount;
+		u32* retainedInstanceIndices;
+		u32 retainedInstanceCount;
+		u32 retainedVisibleCount; // Objects that passed the BVH query, some may still be waiting for resources
+		Camera retainedCullCamera; // The one the BVH query was made for
+		r32 retainedCullAspect;
+		u32 retainedDrawsVersion;
+		u32 uploadedRetainedVersion[COMMAND_BUFFER_COUNT]; // Index regions are per frame too
+		std::vector<RenderObjectHandle> retainedTransparentObjects; // Have to be sorted by depth every frame
+
+		// GPU-driven draws, gathered by DrawMesh in submission order
+		bool gpuDrivenRendering;
+		u32 frameIndex;
+		struct IndirectDrawSlot {
+			u32 frameIndex; // The draw index is only valid for the frame it was assigned in
+			u32 drawIndex;
+		} *indirectDrawSlots; // Per material and mesh slot
+		IndirectDraw* indirectDraws;
+		u32 indirectDrawCount;
+		IndirectObject* indirectObjects;
+		PerInstanceData* indirectInstanceData; // Per object, copied behind the immediate instances
+		u32 indirectObjectCount;
+
+		FrameStats frameStats; // Instance counts of the last Render, the rest comes from vulkan
 
+		// Declared before vulkan, which records its draws on these threads
+		JobSystem jobs;
 		Vulkan vulkan;
 
 		std::unordered_map<std::string, MeshHandle> meshNameMap;
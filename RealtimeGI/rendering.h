@@ -8,10 +8,14 @@
 namespace Rendering {
     constexpr u32 maxMaterialCount = 256;
     constexpr u32 maxShaderCount = 64;
-    constexpr u32 maxTextureCount = 256;
-    constexpr u32 maxVertexBufferCount = 256;
-    constexpr u32 maxDrawcallCount = 4096;
-    constexpr u32 maxInstanceCount = 65536;
+    constexpr u32 maxTextureCount = 4096;
+    constexpr u32 maxVertexBufferCount = 4096;
+    constexpr u32 maxDrawcallCount = 65536; // Sorted draws, bounded by the drawcall key's index bits
+    constexpr u32 maxInstanceCount = 131072; // Immediate, GPU-driven and batched instances of a frame together
+    constexpr u32 maxRenderObjectCount = 65536;
+    // Instance data has a persistent slot per render object, followed by the instances queued for the frame
+    constexpr u32 immediateInstanceOffset = maxRenderObjectCount;
+    constexpr u32 maxInstanceSlotCount = immediateInstanceOffset + maxInstanceCount;
     constexpr u32 maxSamplerCount = 8;
 
 	typedef glm::vec3 VertexPos;
@@ -24,6 +28,7 @@ namespace Rendering {
 	typedef s32 TextureHandle;
 	typedef s32 MaterialHandle;
 	typedef s32 MeshHandle;
+	typedef s32 RenderObjectHandle;
 
     struct Triangle
     {
@@ -37,6 +42,18 @@ namespace Rendering {
         }
     };
 
+    struct Triangle32
+    {
+        u32 index[3];
+
+        Triangle32(): index{} {}
+        Triangle32(u32 a, u32 b, u32 c) {
+            index[0] = a;
+            index[1] = b;
+            index[2] = c;
+        }
+    };
+
     enum VertexAttribFlags
     {
         VERTEX_POSITION_BIT = 1 << 0,
@@ -52,8 +69,26 @@ namespace Rendering {
 
     };
 
+    enum VertexLayout
+    {
+        VERTEX_LAYOUT_SEPARATE = 0, // One full precision buffer per attribute
+        VERTEX_LAYOUT_PACKED = 1, // A single interleaved buffer of PackedVertex
+    };
+
+    // 28 bytes per vertex, against 68 for all of the separate attributes
+    struct PackedVertex
+    {
+        glm::vec3 position;
+        u32 texcoord0; // R16G16_SFLOAT
+        u32 normal; // Octahedral, R16G16_SNORM
+        u32 tangent; // Octahedral, R16G16_SNORM, y remapped to [0, 1] and multiplied by the bitangent sign
+        u32 color; // R8G8B8A8_UNORM
+    };
+    static_assert(sizeof(PackedVertex) == 28);
+
     struct MeshCreateInfo
     {
+        VertexLayout layout; // Packed meshes always carry every attribute, missing ones are filled with defaults
         u32 vertexCount;
         glm::vec3* position;
         glm::vec2* texcoord0;
@@ -62,6 +97,8 @@ namespace Rendering {
         Color* color;
         u32 triangleCount;
         Triangle* triangles;
+        Triangle32* triangles32; // Used instead of triangles if set, meshes whose indices fit in 16 bits still get a 16 bit index buffer
+        bool optimizeIndices; // Reorder triangles for the vertex cache and for less overdraw
     };
 
     ///////////////////////////////////////
@@ -127,7 +164,84 @@ namespace Rendering {
         Color ambientColor;
     };
 
+    // Upper three rows of the model matrix, the last one is always (0, 0, 0, 1)
     struct PerInstanceData {
-        glm::mat4 model;
+        glm::vec4 rows[3];
+    };
+    static_assert(sizeof(PerInstanceData) == 48);
+
+    // One instanced draw in the forward pass
+    struct MeshDraw {
+        MeshHandle mesh;
+        ShaderHandle shader;
+        MaterialHandle material;
+        u32 instanceOffset; // Into this frame's instance indices
+        u32 instanceCount;
+    };
+
+    // One per mesh and material drawn through the GPU-driven path in a frame
+    struct IndirectDraw {
+        MeshHandle mesh;
+        ShaderHandle shader;
+        MaterialHandle material;
+        u32 maxInstanceCount; // Objects that reference the draw
+    };
+
+    // Matches build_draws_comp.glsl
+    struct IndirectObject {
+        u32 instanceIndex; // Slot in the instance data
+        u32 drawIndex;
+    };
+
+    ////////////////////////////////////////
+
+    struct GpuMemoryStats {
+        u32 blockCount;
+        u32 dedicatedAllocationCount;
+        u32 allocationCount;
+        u64 reservedBytes; // Allocated from the driver
+        u64 usedBytes; // Handed out to resources, including rounding up to buddy node sizes
+        u64 largestFreeBytes;
+        r32 fragmentation; // 1 - largest free node / total free bytes
+    };
+
+    // What each device allocation is used for, sizes are tracked per category
+    enum GpuMemoryCategory
+    {
+        GPU_MEMORY_MESH, // Dedicated vertex and index buffers
+        GPU_MEMORY_SHARED_GEOMETRY,
+        GPU_MEMORY_TEXTURE,
+        GPU_MEMORY_ATTACHMENT, // Framebuffer attachments and the offscreen target
+        GPU_MEMORY_FRAME_DATA, // Per frame uniform, instance and indirect buffers
+        GPU_MEMORY_STAGING, // Upload and readback buffers
+        GPU_MEMORY_CATEGORY_COUNT
+    };
+
+    // Work done by the last call to Render
+    struct FrameStats {
+        u32 instancesSubmitted; // DrawMesh calls, render objects and DrawMeshInstances instances
+        u32 instancesCulled;
+        u32 instancesDrawn; // Less than submitted - culled while meshes or pipelines are still pending
+        u32 drawcalls; // Recorded draw commands, after merging instances
+        u32 indirectDrawcalls; // Indirect count commands, each may draw any number of meshes
+        u32 pipelineBinds; // Bind commands issued, ones that wouldn't change the bound state are skipped
+        u32 descriptorSetBinds;
+        u32 vertexBufferBinds;
+        u32 indexBufferBinds;
+        u64 uniformBytesWritten; // Camera, lighting and material data
+        u64 instanceBytesWritten; // Instance data, instance indices and indirect draw data
+        u64 memoryBytes[GPU_MEMORY_CATEGORY_COUNT]; // Currently allocated, without rounding up to buddy node sizes
+    };
+
+    // Rolling statistics of one named GPU zone over the last frames it was recorded in
+    struct GpuZoneStats {
+        const char* name;
+        u32 sampleCount;
+        r64 lastMilliseconds;
+        r64 averageMilliseconds;
+        r64 medianMilliseconds;
+        r64 p95Milliseconds;
+        r64 p99Milliseconds;
+        r64 maxMilliseconds;
     };
 }
\ No newline at end of file
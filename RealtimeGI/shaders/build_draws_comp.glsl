@@ -0,0 +1,95 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(local_size_x = 64) in;
+
+struct IndirectObject
+{
+	uint instanceIndex; // Slot in the instance data
+	uint drawIndex;
+};
+
+struct IndirectDraw
+{
+	uint indexCount;
+	uint firstIndex;
+	int vertexOffset;
+	uint firstInstance;
+	uint instanceCount; // Counted up by the first pass
+	uint group;
+	uint firstCommand; // First command slot of the group
+	uint padding;
+};
+
+// VkDrawIndexedIndirectCommand
+struct DrawCommand
+{
+	uint indexCount;
+	uint instanceCount;
+	uint firstIndex;
+	int vertexOffset;
+	uint firstInstance;
+};
+
+layout(std430, binding = 0) readonly buffer ObjectBuffer
+{
+	IndirectObject objects[];
+};
+
+layout(std430, binding = 1) buffer DrawBuffer
+{
+	IndirectDraw draws[];
+};
+
+// The same buffer the vertex shaders read with gl_InstanceIndex
+layout(std430, binding = 2) writeonly buffer InstanceIndexBuffer
+{
+	uint instanceIndices[];
+};
+
+layout(std430, binding = 3) writeonly buffer CommandBuffer
+{
+	DrawCommand commands[];
+};
+
+// Command count per group, used as the count buffer of vkCmdDrawIndexedIndirectCount
+layout(std430, binding = 4) buffer CountBuffer
+{
+	uint counts[];
+};
+
+layout(push_constant) uniform PushConstants
+{
+	uint objectCount;
+	uint drawCount;
+	uint pass;
+} pc;
+
+void main() {
+	uint i = gl_GlobalInvocationID.x;
+
+	if (pc.pass == 0) {
+		// Scatter each object into its draw's instance range
+		if (i >= pc.objectCount) {
+			return;
+		}
+
+		uint drawIndex = objects[i].drawIndex;
+		uint slot = atomicAdd(draws[drawIndex].instanceCount, 1);
+		instanceIndices[draws[drawIndex].firstInstance + slot] = objects[i].instanceIndex;
+	}
+	else {
+		// Emit a command for every draw that has instances, packed to the front of its group
+		if (i >= pc.drawCount) {
+			return;
+		}
+
+		IndirectDraw draw = draws[i];
+		if (draw.instanceCount == 0) {
+			return;
+		}
+
+		uint commandIndex = draw.firstCommand + atomicAdd(counts[draw.group], 1);
+		commands[commandIndex] = DrawCommand(draw.indexCount, draw.instanceCount, draw.firstIndex, draw.vertexOffset, draw.firstInstance);
+	}
+}
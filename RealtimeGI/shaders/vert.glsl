@@ -24,11 +24,24 @@ layout(binding = 1) uniform LightingData
 	vec4 mainLightColor;
 } lightingData;
 
-layout(binding = 2) uniform PerInstanceData
+// Upper three rows of the model matrix
+struct PerInstanceData
 {
-	mat4 model;
+	vec4 rows[3];
+};
+
+// Render objects keep their instance data in place, draws find it through a contiguous range of indices.
+// gl_InstanceIndex includes the draw's first instance.
+layout(std430, binding = 2) readonly buffer PerInstanceDataBuffer
+{
+	PerInstanceData instances[];
 } perInstanceData;
 
+layout(std430, binding = 16) readonly buffer InstanceIndexBuffer
+{
+	uint indices[];
+} instanceIndices;
+
 layout(location = 0) out vec2 v_uv;
 layout(location = 1) out vec4 v_lightSpacePos;
 layout(location = 2) out vec3 v_normal;
@@ -38,15 +51,17 @@ layout(location = 5) out vec3 v_tangent;
 layout(location = 6) out vec3 v_color;
 
 void main() {
-    gl_Position = cameraData.proj * cameraData.view * perInstanceData.model * vec4(app_pos, 1.0);
+	PerInstanceData instance = perInstanceData.instances[instanceIndices.indices[gl_InstanceIndex]];
+	mat4 model = transpose(mat4(instance.rows[0], instance.rows[1], instance.rows[2], vec4(0.0, 0.0, 0.0, 1.0)));
+    gl_Position = cameraData.proj * cameraData.view * model * vec4(app_pos, 1.0);
     v_uv = app_uv;
 	
-	mat4 normalMatrix = transpose(inverse(perInstanceData.model));
+	mat4 normalMatrix = transpose(inverse(model));
 	v_normal = (normalMatrix * vec4(app_normal, 0.0)).xyz;
 	v_tangent = (normalMatrix * vec4(app_tangent.xyz, 0.0)).xyz;
 	vec3 bitangent = cross(app_normal, app_tangent.xyz) * app_tangent.w;
 	v_bitangent	= (normalMatrix * vec4(bitangent, 0.0)).xyz;
-	v_worldPos = (perInstanceData.model * vec4(app_pos, 1.0)).xyz;
+	v_worldPos = (model * vec4(app_pos, 1.0)).xyz;
 	v_lightSpacePos = lightingData.mainLightProjMat * lightingData.mainLightMat * vec4(v_worldPos, 1.0);
     v_color = app_color.rgb;
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+// Matches VERTEX_LAYOUT_PACKED, every attribute is always present
+layout(location = 0) in vec3 app_pos;
+layout(location = 1) in vec2 app_uv; // Half float
+layout(location = 2) in vec2 app_normal; // Octahedral, snorm
+layout(location = 3) in vec2 app_tangent; // Octahedral, snorm, y remapped to [0, 1] with the bitangent sign
+layout(location = 4) in vec4 app_color; // unorm8
+
+layout(binding = 0) uniform CameraData
+{
+    mat4 view;
+    mat4 proj;
+	vec3 pos;
+} cameraData;
+
+layout(binding = 1) uniform LightingData
+{
+	mat4 mainLightMat;
+	mat4 mainLightProjMat;
+	vec4 mainLightColor;
+} lightingData;
+
+// Upper three rows of the model matrix
+struct PerInstanceData
+{
+	vec4 rows[3];
+};
+
+// Render objects keep their instance data in place, draws find it through a contiguous range of indices.
+// gl_InstanceIndex includes the draw's first instance.
+layout(std430, binding = 2) readonly buffer PerInstanceDataBuffer
+{
+	PerInstanceData instances[];
+} perInstanceData;
+
+layout(std430, binding = 16) readonly buffer InstanceIndexBuffer
+{
+	uint indices[];
+} instanceIndices;
+
+layout(location = 0) out vec2 v_uv;
+layout(location = 1) out vec4 v_lightSpacePos;
+layout(location = 2) out vec3 v_normal;
+layout(location = 3) out vec3 v_worldPos;
+layout(location = 4) out vec3 v_bitangent;
+layout(location = 5) out vec3 v_tangent;
+layout(location = 6) out vec3 v_color;
+
+vec3 OctDecode(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0) {
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+	return normalize(n);
+}
+
+void main() {
+	vec3 normal = OctDecode(app_normal);
+	float bitangentSign = app_tangent.y < 0.0 ? -1.0 : 1.0;
+	vec3 tangent = OctDecode(vec2(app_tangent.x, abs(app_tangent.y) * 2.0 - 1.0));
+
+	PerInstanceData instance = perInstanceData.instances[instanceIndices.indices[gl_InstanceIndex]];
+	mat4 model = transpose(mat4(instance.rows[0], instance.rows[1], instance.rows[2], vec4(0.0, 0.0, 0.0, 1.0)));
+    gl_Position = cameraData.proj * cameraData.view * model * vec4(app_pos, 1.0);
+    v_uv = app_uv;
+	
+	mat4 normalMatrix = transpose(inverse(model));
+	v_normal = (normalMatrix * vec4(normal, 0.0)).xyz;
+	v_tangent = (normalMatrix * vec4(tangent, 0.0)).xyz;
+	vec3 bitangent = cross(normal, tangent) * bitangentSign;
+	v_bitangent	= (normalMatrix * vec4(bitangent, 0.0)).xyz;
+	v_worldPos = (model * vec4(app_pos, 1.0)).xyz;
+	v_lightSpacePos = lightingData.mainLightProjMat * lightingData.mainLightMat * vec4(v_worldPos, 1.0);
+    v_color = app_color.rgb;
+}
@@ -1,7 +1,9 @@
 #include "system.h"
 #include <cstdio>
 #include <stdarg.h>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <iostream>
 #include <fstream>
 
@@ -9,14 +11,22 @@ void Print(const char* fmt, ...) {
 	char s[1025];
 	va_list args;
 	va_start(args, fmt);
-	vsprintf_s(s, fmt, args);
+	vsnprintf(s, sizeof(s), fmt, args);
 	va_end(args);
+#ifdef _WIN32
 	OutputDebugString(s);
+#else
+	fputs(s, stderr);
+#endif
 }
 
 // Memory is owned by caller
 char* AllocFileBytes(const char* fname, u32& outLength) {
 	std::ifstream file(fname, std::ios::ate | std::ios::binary);
+	if (!file.is_open()) {
+		outLength = 0;
+		return nullptr;
+	}
 	auto fileSize = file.tellg();
 	char* buffer = (char*)calloc(1, fileSize);
 	file.seekg(0);
@@ -25,4 +35,16 @@ char* AllocFileBytes(const char* fname, u32& outLength) {
 
 	outLength = (u32)fileSize;
 	return buffer;
+}
+
+// Replaces the file if it exists
+bool WriteFileBytes(const char* fname, const void* data, u32 length) {
+	std::ofstream file(fname, std::ios::trunc | std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	file.write((const char*)data, length);
+	file.close();
+
+	return !file.fail();
 }
\ No newline at end of file
@@ -1,12 +1,16 @@
 #pragma once
 #include "typedef.h"
+#include <cstdlib>
 
 #undef DEBUG_LOG
+// ##__VA_ARGS__ drops the comma when there are no arguments, which MSVC does on its own
 #define DEBUG_LOG(fmt, ...) Print("%s: " fmt " (%s, line %d)\n", \
-    __func__, __VA_ARGS__, __FILE__, __LINE__)
+    __func__, ##__VA_ARGS__, __FILE__, __LINE__)
 
 #undef DEBUG_ERROR
-#define DEBUG_ERROR(fmt, ...) DEBUG_LOG(fmt, __VA_ARGS__); exit(-1)
+#define DEBUG_ERROR(fmt, ...) DEBUG_LOG(fmt, ##__VA_ARGS__); exit(-1)
 
 void Print(const char* fmt, ...);
-char* AllocFileBytes(const char* fname, u32& outLength);
\ No newline at end of file
+// Returns nullptr if the file can't be opened
+char* AllocFileBytes(const char* fname, u32& outLength);
+bool WriteFileBytes(const char* fname, const void* data, u32 length);
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+// Shared by the standalone tests next to benchmark.cpp. Each one is a plain executable that checks results,
+// prints timings and returns non-zero if a check failed, so CTest can run them without a framework.
+#include "typedef.h"
+#include <chrono>
+#include <cstdio>
+
+inline u32 testFailureCount = 0;
+
+#define TEST_CHECK(condition, fmt, ...) do { \
+    if (!(condition)) { \
+        printf("FAILED: " fmt " (%s, line %d)\n", ##__VA_ARGS__, __FILE__, __LINE__); \
+        testFailureCount++; \
+    } \
+} while (0)
+
+// Fastest of several runs in milliseconds, so a context switch in one of them doesn't skew the result
+template<class F>
+r64 TimeBestOf(u32 runs, F&& function) {
+    r64 best = 1e30;
+    for (u32 i = 0; i < runs; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        function();
+        const r64 time = std::chrono::duration<r64, std::milli>(std::chrono::steady_clock::now() - start).count();
+        best = time < best ? time : best;
+    }
+    return best;
+}
+
+// Keeps the compiler from dropping work whose result is never read, the address escapes so the value has to be in memory
+inline const void* volatile doNotOptimizeSink = nullptr;
+template<class T>
+void DoNotOptimize(const T& value) {
+    doNotOptimizeSink = &value;
+}
+
+inline int TestResult() {
+    if (testFailureCount > 0) {
+        printf("%u checks failed\n", testFailureCount);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "transform_batch.h"
+#include <emmintrin.h>
+#include <cstring>
+
+namespace Rendering {
+	TransformSoA AllocTransforms(u32 capacity) {
+		TransformSoA transforms;
+		transforms.posX = (r32*)calloc(capacity, sizeof(r32));
+		transforms.posY = (r32*)calloc(capacity, sizeof(r32));
+		transforms.posZ = (r32*)calloc(capacity, sizeof(r32));
+		transforms.rotX = (r32*)calloc(capacity, sizeof(r32));
+		transforms.rotY = (r32*)calloc(capacity, sizeof(r32));
+		transforms.rotZ = (r32*)calloc(capacity, sizeof(r32));
+		transforms.rotW = (r32*)calloc(capacity, sizeof(r32));
+		transforms.scaleX = (r32*)calloc(capacity, sizeof(r32));
+		transforms.scaleY = (r32*)calloc(capacity, sizeof(r32));
+		transforms.scaleZ = (r32*)calloc(capacity, sizeof(r32));
+		return transforms;
+	}
+
+	void FreeTransforms(TransformSoA& transforms) {
+		free(transforms.posX);
+		free(transforms.posY);
+		free(transforms.posZ);
+		free(transforms.rotX);
+		free(transforms.rotY);
+		free(transforms.rotZ);
+		free(transforms.rotW);
+		free(transforms.scaleX);
+		free(transforms.scaleY);
+		free(transforms.scaleZ);
+		transforms = {};
+	}
+
+	void CopyTransforms(const TransformSoA& src, u32 srcOffset, TransformSoA& dst, u32 dstOffset, u32 count) {
+		const size_t size = sizeof(r32) * count;
+		memcpy(dst.posX + dstOffset, src.posX + srcOffset, size);
+		memcpy(dst.posY + dstOffset, src.posY + srcOffset, size);
+		memcpy(dst.posZ + dstOffset, src.posZ + srcOffset, size);
+		memcpy(dst.rotX + dstOffset, src.rotX + srcOffset, size);
+		memcpy(dst.rotY + dstOffset, src.rotY + srcOffset, size);
+		memcpy(dst.rotZ + dstOffset, src.rotZ + srcOffset, size);
+		memcpy(dst.rotW + dstOffset, src.rotW + srcOffset, size);
+		memcpy(dst.scaleX + dstOffset, src.scaleX + srcOffset, size);
+		memcpy(dst.scaleY + dstOffset, src.scaleY + srcOffset, size);
+		memcpy(dst.scaleZ + dstOffset, src.scaleZ + srcOffset, size);
+	}
+
+	// Upper 3x4 of translation * rotation * scale, in rows
+	static void ComposeRows(r32 px, r32 py, r32 pz, r32 qx, r32 qy, r32 qz, r32 qw, r32 sx, r32 sy, r32 sz, glm::vec4* outRows) {
+		const r32 x2 = qx + qx, y2 = qy + qy, z2 = qz + qz;
+		const r32 xx = qx * x2, yy = qy * y2, zz = qz * z2;
+		const r32 xy = qx * y2, xz = qx * z2, yz = qy * z2;
+		const r32 wx = qw * x2, wy = qw * y2, wz = qw * z2;
+
+		outRows[0] = glm::vec4((1.0f - yy - zz) * sx, (xy - wz) * sy, (xz + wy) * sz, px);
+		outRows[1] = glm::vec4((xy + wz) * sx, (1.0f - xx - zz) * sy, (yz - wx) * sz, py);
+		outRows[2] = glm::vec4((xz - wy) * sx, (yz + wx) * sy, (1.0f - xx - yy) * sz, pz);
+	}
+
+	glm::mat4 ComposeTransform(const Transform& transform) {
+		const Quaternion& rot = transform.rotation;
+		glm::vec4 rows[3];
+		ComposeRows(transform.position.x, transform.position.y, transform.position.z, rot.x, rot.y, rot.z, rot.w, transform.scale.x, transform.scale.y, transform.scale.z, rows);
+
+		// glm is column major
+		return glm::mat4(
+			rows[0].x, rows[1].x, rows[2].x, 0.0f,
+			rows[0].y, rows[1].y, rows[2].y, 0.0f,
+			rows[0].z, rows[1].z, rows[2].z, 0.0f,
+			rows[0].w, rows[1].w, rows[2].w, 1.0f);
+	}
+
+	PerInstanceData ToInstanceData(const glm::mat4& model) {
+		PerInstanceData data;
+		for (u32 row = 0; row < 3; row++) {
+			data.rows[row] = glm::vec4(model[0][row], model[1][row], model[2][row], model[3][row]);
+		}
+		return data;
+	}
+
+	void ComposeInstanceData(const TransformSoA& transforms, u32 count, PerInstanceData* out) {
+		// Mapped memory is usually write-combined, streaming stores avoid reading it back into the cache
+		const bool aligned = ((uintptr_t)out & 15) == 0;
+		const __m128 one = _mm_set1_ps(1.0f);
+
+		const u32 simdCount = count & ~3u;
+		for (u32 i = 0; i < simdCount; i += 4) {
+			const __m128 qx = _mm_loadu_ps(transforms.rotX + i);
+			const __m128 qy = _mm_loadu_ps(transforms.rotY + i);
+			const __m128 qz = _mm_loadu_ps(transforms.rotZ + i);
+			const __m128 qw = _mm_loadu_ps(transforms.rotW + i);
+			const __m128 sx = _mm_loadu_ps(transforms.scaleX + i);
+			const __m128 sy = _mm_loadu_ps(transforms.scaleY + i);
+			const __m128 sz = _mm_loadu_ps(transforms.scaleZ + i);
+
+			const __m128 x2 = _mm_add_ps(qx, qx);
+			const __m128 y2 = _mm_add_ps(qy, qy);
+			const __m128 z2 = _mm_add_ps(qz, qz);
+			const __m128 xx = _mm_mul_ps(qx, x2);
+			const __m128 yy = _mm_mul_ps(qy, y2);
+			const __m128 zz = _mm_mul_ps(qz, z2);
+			const __m128 xy = _mm_mul_ps(qx, y2);
+			const __m128 xz = _mm_mul_ps(qx, z2);
+			const __m128 yz = _mm_mul_ps(qy, z2);
+			const __m128 wx = _mm_mul_ps(qw, x2);
+			const __m128 wy = _mm_mul_ps(qw, y2);
+			const __m128 wz = _mm_mul_ps(qw, z2);
+
+			// Each register holds one matrix element of four transforms
+			__m128 row0[4] = {
+				_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx),
+				_mm_mul_ps(_mm_sub_ps(xy, wz), sy),
+				_mm_mul_ps(_mm_add_ps(xz, wy), sz),
+				_mm_loadu_ps(transforms.posX + i)
+			};
+			__m128 row1[4] = {
+				_mm_mul_ps(_mm_add_ps(xy, wz), sx),
+				_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy),
+				_mm_mul_ps(_mm_sub_ps(yz, wx), sz),
+				_mm_loadu_ps(transforms.posY + i)
+			};
+			__m128 row2[4] = {
+				_mm_mul_ps(_mm_sub_ps(xz, wy), sx),
+				_mm_mul_ps(_mm_add_ps(yz, wx), sy),
+				_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz),
+				_mm_loadu_ps(transforms.posZ + i)
+			};
+
+			// Turn them into one row of each transform
+			_MM_TRANSPOSE4_PS(row0[0], row0[1], row0[2], row0[3]);
+			_MM_TRANSPOSE4_PS(row1[0], row1[1], row1[2], row1[3]);
+			_MM_TRANSPOSE4_PS(row2[0], row2[1], row2[2], row2[3]);
+
+			for (u32 j = 0; j < 4; j++) {
+				r32* dst = (r32*)&out[i + j];
+				if (aligned) {
+					_mm_stream_ps(dst, row0[j]);
+					_mm_stream_ps(dst + 4, row1[j]);
+					_mm_stream_ps(dst + 8, row2[j]);
+				}
+				else {
+					_mm_storeu_ps(dst, row0[j]);
+					_mm_storeu_ps(dst + 4, row1[j]);
+					_mm_storeu_ps(dst + 8, row2[j]);
+				}
+			}
+		}
+		if (aligned) {
+			_mm_sfence();
+		}
+
+		for (u32 i = simdCount; i < count; i++) {
+			ComposeRows(transforms.posX[i], transforms.posY[i], transforms.posZ[i],
+				transforms.rotX[i], transforms.rotY[i], transforms.rotZ[i], transforms.rotW[i],
+				transforms.scaleX[i], transforms.scaleY[i], transforms.scaleZ[i], out[i].rows);
+		}
+	}
+}
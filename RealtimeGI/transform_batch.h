@@ -0,0 +1,49 @@
+#pragma once
+#include "rendering.h"
+
+namespace Rendering {
+	// Structure of arrays, so that four transforms can be converted at once
+	struct TransformSoA {
+		r32* posX;
+		r32* posY;
+		r32* posZ;
+		r32* rotX;
+		r32* rotY;
+		r32* rotZ;
+		r32* rotW;
+		r32* scaleX;
+		r32* scaleY;
+		r32* scaleZ;
+	};
+
+	TransformSoA AllocTransforms(u32 capacity);
+	void FreeTransforms(TransformSoA& transforms);
+	inline void SetTransform(TransformSoA& transforms, u32 index, const Transform& transform) {
+		transforms.posX[index] = transform.position.x;
+		transforms.posY[index] = transform.position.y;
+		transforms.posZ[index] = transform.position.z;
+		transforms.rotX[index] = transform.rotation.x;
+		transforms.rotY[index] = transform.rotation.y;
+		transforms.rotZ[index] = transform.rotation.z;
+		transforms.rotW[index] = transform.rotation.w;
+		transforms.scaleX[index] = transform.scale.x;
+		transforms.scaleY[index] = transform.scale.y;
+		transforms.scaleZ[index] = transform.scale.z;
+	}
+	// View of the transforms from offset on, for splitting a batch into ranges
+	inline TransformSoA OffsetTransforms(const TransformSoA& transforms, u32 offset) {
+		return {
+			transforms.posX + offset, transforms.posY + offset, transforms.posZ + offset,
+			transforms.rotX + offset, transforms.rotY + offset, transforms.rotZ + offset, transforms.rotW + offset,
+			transforms.scaleX + offset, transforms.scaleY + offset, transforms.scaleZ + offset
+		};
+	}
+	void CopyTransforms(const TransformSoA& src, u32 srcOffset, TransformSoA& dst, u32 dstOffset, u32 count);
+
+	// Translation * rotation * scale, built directly instead of multiplying three matrices
+	glm::mat4 ComposeTransform(const Transform& transform);
+	PerInstanceData ToInstanceData(const glm::mat4& model);
+	// Writes one 3x4 matrix per transform. Rotations have to be normalized.
+	// Stores are sequential and skip the cache when out is aligned, so it can point straight into mapped GPU memory.
+	void ComposeInstanceData(const TransformSoA& transforms, u32 count, PerInstanceData* out);
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <cstddef>
 
 typedef int8_t int8;
 typedef int16_t int16;
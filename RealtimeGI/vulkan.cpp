@@ -1,11 +1,56 @@
 #include "vulkan.h"
 #include "system.h"
 #include "math.h"
+#include "mesh_optimize.h"
+#include "profiler.h"
+#include <cstddef>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
 
 namespace Rendering {
-	Vulkan::Vulkan(HINSTANCE hInst, HWND hWindow) {
+#ifdef _WIN32
+	Vulkan::Vulkan(HINSTANCE hInst, HWND hWindow, JobSystem& jobs) : jobs(&jobs), headless(false) {
 		DEBUG_LOG("Initializing vulkan...");
+		const auto startTime = std::chrono::steady_clock::now();
 
+		const char* extensionNames[] = { VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_WIN32_SURFACE_EXTENSION_NAME };
+		CreateInstance(extensionNames, 2);
+
+		VkWin32SurfaceCreateInfoKHR surfaceCreateInfo{};
+		surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
+		surfaceCreateInfo.hwnd = hWindow;
+		surfaceCreateInfo.hinstance = hInst;
+
+		vkCreateWin32SurfaceKHR(vkInstance, &surfaceCreateInfo, nullptr, &surface);
+
+		GetSuitablePhysicalDevice();
+		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &surfaceCapabilities);
+		Initialize();
+
+		DEBUG_LOG("Vulkan initialized in %.2f ms", std::chrono::duration<r64, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+	}
+#endif
+	Vulkan::Vulkan(u32 width, u32 height, JobSystem& jobs) : jobs(&jobs), headless(true) {
+		DEBUG_LOG("Initializing headless vulkan (%ux%u)...", width, height);
+		const auto startTime = std::chrono::steady_clock::now();
+
+		CreateInstance(nullptr, 0);
+		surface = VK_NULL_HANDLE;
+
+		GetSuitablePhysicalDevice();
+		// Nothing to query without a surface, the rest of the code only reads the extent
+		surfaceCapabilities = VkSurfaceCapabilitiesKHR{};
+		surfaceCapabilities.currentExtent = { width, height };
+		surfaceCapabilities.minImageCount = 1;
+		surfaceCapabilities.maxImageCount = 1;
+		Initialize();
+
+		DEBUG_LOG("Vulkan initialized in %.2f ms", std::chrono::duration<r64, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+	}
+	void Vulkan::CreateInstance(const char* const* extensionNames, u32 extensionCount) {
 		VkApplicationInfo appInfo{};
 		appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
 		appInfo.pApplicationName = "Test";
@@ -18,32 +63,48 @@ namespace Rendering {
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 		createInfo.pApplicationInfo = &appInfo;
 
-		// Enable validation layers for debug
+		// Enable validation layers for debug, if they're installed. Build machines usually only have the driver.
 		const char* validationLayer = "VK_LAYER_KHRONOS_validation";
-		createInfo.enabledLayerCount = 1;
-		createInfo.ppEnabledLayerNames = &validationLayer;
+		u32 layerCount = 0;
+		vkEnumerateInstanceLayerProperties(&layerCount, nullptr);
+		std::vector<VkLayerProperties> availableLayers(layerCount);
+		vkEnumerateInstanceLayerProperties(&layerCount, availableLayers.data());
+		for (const auto& layer : availableLayers) {
+			if (strcmp(layer.layerName, validationLayer) == 0) {
+				createInfo.enabledLayerCount = 1;
+				createInfo.ppEnabledLayerNames = &validationLayer;
+				break;
+			}
+		}
 
-		const char* extensionNames[2];
-		extensionNames[0] = "VK_KHR_surface";
-#ifdef VK_USE_PLATFORM_WIN32_KHR
-		extensionNames[1] = "VK_KHR_win32_surface";
-#endif
-		createInfo.enabledExtensionCount = 2;
+		createInfo.enabledExtensionCount = extensionCount;
 		createInfo.ppEnabledExtensionNames = extensionNames;
 
-		vkCreateInstance(&createInfo, nullptr, &vkInstance);
-
-		VkWin32SurfaceCreateInfoKHR surfaceCreateInfo{};
-		surfaceCreateInfo.sType = VK_STRUCTURE_TYPE_WIN32_SURFACE_CREATE_INFO_KHR;
-		surfaceCreateInfo.hwnd = hWindow;
-		surfaceCreateInfo.hinstance = hInst;
+		VkResult err = vkCreateInstance(&createInfo, nullptr, &vkInstance);
+		if (err != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create instance (%d)!", err);
+		}
+	}
+	// Everything after the physical device and surface, shared by the windowed and headless setups
+	void Vulkan::Initialize() {
+		// 8x where the device has it, software drivers like lavapipe only do 4x
+		const VkPhysicalDeviceLimits& limits = physicalDeviceInfo.properties.limits;
+		const VkSampleCountFlags sampleCounts = limits.framebufferColorSampleCounts & limits.framebufferDepthSampleCounts;
+		msaaSamples = VK_SAMPLE_COUNT_1_BIT;
+		for (VkSampleCountFlagBits samples : { VK_SAMPLE_COUNT_8_BIT, VK_SAMPLE_COUNT_4_BIT, VK_SAMPLE_COUNT_2_BIT }) {
+			if (sampleCounts & samples) {
+				msaaSamples = samples;
+				break;
+			}
+		}
 
-		vkCreateWin32SurfaceKHR(vkInstance, &surfaceCreateInfo, nullptr, &surface);
+		memset(categoryMemoryBytes, 0, sizeof(categoryMemoryBytes));
+		frameStats = {};
 
-		GetSuitablePhysicalDevice();
-		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &surfaceCapabilities);
 		CreateLogicalDevice();
 		vkGetDeviceQueue(device, primaryQueueFamilyIndex, 0, &primaryQueue);
+		vkGetDeviceQueue(device, transferQueueFamilyIndex, 0, &transferQueue);
+		CreatePipelineCache();
 
 		CreateRenderPasses();
 		CreateSwapchain(finalBlitRenderPass);
@@ -73,51 +134,71 @@ namespace Rendering {
 		vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool);
 
 		CreatePrimaryCommandPoolAndBuffers();
+		CreateRecordCommandPools();
+		CreateUploadQueue();
 
 		CreateFramebufferAttachments();
 		CreatePrimaryFramebuffer();
 
 		CreateUniformBuffers();
+		CreateSharedGeometryBuffers();
+		CreateIndirectDrawResources();
 
 		CreateBlitPipeline();
+		CreateGpuProfiler();
 	}
 	Vulkan::~Vulkan() {
 		// Wait for all commands to execute first
 		WaitForAllCommands();
+		FlushUploads();
+		WaitForUploads(uploadSubmittedValue);
+
+		// Everything compiled this run ends up in the next run's cache
+		SavePipelineCache();
 
 		// Free all user-created resources
-		for (u32 i = 0; i < textures.Count(); i++) {
+		// Iterate backwards, so that each removal takes the last object and nothing gets swapped over it
+		for (s32 i = textures.Count() - 1; i >= 0; i--) {
 			TextureHandle handle = textures.GetHandle(i);
 			FreeTexture(handle);
 		}
-		for (u32 i = 0; i < meshes.Count(); i++) {
+		for (s32 i = meshes.Count() - 1; i >= 0; i--) {
 			MeshHandle handle = meshes.GetHandle(i);
 			FreeMesh(handle);
 		}
-		for (u32 i = 0; i < shaders.Count(); i++) {
-			ShaderHandle handle = shaders.GetHandle(i);
-			FreeShader(handle);
-		}
-		for (u32 i = 0; i < materials.Count(); i++) {
+		for (s32 i = materials.Count() - 1; i >= 0; i--) {
 			MaterialHandle handle = materials.GetHandle(i);
 			FreeMaterial(handle);
 		}
+		for (s32 i = shaders.Count() - 1; i >= 0; i--) {
+			ShaderHandle handle = shaders.GetHandle(i);
+			FreeShader(handle);
+		}
 
+		FreeGpuProfiler();
 		FreeBlitPipeline();
 
+		FreeIndirectDrawResources();
 		FreeUniformBuffers();
+		FreeSharedGeometryBuffers();
+		FreeUploadQueue();
 
 		FreePrimaryFramebuffer();
 		FreeFramebufferAttachments();
 
+		FreeRecordCommandPools();
 		FreePrimaryCommandPoolAndBuffers();
 
 		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
 
 		FreeRenderPasses();
 		FreeSwapchain();
+		FreeMemoryBlocks();
+		vkDestroyPipelineCache(device, pipelineCache, nullptr);
 		vkDestroyDevice(device, nullptr);
-		vkDestroySurfaceKHR(vkInstance, surface, nullptr);
+		if (!headless) {
+			vkDestroySurfaceKHR(vkInstance, surface, nullptr);
+		}
 		vkDestroyInstance(vkInstance, nullptr);
 	}
 
@@ -125,7 +206,10 @@ namespace Rendering {
 		// Wait for all commands to execute first
 		WaitForAllCommands();
 
-		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &surfaceCapabilities);
+		// The offscreen target keeps the size it was created with
+		if (!headless) {
+			vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physicalDevice, surface, &surfaceCapabilities);
+		}
 
 		FreePrimaryFramebuffer();
 		FreeFramebufferAttachments();
@@ -164,9 +248,18 @@ namespace Rendering {
 
 		for (const auto& device : availableDevices) {
 			u32 queueFamilyIndex;
-			if (IsPhysicalDeviceSuitable(device, queueFamilyIndex)) {
+			u32 transferFamilyIndex;
+			if (IsPhysicalDeviceSuitable(device, queueFamilyIndex, transferFamilyIndex)) {
 				physicalDevice = device;
 				primaryQueueFamilyIndex = queueFamilyIndex;
+				transferQueueFamilyIndex = transferFamilyIndex;
+
+				vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceInfo.properties);
+				vkGetPhysicalDeviceMemoryProperties(physicalDevice, &physicalDeviceInfo.memProperties);
+				u32 queueFamilyCount = 0;
+				vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+				physicalDeviceInfo.queueFamilies.resize(queueFamilyCount);
+				vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, physicalDeviceInfo.queueFamilies.data());
 				return;
 			}
 		}
@@ -174,38 +267,50 @@ namespace Rendering {
 		DEBUG_ERROR("No suitable physical device found!");
 	}
 
-	bool Vulkan::IsPhysicalDeviceSuitable(VkPhysicalDevice physicalDevice, u32& outQueueFamilyIndex) {
+	bool Vulkan::IsPhysicalDeviceSuitable(VkPhysicalDevice physicalDevice, u32& outQueueFamilyIndex, u32& outTransferQueueFamilyIndex) {
 		VkPhysicalDeviceProperties deviceProperties;
 		vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
 
-		VkPhysicalDeviceFeatures deviceFeatures;
-		vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
+		VkPhysicalDeviceVulkan12Features vulkan12Features{};
+		vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		VkPhysicalDeviceFeatures2 deviceFeatures{};
+		deviceFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		deviceFeatures.pNext = &vulkan12Features;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &deviceFeatures);
+
+		// Uploads are tracked with timeline semaphores
+		if (!vulkan12Features.timelineSemaphore) {
+			return false;
+		}
 
 		u32 extensionCount = 0;
 		vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
 		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
 		vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, availableExtensions.data());
 
-		bool hasSwapchainSupport = false;
-		for (const auto& extension : availableExtensions) {
-			if (strcmp(extension.extensionName, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) {
-				hasSwapchainSupport = true;
-				break;
+		// Headless rendering never presents, so it doesn't need a swapchain or a surface to check against
+		if (!headless) {
+			bool hasSwapchainSupport = false;
+			for (const auto& extension : availableExtensions) {
+				if (strcmp(extension.extensionName, VK_KHR_SWAPCHAIN_EXTENSION_NAME) == 0) {
+					hasSwapchainSupport = true;
+					break;
+				}
 			}
-		}
 
-		if (!hasSwapchainSupport) {
-			return false;
-		}
+			if (!hasSwapchainSupport) {
+				return false;
+			}
 
-		// TODO: Actually check what formats are available
-		u32 surfaceFormatCount = 0;
-		vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &surfaceFormatCount, nullptr);
-		u32 presentModeCount = 0;
-		vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &presentModeCount, nullptr);
+			// TODO: Actually check what formats are available
+			u32 surfaceFormatCount = 0;
+			vkGetPhysicalDeviceSurfaceFormatsKHR(physicalDevice, surface, &surfaceFormatCount, nullptr);
+			u32 presentModeCount = 0;
+			vkGetPhysicalDeviceSurfacePresentModesKHR(physicalDevice, surface, &presentModeCount, nullptr);
 
-		if (surfaceFormatCount == 0 || presentModeCount == 0) {
-			return false;
+			if (surfaceFormatCount == 0 || presentModeCount == 0) {
+				return false;
+			}
 		}
 
 		u32 queueFamilyCount = 0;
@@ -213,6 +318,22 @@ namespace Rendering {
 		std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
 		vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
 
+		// Prefer a transfer-only family for uploads, those usually map to the copy engines.
+		// Falls back to the primary family, set below, if there's none.
+		bool hasTransferFamily = false;
+		for (u32 i = 0; i < queueFamilyCount; i++) {
+			const VkQueueFamilyProperties& queueFamily = queueFamilies.at(i);
+
+			if (queueFamily.queueCount == 0 || !(queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) || (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+				continue;
+			}
+
+			if (!hasTransferFamily || !(queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT)) {
+				outTransferQueueFamilyIndex = i;
+				hasTransferFamily = true;
+			}
+		}
+
 		for (u32 i = 0; i < queueFamilyCount; i++) {
 			const VkQueueFamilyProperties& queueFamily = queueFamilies.at(i);
 
@@ -220,8 +341,10 @@ namespace Rendering {
 				continue;
 			}
 
-			VkBool32 presentSupport = false;
-			vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &presentSupport);
+			VkBool32 presentSupport = headless;
+			if (!headless) {
+				vkGetPhysicalDeviceSurfaceSupportKHR(physicalDevice, i, surface, &presentSupport);
+			}
 
 			if (!presentSupport) {
 				continue;
@@ -230,6 +353,9 @@ namespace Rendering {
 			// For now, to keep things simple I want to use one queue for everything, so the family needs to support all of these:
 			if ((queueFamilies[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT))) {
 				outQueueFamilyIndex = i;
+				if (!hasTransferFamily) {
+					outTransferQueueFamilyIndex = i;
+				}
 				return true;
 			}
 		}
@@ -240,26 +366,49 @@ namespace Rendering {
 	void Vulkan::CreateLogicalDevice() {
 		float queuePriority = 1.0f;
 
-		VkDeviceQueueCreateInfo queueCreateInfo;
-		queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-		queueCreateInfo.pNext = nullptr;
-		queueCreateInfo.flags = 0;
-		queueCreateInfo.queueFamilyIndex = primaryQueueFamilyIndex;
-		queueCreateInfo.queueCount = 1;
-		queueCreateInfo.pQueuePriorities = &queuePriority;
+		VkDeviceQueueCreateInfo queueCreateInfos[2];
+		queueCreateInfos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueCreateInfos[0].pNext = nullptr;
+		queueCreateInfos[0].flags = 0;
+		queueCreateInfos[0].queueFamilyIndex = primaryQueueFamilyIndex;
+		queueCreateInfos[0].queueCount = 1;
+		queueCreateInfos[0].pQueuePriorities = &queuePriority;
+
+		u32 queueCreateInfoCount = 1;
+		if (transferQueueFamilyIndex != primaryQueueFamilyIndex) {
+			queueCreateInfos[1] = queueCreateInfos[0];
+			queueCreateInfos[1].queueFamilyIndex = transferQueueFamilyIndex;
+			queueCreateInfoCount = 2;
+		}
+
+		VkPhysicalDeviceVulkan12Features supportedVulkan12Features{};
+		supportedVulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		VkPhysicalDeviceFeatures2 supportedFeatures{};
+		supportedFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		supportedFeatures.pNext = &supportedVulkan12Features;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &supportedFeatures);
+
+		// GPU-driven draws are optional, everything else falls back to drawing from the CPU
+		indirectDrawSupported = supportedVulkan12Features.drawIndirectCount && supportedFeatures.features.drawIndirectFirstInstance;
 
 		VkPhysicalDeviceFeatures deviceFeatures{};
+		deviceFeatures.drawIndirectFirstInstance = indirectDrawSupported;
+
+		VkPhysicalDeviceVulkan12Features vulkan12Features{};
+		vulkan12Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		vulkan12Features.timelineSemaphore = VK_TRUE;
+		vulkan12Features.drawIndirectCount = indirectDrawSupported;
 
 		const char* swapchainExtensionName = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
 
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-		createInfo.pNext = nullptr;
+		createInfo.pNext = &vulkan12Features;
 		createInfo.flags = 0;
-		createInfo.queueCreateInfoCount = 1;
-		createInfo.pQueueCreateInfos = &queueCreateInfo;
+		createInfo.queueCreateInfoCount = queueCreateInfoCount;
+		createInfo.pQueueCreateInfos = queueCreateInfos;
 		createInfo.pEnabledFeatures = &deviceFeatures;
-		createInfo.enabledExtensionCount = 1;
+		createInfo.enabledExtensionCount = headless ? 0 : 1;
 		createInfo.ppEnabledExtensionNames = &swapchainExtensionName;
 
 		VkResult err = vkCreateDevice(physicalDevice, &createInfo, nullptr, &device);
@@ -279,7 +428,7 @@ namespace Rendering {
 		attachmentDescription.pNext = nullptr;
 		attachmentDescription.flags = 0;
 		attachmentDescription.format = VK_FORMAT_R16G16B16A16_SFLOAT;
-		attachmentDescription.samples = VK_SAMPLE_COUNT_8_BIT;
+		attachmentDescription.samples = msaaSamples;
 		attachmentDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR; //temporary: clear before drawing. Change later to VK_ATTACHMENT_LOAD_OP_LOAD
 		attachmentDescription.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		attachmentDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
@@ -294,7 +443,7 @@ namespace Rendering {
 		depthDescription.pNext = nullptr;
 		depthDescription.flags = 0;
 		depthDescription.format = VK_FORMAT_D32_SFLOAT;
-		depthDescription.samples = VK_SAMPLE_COUNT_8_BIT;
+		depthDescription.samples = msaaSamples;
 		depthDescription.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
 		depthDescription.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		depthDescription.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
@@ -404,7 +553,8 @@ namespace Rendering {
 		colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		// The offscreen target is only ever copied out by ReadbackFrame
+		colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
 		VkAttachmentReference colorAttachmentRef{};
 		colorAttachmentRef.attachment = 0;
@@ -422,6 +572,10 @@ namespace Rendering {
 		dependency.srcAccessMask = 0;
 		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		if (headless) {
+			// Without an acquire semaphore in between, frames in flight write the one offscreen image one after another
+			dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		}
 
 		VkRenderPassCreateInfo renderImagePassInfo{};
 		renderImagePassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
@@ -438,6 +592,78 @@ namespace Rendering {
 		}
 	}
 
+	// Written in front of the driver's cache data. Drivers check their own header too, but some
+	// don't handle a cache from another device well, so anything that doesn't match is dropped here.
+	struct PipelineCacheFileHeader {
+		u32 magic;
+		u32 vendorID;
+		u32 deviceID;
+		u32 driverVersion;
+		u8 pipelineCacheUUID[VK_UUID_SIZE];
+		u64 dataSize;
+	};
+	static constexpr u32 pipelineCacheMagic = 0x43504752; // "RGPC"
+	static constexpr const char* pipelineCachePath = "pipeline_cache.bin";
+
+	void Vulkan::CreatePipelineCache() {
+		pipelineCreateMilliseconds = 0.0;
+		const VkPhysicalDeviceProperties& properties = physicalDeviceInfo.properties;
+
+		u32 fileLength = 0;
+		char* fileData = AllocFileBytes(pipelineCachePath, fileLength);
+		const PipelineCacheFileHeader* header = (const PipelineCacheFileHeader*)fileData;
+
+		VkPipelineCacheCreateInfo cacheInfo{};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		if (fileData != nullptr && fileLength >= sizeof(PipelineCacheFileHeader)) {
+			if (header->magic == pipelineCacheMagic &&
+				header->vendorID == properties.vendorID &&
+				header->deviceID == properties.deviceID &&
+				header->driverVersion == properties.driverVersion &&
+				memcmp(header->pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+				header->dataSize == fileLength - sizeof(PipelineCacheFileHeader)) {
+				cacheInfo.initialDataSize = (size_t)header->dataSize;
+				cacheInfo.pInitialData = fileData + sizeof(PipelineCacheFileHeader);
+			}
+			else {
+				DEBUG_LOG("Pipeline cache is from another device or driver, starting empty");
+			}
+		}
+
+		if (vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to create pipeline cache!");
+		}
+		if (cacheInfo.initialDataSize > 0) {
+			DEBUG_LOG("Loaded pipeline cache (%zu bytes)", cacheInfo.initialDataSize);
+		}
+		free(fileData);
+	}
+	void Vulkan::SavePipelineCache() {
+		DEBUG_LOG("Pipeline creation took %.2f ms this run", pipelineCreateMilliseconds);
+
+		size_t dataSize = 0;
+		if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS || dataSize == 0) {
+			return;
+		}
+
+		const VkPhysicalDeviceProperties& properties = physicalDeviceInfo.properties;
+		u8* fileData = (u8*)calloc(1, sizeof(PipelineCacheFileHeader) + dataSize);
+		PipelineCacheFileHeader* header = (PipelineCacheFileHeader*)fileData;
+		header->magic = pipelineCacheMagic;
+		header->vendorID = properties.vendorID;
+		header->deviceID = properties.deviceID;
+		header->driverVersion = properties.driverVersion;
+		memcpy(header->pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+		if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, fileData + sizeof(PipelineCacheFileHeader)) == VK_SUCCESS) {
+			header->dataSize = dataSize;
+			if (!WriteFileBytes(pipelineCachePath, fileData, (u32)(sizeof(PipelineCacheFileHeader) + dataSize))) {
+				DEBUG_LOG("Failed to write pipeline cache to %s", pipelineCachePath);
+			}
+		}
+		free(fileData);
+	}
+
 	void Vulkan::CreateRenderPasses() {
 		CreateForwardRenderPass();
 		CreateFinalBlitRenderPass();
@@ -450,6 +676,11 @@ namespace Rendering {
 	}
 
 	void Vulkan::CreateSwapchain(VkRenderPass renderPass) {
+		if (headless) {
+			CreateOffscreenTarget(renderPass);
+			return;
+		}
+
 		if (SWAPCHAIN_MIN_IMAGE_COUNT > surfaceCapabilities.maxImageCount) {
 			DEBUG_ERROR("Image count not supported (%d or bigger than %d, the maximum image count)!", SWAPCHAIN_MIN_IMAGE_COUNT, surfaceCapabilities.maxImageCount);
 		}
@@ -537,6 +768,11 @@ namespace Rendering {
 	}
 
 	void Vulkan::FreeSwapchain() {
+		if (headless) {
+			FreeOffscreenTarget();
+			return;
+		}
+
 		for (auto& swap : swapchainImages) {
 			vkDestroyFramebuffer(device, swap.framebuffer, nullptr);
 			vkDestroyImageView(device, swap.view, nullptr);
@@ -545,6 +781,416 @@ namespace Rendering {
 		vkDestroySwapchainKHR(device, swapchain, nullptr);
 	}
 
+	// Headless stand-in for the swapchain, a single image that every frame is blitted to
+	void Vulkan::CreateOffscreenTarget(VkRenderPass renderPass) {
+		if (renderPass == VK_NULL_HANDLE) {
+			DEBUG_ERROR("Invalid render pass!");
+		}
+
+		const VkExtent2D extent = surfaceCapabilities.currentExtent;
+		swapchain = VK_NULL_HANDLE;
+		currentSwapchainImageIndex = 0;
+		swapchainImages = std::vector<SwapchainImage>(1);
+		SwapchainImage& swap = swapchainImages[0];
+
+		VkImageCreateInfo imageInfo{};
+		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+		imageInfo.flags = 0;
+		imageInfo.imageType = VK_IMAGE_TYPE_2D;
+		imageInfo.extent = { extent.width, extent.height, 1 };
+		imageInfo.mipLevels = 1;
+		imageInfo.arrayLayers = 1;
+		imageInfo.format = VK_FORMAT_B8G8R8A8_SRGB;
+		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		imageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+
+		VkResult err = vkCreateImage(device, &imageInfo, nullptr, &swap.image);
+		if (err != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create offscreen image!");
+		}
+
+		VkMemoryRequirements memRequirements;
+		vkGetImageMemoryRequirements(device, swap.image, &memRequirements);
+		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, GPU_MEMORY_ATTACHMENT, offscreenAllocation);
+		vkBindImageMemory(device, swap.image, offscreenAllocation.memory, offscreenAllocation.offset);
+
+		VkImageViewCreateInfo viewInfo{};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = swap.image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = VK_FORMAT_B8G8R8A8_SRGB;
+		viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		viewInfo.subresourceRange.baseMipLevel = 0;
+		viewInfo.subresourceRange.levelCount = 1;
+		viewInfo.subresourceRange.baseArrayLayer = 0;
+		viewInfo.subresourceRange.layerCount = 1;
+
+		err = vkCreateImageView(device, &viewInfo, nullptr, &swap.view);
+		if (err != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create image view!");
+		}
+
+		VkFramebufferCreateInfo framebufferInfo{};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = renderPass;
+		framebufferInfo.attachmentCount = 1;
+		framebufferInfo.pAttachments = &swap.view;
+		framebufferInfo.width = extent.width;
+		framebufferInfo.height = extent.height;
+		framebufferInfo.layers = 1;
+
+		err = vkCreateFramebuffer(device, &framebufferInfo, nullptr, &swap.framebuffer);
+		if (err != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create framebuffer!");
+		}
+
+		// Tightly packed BGRA8, the layout ReadbackFrame hands out
+		AllocateBuffer((VkDeviceSize)extent.width * extent.height * 4, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_STAGING, readbackBuffer);
+	}
+	void Vulkan::FreeOffscreenTarget() {
+		SwapchainImage& swap = swapchainImages[0];
+		vkDestroyFramebuffer(device, swap.framebuffer, nullptr);
+		vkDestroyImageView(device, swap.view, nullptr);
+		vkDestroyImage(device, swap.image, nullptr);
+		FreeMemory(offscreenAllocation);
+		FreeBuffer(readbackBuffer);
+	}
+
+	void Vulkan::ReadbackFrame(u8* outPixels) {
+		if (!headless) {
+			DEBUG_ERROR("Only the headless target can be read back!");
+		}
+
+		// The last submitted frame has to be done writing the image
+		WaitForAllCommands();
+
+		const VkExtent2D extent = surfaceCapabilities.currentExtent;
+		const SwapchainImage& swap = swapchainImages[0];
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = primaryCommandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		VkCommandBuffer cmdBuffer;
+		if (vkAllocateCommandBuffers(device, &allocInfo, &cmdBuffer) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to allocate command buffers!");
+		}
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		vkBeginCommandBuffer(cmdBuffer, &beginInfo);
+
+		// The blit pass left the image in transfer source layout, this only orders the copy after its writes
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = swap.image;
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.levelCount = 1;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		VkBufferImageCopy region{};
+		region.bufferOffset = 0;
+		region.bufferRowLength = 0;
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = { 0, 0, 0 };
+		region.imageExtent = { extent.width, extent.height, 1 };
+		vkCmdCopyImageToBuffer(cmdBuffer, swap.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer.buffer, 1, &region);
+
+		VkBufferMemoryBarrier hostBarrier{};
+		hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.buffer = readbackBuffer.buffer;
+		hostBarrier.offset = 0;
+		hostBarrier.size = VK_WHOLE_SIZE;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+
+		vkEndCommandBuffer(cmdBuffer);
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &cmdBuffer;
+		vkQueueSubmit(primaryQueue, 1, &submitInfo, VK_NULL_HANDLE);
+		vkQueueWaitIdle(primaryQueue);
+
+		vkFreeCommandBuffers(device, primaryCommandPool, 1, &cmdBuffer);
+
+		memcpy(outPixels, readbackBuffer.allocation.mapped, (size_t)extent.width * extent.height * 4);
+	}
+
+	void Vulkan::ReadbackDrawCommands(const MeshDraw* draws, u32 drawCount, std::vector<VkDrawIndexedIndirectCommand>& outCommands) {
+		WaitForAllCommands();
+
+		for (u32 i = 0; i < drawCount; i++) {
+			const MeshImpl& mesh = meshes[draws[i].mesh];
+			outCommands.push_back({ mesh.indexCount, draws[i].instanceCount, mesh.firstIndex, (s32)mesh.baseVertex, draws[i].instanceOffset });
+		}
+
+		if (indirectObjectCount == 0) {
+			return;
+		}
+
+		// The commands were built in device local memory, in the region of the command buffer submitted last
+		const u32 lastCbIndex = (currentCbIndex + COMMAND_BUFFER_COUNT - 1) % COMMAND_BUFFER_COUNT;
+		const VkDeviceSize commandSize = sizeof(VkDrawIndexedIndirectCommand) * indirectDrawCount;
+		Buffer stagingBuffer;
+		AllocateBuffer(commandSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_STAGING, stagingBuffer);
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = primaryCommandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		VkCommandBuffer cmdBuffer;
+		if (vkAllocateCommandBuffers(device, &allocInfo, &cmdBuffer) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to allocate command buffers!");
+		}
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		vkBeginCommandBuffer(cmdBuffer, &beginInfo);
+
+		VkBufferCopy region{};
+		region.srcOffset = indirectCommandFrameSize * lastCbIndex;
+		region.dstOffset = 0;
+		region.size = commandSize;
+		vkCmdCopyBuffer(cmdBuffer, indirectCommandBuffer.buffer, stagingBuffer.buffer, 1, &region);
+
+		VkBufferMemoryBarrier hostBarrier{};
+		hostBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		hostBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		hostBarrier.buffer = stagingBuffer.buffer;
+		hostBarrier.offset = 0;
+		hostBarrier.size = VK_WHOLE_SIZE;
+		vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &hostBarrier, 0, nullptr);
+
+		vkEndCommandBuffer(cmdBuffer);
+
+		VkSubmitInfo submitInfo{};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &cmdBuffer;
+		vkQueueSubmit(primaryQueue, 1, &submitInfo, VK_NULL_HANDLE);
+		vkQueueWaitIdle(primaryQueue);
+
+		vkFreeCommandBuffers(device, primaryCommandPool, 1, &cmdBuffer);
+
+		// Each group's commands are packed to the front of its slots, the count buffer says how many were emitted
+		const VkDrawIndexedIndirectCommand* commands = (const VkDrawIndexedIndirectCommand*)stagingBuffer.allocation.mapped;
+		const u32* counts = (const u32*)((const u8*)indirectCountBuffer.allocation.mapped + indirectCountFrameSize * lastCbIndex);
+		for (u32 i = 0; i < indirectGroupCount; i++) {
+			const IndirectGroup& group = indirectGroups[i];
+			outCommands.insert(outCommands.end(), commands + group.firstCommand, commands + group.firstCommand + MIN(counts[i], group.commandCount));
+		}
+
+		FreeBuffer(stagingBuffer);
+	}
+
+	// Two timestamps per zone, every command buffer has its own range of the pool
+	void Vulkan::CreateGpuProfiler() {
+		gpuFrameMilliseconds = -1.0;
+		gpuFrameNumber = 0;
+		gpuZoneStackDepth = 0;
+		for (u32 i = 0; i < COMMAND_BUFFER_COUNT; i++) {
+			gpuZoneCounts[i] = 0;
+			gpuZoneFrames[i] = 0;
+		}
+		gpuTraceActive = false;
+		gpuTraceOriginSet = false;
+		gpuTraceOrigin = 0;
+
+		timestampValidBits = physicalDeviceInfo.queueFamilies[primaryQueueFamilyIndex].timestampValidBits;
+		if (timestampValidBits == 0) {
+			DEBUG_LOG("Timestamps not supported, GPU timings won't be available");
+			gpuZonePool = VK_NULL_HANDLE;
+			return;
+		}
+
+		VkQueryPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+		poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+		poolInfo.queryCount = COMMAND_BUFFER_COUNT * maxGpuZonesPerFrame * 2;
+
+		if (vkCreateQueryPool(device, &poolInfo, nullptr, &gpuZonePool) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to create query pool!");
+		}
+	}
+	void Vulkan::FreeGpuProfiler() {
+		if (gpuZonePool != VK_NULL_HANDLE) {
+			vkDestroyQueryPool(device, gpuZonePool, nullptr);
+		}
+	}
+
+	void Vulkan::BeginGpuZone(const char* name) {
+		if (gpuZoneStackDepth == maxGpuZonesPerFrame) {
+			DEBUG_ERROR("GPU zones nested too deep!");
+		}
+
+		// Zones past the per-frame limit are still tracked on the stack, so that the matching EndGpuZone skips them too
+		u32& zoneCount = gpuZoneCounts[currentCbIndex];
+		s32 zone = -1;
+		if (gpuZonePool != VK_NULL_HANDLE && zoneCount < maxGpuZonesPerFrame) {
+			zone = (s32)zoneCount++;
+			gpuZones[currentCbIndex][zone] = { name, gpuZoneStackDepth };
+			vkCmdWriteTimestamp(primaryCommandBuffers[currentCbIndex].cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, gpuZonePool, (currentCbIndex * maxGpuZonesPerFrame + zone) * 2);
+		}
+		gpuZoneStack[gpuZoneStackDepth++] = zone;
+	}
+	void Vulkan::EndGpuZone() {
+		if (gpuZoneStackDepth == 0) {
+			DEBUG_ERROR("No GPU zone to end!");
+		}
+
+		const s32 zone = gpuZoneStack[--gpuZoneStackDepth];
+		if (zone >= 0) {
+			vkCmdWriteTimestamp(primaryCommandBuffers[currentCbIndex].cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, gpuZonePool, (currentCbIndex * maxGpuZonesPerFrame + zone) * 2 + 1);
+		}
+	}
+
+	// Called once the command buffer's fence has signaled, so the results are there without waiting
+	void Vulkan::ResolveGpuZones(u32 cbIndex) {
+		const u32 zoneCount = gpuZoneCounts[cbIndex];
+		if (gpuZonePool == VK_NULL_HANDLE || zoneCount == 0) {
+			return;
+		}
+
+		u64 timestamps[maxGpuZonesPerFrame * 2];
+		VkResult err = vkGetQueryPoolResults(device, gpuZonePool, cbIndex * maxGpuZonesPerFrame * 2, zoneCount * 2, sizeof(u64) * zoneCount * 2, timestamps, sizeof(u64), VK_QUERY_RESULT_64_BIT);
+		if (err != VK_SUCCESS) {
+			return;
+		}
+
+		const u64 mask = timestampValidBits >= 64 ? ~0ull : (1ull << timestampValidBits) - 1;
+		const r64 tickMilliseconds = physicalDeviceInfo.properties.limits.timestampPeriod / 1000000.0;
+		for (u32 i = 0; i < zoneCount; i++) {
+			const GpuZone& zone = gpuZones[cbIndex][i];
+			const u64 begin = timestamps[i * 2] & mask;
+			const r64 milliseconds = (((timestamps[i * 2 + 1] & mask) - begin) & mask) * tickMilliseconds;
+
+			AddGpuZoneSample(zone.name, milliseconds);
+			// The frame zone is always the first one
+			if (i == 0) {
+				gpuFrameMilliseconds = milliseconds;
+			}
+
+			if (gpuTraceActive) {
+				if (!gpuTraceOriginSet) {
+					gpuTraceOrigin = begin;
+					gpuTraceOriginSet = true;
+				}
+				const r64 startMicroseconds = ((begin - gpuTraceOrigin) & mask) * tickMilliseconds * 1000.0;
+				gpuTraceEvents.push_back({ zone.name, gpuZoneFrames[cbIndex], startMicroseconds, milliseconds * 1000.0, zone.depth });
+			}
+		}
+	}
+	void Vulkan::AddGpuZoneSample(const char* name, r64 milliseconds) {
+		GpuZoneHistory* history = nullptr;
+		for (GpuZoneHistory& candidate : gpuZoneHistories) {
+			if (strcmp(candidate.name, name) == 0) {
+				history = &candidate;
+				break;
+			}
+		}
+		if (history == nullptr) {
+			history = &gpuZoneHistories.emplace_back();
+			history->name = name;
+			history->sampleCount = 0;
+			history->next = 0;
+		}
+
+		history->samples[history->next] = milliseconds;
+		history->next = (history->next + 1) % gpuZoneHistoryLength;
+		history->sampleCount = MIN(history->sampleCount + 1, gpuZoneHistoryLength);
+	}
+
+	// Nearest rank, so the result is always one of the samples
+	static r64 SortedPercentile(const r64* sorted, u32 count, r64 percentile) {
+		const u32 rank = (u32)ceil(percentile * count);
+		return sorted[rank > 0 ? rank - 1 : 0];
+	}
+
+	void Vulkan::GetGpuProfile(std::vector<GpuZoneStats>& outZones) const {
+		outZones.clear();
+		for (const GpuZoneHistory& history : gpuZoneHistories) {
+			const u32 count = history.sampleCount;
+			r64 sorted[gpuZoneHistoryLength];
+			memcpy(sorted, history.samples, count * sizeof(r64));
+			std::sort(sorted, sorted + count);
+
+			r64 total = 0.0;
+			for (u32 i = 0; i < count; i++) {
+				total += sorted[i];
+			}
+
+			GpuZoneStats& stats = outZones.emplace_back();
+			stats.name = history.name;
+			stats.sampleCount = count;
+			stats.lastMilliseconds = history.samples[(history.next + gpuZoneHistoryLength - 1) % gpuZoneHistoryLength];
+			stats.averageMilliseconds = total / count;
+			stats.medianMilliseconds = SortedPercentile(sorted, count, 0.5);
+			stats.p95Milliseconds = SortedPercentile(sorted, count, 0.95);
+			stats.p99Milliseconds = SortedPercentile(sorted, count, 0.99);
+			stats.maxMilliseconds = sorted[count - 1];
+		}
+	}
+
+	void Vulkan::StartGpuTrace() {
+		gpuTraceEvents.clear();
+		gpuTraceOriginSet = false;
+		gpuTraceActive = true;
+	}
+	// Complete events on a single GPU track, nested zones show up stacked under their parents
+	bool Vulkan::StopGpuTrace(const char* path) {
+		gpuTraceActive = false;
+
+		std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		json += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"GPU\"}}";
+		char event[256];
+		for (const GpuTraceEvent& trace : gpuTraceEvents) {
+			snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%llu,\"depth\":%u}}",
+				trace.name, trace.startMicroseconds, trace.durationMicroseconds, (unsigned long long)trace.frame, trace.depth);
+			json += event;
+		}
+		json += "\n]}\n";
+		gpuTraceEvents.clear();
+
+		return WriteFileBytes(path, json.data(), (u32)json.size());
+	}
+
+	r64 Vulkan::GetGpuFrameMilliseconds() const {
+		return gpuFrameMilliseconds;
+	}
+	bool Vulkan::IsHeadless() const {
+		return headless;
+	}
+
 	void Vulkan::CreatePrimaryCommandPoolAndBuffers() {
 		VkCommandPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -593,6 +1239,50 @@ namespace Rendering {
 		}
 		vkDestroyCommandPool(device, primaryCommandPool, nullptr);
 	}
+	void Vulkan::CreateRecordCommandPools() {
+		// The calling thread records too
+		recordThreadCount = MIN(maxRecordThreadCount, jobs->ThreadCount());
+
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		poolInfo.queueFamilyIndex = primaryQueueFamilyIndex;
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+		allocInfo.commandBufferCount = 1;
+
+		for (u32 frame = 0; frame < COMMAND_BUFFER_COUNT; frame++) {
+			for (u32 i = 0; i < recordThreadCount; i++) {
+				RecordContext& context = recordContexts[frame][i];
+				if (vkCreateCommandPool(device, &poolInfo, nullptr, &context.pool) != VK_SUCCESS) {
+					DEBUG_ERROR("failed to create command pool!");
+				}
+
+				allocInfo.commandPool = context.pool;
+				if (vkAllocateCommandBuffers(device, &allocInfo, &context.cmdBuffer) != VK_SUCCESS) {
+					DEBUG_ERROR("failed to allocate command buffers!");
+				}
+			}
+
+			allocInfo.commandPool = recordContexts[frame][0].pool;
+			if (vkAllocateCommandBuffers(device, &allocInfo, &indirectSecondaryBuffers[frame]) != VK_SUCCESS) {
+				DEBUG_ERROR("failed to allocate command buffers!");
+			}
+		}
+
+		passSecondaryCount = 0;
+		passDrawsRecorded = false;
+	}
+	void Vulkan::FreeRecordCommandPools() {
+		// Destroying a pool frees its command buffers
+		for (u32 frame = 0; frame < COMMAND_BUFFER_COUNT; frame++) {
+			for (u32 i = 0; i < recordThreadCount; i++) {
+				vkDestroyCommandPool(device, recordContexts[frame][i].pool, nullptr);
+			}
+		}
+	}
 
 	void Vulkan::CreateBlitPipeline()
 	{
@@ -739,7 +1429,9 @@ namespace Rendering {
 		pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 		pipelineInfo.basePipelineIndex = -1; // Optional
 
-		VkResult err = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &blitPipeline);
+		const auto compileStart = std::chrono::steady_clock::now();
+		VkResult err = vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &blitPipeline);
+		pipelineCreateMilliseconds += std::chrono::duration<r64, std::milli>(std::chrono::steady_clock::now() - compileStart).count();
 		if (err != VK_SUCCESS) {
 			DEBUG_ERROR("failed to create graphics pipelines!");
 		}
@@ -756,16 +1448,255 @@ namespace Rendering {
 	}
 
 	void Vulkan::CreateUniformBuffers() {
-		AllocateBuffer(sizeof(CameraData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, cameraDataBuffer);
-		AllocateBuffer(sizeof(LightingData), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, lightingDataBuffer);
-		AllocateBuffer(sizeof(PerInstanceData) * maxInstanceCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, perInstanceBuffer);
-		AllocateBuffer(maxShaderDataBlockSize * maxMaterialCount, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, shaderDataBuffer);
+		// Camera and lighting are rewritten every frame, one region per command buffer keeps them away from frames still in flight
+		const VkDeviceSize uniformAlignment = physicalDeviceInfo.properties.limits.minUniformBufferOffsetAlignment;
+		cameraDataFrameSize = (sizeof(CameraData) + uniformAlignment - 1) & ~(uniformAlignment - 1);
+		AllocateBuffer(cameraDataFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, cameraDataBuffer);
+		lightingDataFrameSize = (sizeof(LightingData) + uniformAlignment - 1) & ~(uniformAlignment - 1);
+		AllocateBuffer(lightingDataFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, lightingDataBuffer);
+
+		// Instance data is written while earlier frames may still be reading it, so each command buffer gets its own region.
+		// Render object slots are only rewritten in the regions that haven't seen their latest transform yet.
+		// Draws find their instances through the index regions, indexed with gl_InstanceIndex, only the region offsets have to be aligned.
+		const VkDeviceSize offsetAlignment = physicalDeviceInfo.properties.limits.minStorageBufferOffsetAlignment;
+		perInstanceFrameSize = (sizeof(PerInstanceData) * maxInstanceSlotCount + offsetAlignment - 1) & ~(offsetAlignment - 1);
+		AllocateBuffer(perInstanceFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, perInstanceBuffer);
+		instanceIndexFrameSize = (sizeof(u32) * maxInstanceSlotCount + offsetAlignment - 1) & ~(offsetAlignment - 1);
+		AllocateBuffer(instanceIndexFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, instanceIndexBuffer);
+
+		// Material blocks are at most maxShaderDataBlockSize apart, which is the largest alignment any device asks for
+		shaderDataFrameSize = (maxShaderDataBlockSize * maxMaterialCount + uniformAlignment - 1) & ~(uniformAlignment - 1);
+		AllocateBuffer(shaderDataFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, shaderDataBuffer);
+		materialShadowData = (u8*)calloc(maxMaterialCount, maxShaderDataBlockSize);
+		materialDirtyFrames = (u8*)calloc(maxMaterialCount, sizeof(u8));
+
+		for (u32 i = 0; i < COMMAND_BUFFER_COUNT; i++) {
+			frameDynamicOffsets[i][0] = (u32)(cameraDataFrameSize * i);
+			frameDynamicOffsets[i][1] = (u32)(lightingDataFrameSize * i);
+			frameDynamicOffsets[i][2] = (u32)(perInstanceFrameSize * i);
+			frameDynamicOffsets[i][3] = (u32)(shaderDataFrameSize * i);
+			frameDynamicOffsets[i][4] = (u32)(instanceIndexFrameSize * i);
+		}
 	}
 	void Vulkan::FreeUniformBuffers() {
 		FreeBuffer(cameraDataBuffer);
 		FreeBuffer(lightingDataBuffer);
 		FreeBuffer(perInstanceBuffer);
+		FreeBuffer(instanceIndexBuffer);
 		FreeBuffer(shaderDataBuffer);
+		free(materialShadowData);
+		free(materialDirtyFrames);
+		dirtyMaterialSlots.clear();
+	}
+
+	void Vulkan::CreateSharedGeometryBuffers() {
+		AllocateBuffer(sizeof(PackedVertex) * sharedVertexCapacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_SHARED_GEOMETRY, sharedVertexBuffer);
+		AllocateBuffer(sizeof(u16) * sharedIndexCapacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_SHARED_GEOMETRY, sharedIndexBuffer);
+		AllocateBuffer(sizeof(u32) * sharedIndex32Capacity, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_SHARED_GEOMETRY, sharedIndex32Buffer);
+		sharedVertexRanges.Init(sharedVertexCapacity);
+		sharedIndexRanges.Init(sharedIndexCapacity);
+		sharedIndex32Ranges.Init(sharedIndex32Capacity);
+	}
+	void Vulkan::FreeSharedGeometryBuffers() {
+		FreeBuffer(sharedVertexBuffer);
+		FreeBuffer(sharedIndexBuffer);
+		FreeBuffer(sharedIndex32Buffer);
+	}
+
+	void Vulkan::CreateIndirectDrawResources() {
+		indirectGroupCount = 0;
+		indirectDrawCount = 0;
+		indirectObjectCount = 0;
+		if (!indirectDrawSupported) {
+			DEBUG_LOG("Device doesn't support indirect count draws, GPU-driven rendering is disabled");
+			return;
+		}
+
+		// Loaded before anything else is created, without it the draws are built on the CPU like on devices without indirect count
+		VkShaderModule compModule = VK_NULL_HANDLE;
+		u32 compShaderLength;
+		char* compShader = AllocFileBytes("shaders/build_draws_comp.spv", compShaderLength);
+		if (compShader != nullptr) {
+			VkShaderModuleCreateInfo moduleInfo{};
+			moduleInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+			moduleInfo.codeSize = compShaderLength;
+			moduleInfo.pCode = (const u32*)compShader;
+			if (vkCreateShaderModule(device, &moduleInfo, nullptr, &compModule) != VK_SUCCESS) {
+				compModule = VK_NULL_HANDLE;
+			}
+			free(compShader);
+		}
+		if (compModule == VK_NULL_HANDLE) {
+			DEBUG_LOG("Couldn't load shaders/build_draws_comp.spv, GPU-driven rendering is disabled");
+			indirectDrawSupported = false;
+			return;
+		}
+
+		// Every draw has at least one object, so there can't be more draws or commands than instances
+		const VkDeviceSize offsetAlignment = physicalDeviceInfo.properties.limits.minStorageBufferOffsetAlignment;
+		indirectObjectFrameSize = (sizeof(IndirectObject) * maxInstanceCount + offsetAlignment - 1) & ~(offsetAlignment - 1);
+		indirectDrawFrameSize = (sizeof(IndirectDrawInfo) * maxInstanceCount + offsetAlignment - 1) & ~(offsetAlignment - 1);
+		indirectCountFrameSize = (sizeof(u32) * maxIndirectGroupCount + offsetAlignment - 1) & ~(offsetAlignment - 1);
+		indirectCommandFrameSize = (sizeof(VkDrawIndexedIndirectCommand) * maxInstanceCount + offsetAlignment - 1) & ~(offsetAlignment - 1);
+		AllocateBuffer(indirectObjectFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, indirectObjectBuffer);
+		AllocateBuffer(indirectDrawFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, indirectDrawBuffer);
+		AllocateBuffer(indirectCountFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_FRAME_DATA, indirectCountBuffer);
+		AllocateBuffer(indirectCommandFrameSize * COMMAND_BUFFER_COUNT, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_FRAME_DATA, indirectCommandBuffer);
+
+		// Objects, draws, instance indices, commands, command counts
+		VkDescriptorSetLayoutBinding bindings[5]{};
+		for (u32 i = 0; i < 5; i++) {
+			bindings[i].binding = i;
+			bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			bindings[i].descriptorCount = 1;
+			bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		}
+
+		VkDescriptorSetLayoutCreateInfo layoutInfo{};
+		layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		layoutInfo.bindingCount = 5;
+		layoutInfo.pBindings = bindings;
+		if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &indirectDescriptorSetLayout) != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create indirect draw descriptor set layout");
+		}
+
+		VkDescriptorSetLayout setLayouts[COMMAND_BUFFER_COUNT];
+		for (u32 i = 0; i < COMMAND_BUFFER_COUNT; i++) {
+			setLayouts[i] = indirectDescriptorSetLayout;
+		}
+		VkDescriptorSetAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+		allocInfo.descriptorPool = descriptorPool;
+		allocInfo.descriptorSetCount = COMMAND_BUFFER_COUNT;
+		allocInfo.pSetLayouts = setLayouts;
+		vkAllocateDescriptorSets(device, &allocInfo, indirectDescriptorSets);
+
+		for (u32 i = 0; i < COMMAND_BUFFER_COUNT; i++) {
+			UpdateDescriptorSetBuffer(indirectDescriptorSets[i], 0, { indirectObjectBuffer.buffer, indirectObjectFrameSize * i, indirectObjectFrameSize }, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+			UpdateDescriptorSetBuffer(indirectDescriptorSets[i], 1, { indirectDrawBuffer.buffer, indirectDrawFrameSize * i, indirectDrawFrameSize }, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+			UpdateDescriptorSetBuffer(indirectDescriptorSets[i], 2, { instanceIndexBuffer.buffer, instanceIndexFrameSize * i, instanceIndexFrameSize }, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+			UpdateDescriptorSetBuffer(indirectDescriptorSets[i], 3, { indirectCommandBuffer.buffer, indirectCommandFrameSize * i, indirectCommandFrameSize }, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+			UpdateDescriptorSetBuffer(indirectDescriptorSets[i], 4, { indirectCountBuffer.buffer, indirectCountFrameSize * i, indirectCountFrameSize }, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER);
+		}
+
+		// Object count, draw count, pass
+		VkPushConstantRange pushConstantRange{};
+		pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		pushConstantRange.offset = 0;
+		pushConstantRange.size = sizeof(u32) * 3;
+
+		VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfo.setLayoutCount = 1;
+		pipelineLayoutInfo.pSetLayouts = &indirectDescriptorSetLayout;
+		pipelineLayoutInfo.pushConstantRangeCount = 1;
+		pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+		if (vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &indirectPipelineLayout) != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create indirect draw pipeline layout");
+		}
+
+		VkComputePipelineCreateInfo pipelineInfo{};
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+		pipelineInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		pipelineInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+		pipelineInfo.stage.module = compModule;
+		pipelineInfo.stage.pName = "main";
+		pipelineInfo.layout = indirectPipelineLayout;
+		const auto compileStart = std::chrono::steady_clock::now();
+		if (vkCreateComputePipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &indirectPipeline) != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to create indirect draw pipeline");
+		}
+		pipelineCreateMilliseconds += std::chrono::duration<r64, std::milli>(std::chrono::steady_clock::now() - compileStart).count();
+
+		vkDestroyShaderModule(device, compModule, nullptr);
+	}
+	void Vulkan::FreeIndirectDrawResources() {
+		if (!indirectDrawSupported) {
+			return;
+		}
+
+		vkDestroyPipeline(device, indirectPipeline, nullptr);
+		vkDestroyPipelineLayout(device, indirectPipelineLayout, nullptr);
+		vkFreeDescriptorSets(device, descriptorPool, COMMAND_BUFFER_COUNT, indirectDescriptorSets);
+		vkDestroyDescriptorSetLayout(device, indirectDescriptorSetLayout, nullptr);
+
+		FreeBuffer(indirectObjectBuffer);
+		FreeBuffer(indirectDrawBuffer);
+		FreeBuffer(indirectCountBuffer);
+		FreeBuffer(indirectCommandBuffer);
+	}
+
+	void Vulkan::CreateUploadQueue() {
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+		poolInfo.queueFamilyIndex = transferQueueFamilyIndex;
+		if (vkCreateCommandPool(device, &poolInfo, nullptr, &uploadTransferCommandPool) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to create command pool!");
+		}
+		poolInfo.queueFamilyIndex = primaryQueueFamilyIndex;
+		if (vkCreateCommandPool(device, &poolInfo, nullptr, &uploadGraphicsCommandPool) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to create command pool!");
+		}
+
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+
+		for (u32 i = 0; i < uploadBatchCount; i++) {
+			UploadBatch& batch = uploadBatches[i];
+
+			allocInfo.commandPool = uploadTransferCommandPool;
+			vkAllocateCommandBuffers(device, &allocInfo, &batch.transferCmd);
+			allocInfo.commandPool = uploadGraphicsCommandPool;
+			vkAllocateCommandBuffers(device, &allocInfo, &batch.graphicsCmd);
+
+			batch.timelineValue = 0;
+			batch.stagingEnd = 0;
+		}
+
+		VkSemaphoreTypeCreateInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		timelineInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		timelineInfo.initialValue = 0;
+
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphoreInfo.pNext = &timelineInfo;
+
+		vkCreateSemaphore(device, &semaphoreInfo, nullptr, &uploadTransferTimeline);
+		vkCreateSemaphore(device, &semaphoreInfo, nullptr, &uploadGraphicsTimeline);
+
+		uploadBatchOpen = false;
+		uploadSubmittedValue = 0;
+		uploadCompletedValue = 0;
+		frameUploadWaitValue = 0;
+
+		AllocateBuffer(uploadStagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_STAGING, uploadStagingBuffer);
+		uploadStagingHead = 0;
+		uploadStagingTail = 0;
+	}
+	void Vulkan::FreeUploadQueue() {
+		for (u32 i = 0; i < uploadBatchCount; i++) {
+			UploadBatch& batch = uploadBatches[i];
+
+			for (const Buffer& buffer : batch.overflowBuffers) {
+				FreeBuffer(buffer);
+			}
+			batch.overflowBuffers.clear();
+
+			vkFreeCommandBuffers(device, uploadTransferCommandPool, 1, &batch.transferCmd);
+			vkFreeCommandBuffers(device, uploadGraphicsCommandPool, 1, &batch.graphicsCmd);
+		}
+
+		vkDestroyCommandPool(device, uploadTransferCommandPool, nullptr);
+		vkDestroyCommandPool(device, uploadGraphicsCommandPool, nullptr);
+		vkDestroySemaphore(device, uploadTransferTimeline, nullptr);
+		vkDestroySemaphore(device, uploadGraphicsTimeline, nullptr);
+
+		FreeBuffer(uploadStagingBuffer);
 	}
 
 	void Vulkan::CreateFramebufferAttachments() {
@@ -782,14 +1713,14 @@ namespace Rendering {
 		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 		imageInfo.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-		imageInfo.samples = VK_SAMPLE_COUNT_8_BIT;
+		imageInfo.samples = msaaSamples;
 
 		vkCreateImage(device, &imageInfo, nullptr, &colorAttachment.image);
 
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, colorAttachment.image, &memRequirements);
-		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, colorAttachment.memory);
-		vkBindImageMemory(device, colorAttachment.image, colorAttachment.memory, 0);
+		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, GPU_MEMORY_ATTACHMENT, colorAttachment.allocation);
+		vkBindImageMemory(device, colorAttachment.image, colorAttachment.allocation.memory, colorAttachment.allocation.offset);
 
 		VkImageViewCreateInfo viewInfo{};
 		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -809,19 +1740,19 @@ namespace Rendering {
 		imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
 		vkCreateImage(device, &imageInfo, nullptr, &colorAttachmentResolve.image);
 		vkGetImageMemoryRequirements(device, colorAttachmentResolve.image, &memRequirements);
-		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, colorAttachmentResolve.memory);
-		vkBindImageMemory(device, colorAttachmentResolve.image, colorAttachmentResolve.memory, 0);
+		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, GPU_MEMORY_ATTACHMENT, colorAttachmentResolve.allocation);
+		vkBindImageMemory(device, colorAttachmentResolve.image, colorAttachmentResolve.allocation.memory, colorAttachmentResolve.allocation.offset);
 		viewInfo.image = colorAttachmentResolve.image;
 		vkCreateImageView(device, &viewInfo, nullptr, &colorAttachmentResolve.view);
 
 		// Depth attachment (multisampled)
 		imageInfo.format = VK_FORMAT_D32_SFLOAT;
 		imageInfo.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
-		imageInfo.samples = VK_SAMPLE_COUNT_8_BIT;
+		imageInfo.samples = msaaSamples;
 		vkCreateImage(device, &imageInfo, nullptr, &depthAttachment.image);
 		vkGetImageMemoryRequirements(device, depthAttachment.image, &memRequirements);
-		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthAttachment.memory);
-		vkBindImageMemory(device, depthAttachment.image, depthAttachment.memory, 0);
+		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, GPU_MEMORY_ATTACHMENT, depthAttachment.allocation);
+		vkBindImageMemory(device, depthAttachment.image, depthAttachment.allocation.memory, depthAttachment.allocation.offset);
 		viewInfo.format = VK_FORMAT_D32_SFLOAT;
 		viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
 		viewInfo.image = depthAttachment.image;
@@ -832,27 +1763,27 @@ namespace Rendering {
 		imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
 		vkCreateImage(device, &imageInfo, nullptr, &depthAttachmentResolve.image);
 		vkGetImageMemoryRequirements(device, depthAttachmentResolve.image, &memRequirements);
-		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, depthAttachmentResolve.memory);
-		vkBindImageMemory(device, depthAttachmentResolve.image, depthAttachmentResolve.memory, 0);
+		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, GPU_MEMORY_ATTACHMENT, depthAttachmentResolve.allocation);
+		vkBindImageMemory(device, depthAttachmentResolve.image, depthAttachmentResolve.allocation.memory, depthAttachmentResolve.allocation.offset);
 		viewInfo.image = depthAttachmentResolve.image;
 		vkCreateImageView(device, &viewInfo, nullptr, &depthAttachmentResolve.view);
 	}
 	void Vulkan::FreeFramebufferAttachments() {
 		vkDestroyImageView(device, colorAttachment.view, nullptr);
 		vkDestroyImage(device, colorAttachment.image, nullptr);
-		vkFreeMemory(device, colorAttachment.memory, nullptr);
+		FreeMemory(colorAttachment.allocation);
 
 		vkDestroyImageView(device, colorAttachmentResolve.view, nullptr);
 		vkDestroyImage(device, colorAttachmentResolve.image, nullptr);
-		vkFreeMemory(device, colorAttachmentResolve.memory, nullptr);
+		FreeMemory(colorAttachmentResolve.allocation);
 
 		vkDestroyImageView(device, depthAttachment.view, nullptr);
 		vkDestroyImage(device, depthAttachment.image, nullptr);
-		vkFreeMemory(device, depthAttachment.memory, nullptr);
+		FreeMemory(depthAttachment.allocation);
 
 		vkDestroyImageView(device, depthAttachmentResolve.view, nullptr);
 		vkDestroyImage(device, depthAttachmentResolve.image, nullptr);
-		vkFreeMemory(device, depthAttachmentResolve.memory, nullptr);
+		FreeMemory(depthAttachmentResolve.allocation);
 	}
 	void Vulkan::CreatePrimaryFramebuffer() {
 		VkImageView attachments[4] = { colorAttachment.view, depthAttachment.view, colorAttachmentResolve.view, depthAttachmentResolve.view };
@@ -910,32 +1841,251 @@ namespace Rendering {
 		return -1;
 	}
 
-	VkCommandBuffer Vulkan::GetTemporaryCommandBuffer() {
-		VkCommandBufferAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-		allocInfo.commandPool = primaryCommandPool;
-		allocInfo.commandBufferCount = 1;
-
-		VkCommandBuffer commandBuffer;
-		vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-
-		return commandBuffer;
-	}
+	u32 Vulkan::CreateMemoryBlock(u32 memoryType, VkDeviceSize size, bool linear, bool dedicated) {
+		// Reuse the slot of a freed dedicated allocation if there is one
+		u32 index = 0;
+		while (index < memoryBlocks.size() && memoryBlocks[index].memory != VK_NULL_HANDLE) {
+			index++;
+		}
+		if (index == memoryBlocks.size()) {
+			memoryBlocks.emplace_back();
+		}
+		MemoryBlock& block = memoryBlocks[index];
 
-	void Vulkan::AllocateMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, VkDeviceMemory& outMemory) {
 		VkMemoryAllocateInfo memAllocInfo{};
 		memAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		memAllocInfo.allocationSize = requirements.size;
-		memAllocInfo.memoryTypeIndex = GetDeviceMemoryTypeIndex(requirements.memoryTypeBits, properties);
+		memAllocInfo.allocationSize = size;
+		memAllocInfo.memoryTypeIndex = memoryType;
 
-		VkResult err = vkAllocateMemory(device, &memAllocInfo, nullptr, &outMemory);
+		VkResult err = vkAllocateMemory(device, &memAllocInfo, nullptr, &block.memory);
 		if (err != VK_SUCCESS) {
 			DEBUG_ERROR("Failed to allocate memory!\n");
 		}
+
+		block.size = size;
+		block.mapped = nullptr;
+		block.memoryType = memoryType;
+		block.linear = linear;
+		block.dedicated = dedicated;
+		block.allocationCount = 0;
+		block.usedBytes = 0;
+
+		// Host visible memory stays mapped for its whole lifetime
+		if (physicalDeviceInfo.memProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+			vkMapMemory(device, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped);
+		}
+
+		if (!dedicated) {
+			const u32 unitCount = (u32)(memoryBlockSize / minAllocationSize);
+			block.freeNodeOrders.assign(unitCount, 0);
+			block.freeNodePositions.assign(unitCount, 0);
+			for (u32 i = 0; i < memoryBlockOrderCount; i++) {
+				block.freeLists[i].clear();
+			}
+			// The whole block starts out as a single free node
+			PushFreeNode(block, 0, memoryBlockOrderCount - 1);
+		}
+
+		return index;
+	}
+
+	void Vulkan::PushFreeNode(MemoryBlock& block, u32 unitOffset, u32 order) {
+		block.freeNodeOrders[unitOffset] = order + 1;
+		block.freeNodePositions[unitOffset] = (u32)block.freeLists[order].size();
+		block.freeLists[order].push_back(unitOffset);
+	}
+
+	void Vulkan::RemoveFreeNode(MemoryBlock& block, u32 unitOffset) {
+		std::vector<u32>& freeList = block.freeLists[block.freeNodeOrders[unitOffset] - 1];
+		const u32 position = block.freeNodePositions[unitOffset];
+		const u32 last = freeList.back();
+
+		freeList[position] = last;
+		block.freeNodePositions[last] = position;
+		freeList.pop_back();
+		block.freeNodeOrders[unitOffset] = 0;
+	}
+
+	bool Vulkan::AllocateFromBlock(MemoryBlock& block, u32 order, u32& outUnitOffset) {
+		// Take the smallest free node that fits
+		u32 freeOrder = order;
+		while (freeOrder < memoryBlockOrderCount && block.freeLists[freeOrder].empty()) {
+			freeOrder++;
+		}
+		if (freeOrder == memoryBlockOrderCount) {
+			return false;
+		}
+
+		const u32 unitOffset = block.freeLists[freeOrder].back();
+		RemoveFreeNode(block, unitOffset);
+
+		// Split it down to the requested order, the upper halves become free nodes
+		while (freeOrder > order) {
+			freeOrder--;
+			PushFreeNode(block, unitOffset + (1 << freeOrder), freeOrder);
+		}
+
+		outUnitOffset = unitOffset;
+		return true;
+	}
+
+	void Vulkan::FreeToBlock(MemoryBlock& block, u32 unitOffset, u32 order) {
+		// Merge with the buddy for as long as it's free as a whole
+		while (order < memoryBlockOrderCount - 1) {
+			const u32 buddy = unitOffset ^ (1 << order);
+			if (block.freeNodeOrders[buddy] != order + 1) {
+				break;
+			}
+			RemoveFreeNode(block, buddy);
+			unitOffset &= ~(1 << order);
+			order++;
+		}
+
+		PushFreeNode(block, unitOffset, order);
+	}
+
+	void Vulkan::FreeMemoryBlocks() {
+		for (MemoryBlock& block : memoryBlocks) {
+			if (block.memory == VK_NULL_HANDLE) {
+				continue;
+			}
+			if (block.allocationCount > 0) {
+				DEBUG_LOG("Memory block freed with %d live allocations", block.allocationCount);
+			}
+			if (block.mapped != nullptr) {
+				vkUnmapMemory(device, block.memory);
+			}
+			vkFreeMemory(device, block.memory, nullptr);
+		}
+		memoryBlocks.clear();
+	}
+
+	void Vulkan::AllocateMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, bool linear, GpuMemoryCategory category, Allocation& outAllocation) {
+		s32 memoryType = GetDeviceMemoryTypeIndex(requirements.memoryTypeBits, properties);
+		if (memoryType < 0) {
+			DEBUG_ERROR("No suitable memory type!\n");
+		}
+
+		outAllocation = {};
+		outAllocation.size = requirements.size;
+		outAllocation.category = category;
+		categoryMemoryBytes[category] += requirements.size;
+
+		// Anything this big would leave most of a block unusable, so it gets an allocation of its own
+		if (requirements.size > memoryBlockSize / 2) {
+			const u32 blockIndex = CreateMemoryBlock(memoryType, requirements.size, linear, true);
+			MemoryBlock& block = memoryBlocks[blockIndex];
+			block.allocationCount = 1;
+			block.usedBytes = requirements.size;
+
+			outAllocation.memory = block.memory;
+			outAllocation.offset = 0;
+			outAllocation.mapped = block.mapped;
+			outAllocation.block = blockIndex;
+			outAllocation.order = 0;
+			return;
+		}
+
+		u32 order = 0;
+		while ((minAllocationSize << order) < requirements.size || (minAllocationSize << order) < requirements.alignment) {
+			order++;
+		}
+
+		u32 blockIndex = 0;
+		u32 unitOffset = 0;
+		for (; blockIndex < memoryBlocks.size(); blockIndex++) {
+			MemoryBlock& block = memoryBlocks[blockIndex];
+			if (block.memory == VK_NULL_HANDLE || block.dedicated || block.memoryType != (u32)memoryType || block.linear != linear) {
+				continue;
+			}
+			if (AllocateFromBlock(block, order, unitOffset)) {
+				break;
+			}
+		}
+		if (blockIndex == memoryBlocks.size()) {
+			blockIndex = CreateMemoryBlock(memoryType, memoryBlockSize, linear, false);
+			AllocateFromBlock(memoryBlocks[blockIndex], order, unitOffset);
+		}
+
+		MemoryBlock& block = memoryBlocks[blockIndex];
+		block.allocationCount++;
+		block.usedBytes += minAllocationSize << order;
+
+		outAllocation.memory = block.memory;
+		outAllocation.offset = unitOffset * minAllocationSize;
+		outAllocation.mapped = block.mapped != nullptr ? (u8*)block.mapped + outAllocation.offset : nullptr;
+		outAllocation.block = blockIndex;
+		outAllocation.order = order;
 	}
 
-	void Vulkan::AllocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memProps, Buffer& outBuffer) {
+	void Vulkan::FreeMemory(const Allocation& allocation) {
+		if (allocation.memory == VK_NULL_HANDLE) {
+			return;
+		}
+
+		categoryMemoryBytes[allocation.category] -= allocation.size;
+
+		MemoryBlock& block = memoryBlocks[allocation.block];
+		if (block.dedicated) {
+			if (block.mapped != nullptr) {
+				vkUnmapMemory(device, block.memory);
+			}
+			vkFreeMemory(device, block.memory, nullptr);
+			block.memory = VK_NULL_HANDLE;
+			block.mapped = nullptr;
+			block.allocationCount = 0;
+			block.usedBytes = 0;
+			return;
+		}
+
+		// Empty blocks are kept, staging buffers come and go constantly and would otherwise allocate a new block every time
+		FreeToBlock(block, (u32)(allocation.offset / minAllocationSize), allocation.order);
+		block.allocationCount--;
+		block.usedBytes -= minAllocationSize << allocation.order;
+	}
+
+	GpuMemoryStats Vulkan::GetMemoryStats() const {
+		GpuMemoryStats stats{};
+		u64 freeBytes = 0;
+
+		for (const MemoryBlock& block : memoryBlocks) {
+			if (block.memory == VK_NULL_HANDLE) {
+				continue;
+			}
+
+			stats.reservedBytes += block.size;
+			stats.usedBytes += block.usedBytes;
+			stats.allocationCount += block.allocationCount;
+
+			if (block.dedicated) {
+				stats.dedicatedAllocationCount++;
+				continue;
+			}
+
+			stats.blockCount++;
+			freeBytes += block.size - block.usedBytes;
+			for (s32 order = memoryBlockOrderCount - 1; order >= 0; order--) {
+				if (!block.freeLists[order].empty()) {
+					const u64 nodeBytes = minAllocationSize << order;
+					if (nodeBytes > stats.largestFreeBytes) {
+						stats.largestFreeBytes = nodeBytes;
+					}
+					break;
+				}
+			}
+		}
+
+		stats.fragmentation = freeBytes > 0 ? 1.0f - (r32)((r64)stats.largestFreeBytes / freeBytes) : 0.0f;
+		return stats;
+	}
+
+	FrameStats Vulkan::GetFrameStats() const {
+		FrameStats stats = frameStats;
+		memcpy(stats.memoryBytes, categoryMemoryBytes, sizeof(stats.memoryBytes));
+		return stats;
+	}
+
+	void Vulkan::AllocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memProps, GpuMemoryCategory category, Buffer& outBuffer) {
 		VkBufferCreateInfo bufferInfo{};
 		bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
 		bufferInfo.pNext = nullptr;
@@ -944,6 +2094,14 @@ namespace Rendering {
 		bufferInfo.usage = usage;
 		bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
+		// Buffers that take part in uploads are shared with the transfer queue, so no ownership transfers are needed
+		const u32 queueFamilyIndices[2] = { primaryQueueFamilyIndex, transferQueueFamilyIndex };
+		if ((usage & (VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT)) && transferQueueFamilyIndex != primaryQueueFamilyIndex) {
+			bufferInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+			bufferInfo.queueFamilyIndexCount = 2;
+			bufferInfo.pQueueFamilyIndices = queueFamilyIndices;
+		}
+
 		VkResult err = vkCreateBuffer(device, &bufferInfo, nullptr, &outBuffer.buffer);
 		if (err != VK_SUCCESS) {
 			DEBUG_ERROR("Failed to create buffer!\n");
@@ -953,56 +2111,171 @@ namespace Rendering {
 		vkGetBufferMemoryRequirements(device, outBuffer.buffer, &memRequirements);
 		DEBUG_LOG("Buffer memory required: %d\n", memRequirements.size);
 
-		AllocateMemory(memRequirements, memProps, outBuffer.memory);
+		AllocateMemory(memRequirements, memProps, true, category, outBuffer.allocation);
 
-		vkBindBufferMemory(device, outBuffer.buffer, outBuffer.memory, 0);
+		vkBindBufferMemory(device, outBuffer.buffer, outBuffer.allocation.memory, outBuffer.allocation.offset);
 	}
 
-	void Vulkan::CopyBuffer(const VkBuffer& src, const VkBuffer& dst, VkDeviceSize size) {
-		VkCommandBuffer temp = GetTemporaryCommandBuffer();
+	Vulkan::UploadBatch& Vulkan::GetUploadBatch() {
+		const u64 value = uploadSubmittedValue + 1;
+		UploadBatch& batch = uploadBatches[value % uploadBatchCount];
 
-		VkCommandBufferBeginInfo beginInfo{};
-		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		if (!uploadBatchOpen) {
+			// The slot's previous batch has to be done before its command buffers can be reused
+			if (value > uploadBatchCount) {
+				WaitForUploads(value - uploadBatchCount);
+			}
+
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
 
-		vkBeginCommandBuffer(temp, &beginInfo);
+			vkResetCommandBuffer(batch.transferCmd, 0);
+			vkResetCommandBuffer(batch.graphicsCmd, 0);
+			vkBeginCommandBuffer(batch.transferCmd, &beginInfo);
+			vkBeginCommandBuffer(batch.graphicsCmd, &beginInfo);
+
+			batch.timelineValue = value;
+			uploadBatchOpen = true;
+		}
+
+		return batch;
+	}
+
+	// Copies the data to staging memory right away, so the caller can free it.
+	// Has to be called before GetUploadBatch, since making room in the ring may submit the open batch.
+	void Vulkan::StageUploadData(const void* data, VkDeviceSize size, VkBuffer& outBuffer, VkDeviceSize& outOffset) {
+		if (size > uploadStagingSize) {
+			Buffer overflowBuffer{};
+			AllocateBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, GPU_MEMORY_STAGING, overflowBuffer);
+			memcpy(overflowBuffer.allocation.mapped, data, size);
+
+			GetUploadBatch().overflowBuffers.push_back(overflowBuffer);
+			outBuffer = overflowBuffer.buffer;
+			outOffset = 0;
+			return;
+		}
+
+		// Move both ends to the start of the ring when it's empty, so that a large upload doesn't have to wait for nothing
+		if (uploadStagingTail == uploadStagingHead) {
+			uploadStagingHead = (uploadStagingHead + uploadStagingSize - 1) / uploadStagingSize * uploadStagingSize;
+			uploadStagingTail = uploadStagingHead;
+		}
+
+		// 16 byte alignment satisfies buffer to image copies of every format we use
+		u64 head = (uploadStagingHead + 15) & ~15ull;
+		// Don't straddle the end of the ring
+		if (head % uploadStagingSize + size > uploadStagingSize) {
+			head += uploadStagingSize - head % uploadStagingSize;
+		}
+
+		while (head + size - uploadStagingTail > uploadStagingSize) {
+			if (uploadCompletedValue == uploadSubmittedValue) {
+				// Everything in flight is done, so the open batch itself is holding the ring
+				FlushUploads();
+			}
+			WaitForUploads(uploadCompletedValue + 1);
+		}
+
+		memcpy((u8*)uploadStagingBuffer.allocation.mapped + head % uploadStagingSize, data, size);
+		uploadStagingHead = head + size;
+
+		outBuffer = uploadStagingBuffer.buffer;
+		outOffset = head % uploadStagingSize;
+	}
+
+	void Vulkan::UploadToBuffer(const void* data, VkDeviceSize size, const VkBuffer& dst, VkDeviceSize dstOffset) {
+		VkBuffer stagingBuffer;
+		VkDeviceSize stagingOffset;
+		StageUploadData(data, size, stagingBuffer, stagingOffset);
+
+		UploadBatch& batch = GetUploadBatch();
 
 		VkBufferCopy copyRegion{};
-		copyRegion.srcOffset = 0; // Optional
-		copyRegion.dstOffset = 0; // Optional
+		copyRegion.srcOffset = stagingOffset;
+		copyRegion.dstOffset = dstOffset;
 		copyRegion.size = size;
-		vkCmdCopyBuffer(temp, src, dst, 1, &copyRegion);
+		vkCmdCopyBuffer(batch.transferCmd, stagingBuffer, dst, 1, &copyRegion);
+	}
+
+	void Vulkan::FlushUploads() {
+		PROFILE_ZONE("Vulkan::FlushUploads");
+		if (!uploadBatchOpen) {
+			return;
+		}
 
-		vkEndCommandBuffer(temp);
+		UploadBatch& batch = uploadBatches[(uploadSubmittedValue + 1) % uploadBatchCount];
+		vkEndCommandBuffer(batch.transferCmd);
+		vkEndCommandBuffer(batch.graphicsCmd);
+		batch.stagingEnd = uploadStagingHead;
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineInfo.signalSemaphoreValueCount = 1;
+		timelineInfo.pSignalSemaphoreValues = &batch.timelineValue;
 
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pNext = &timelineInfo;
 		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &temp;
+		submitInfo.signalSemaphoreCount = 1;
 
+		submitInfo.pCommandBuffers = &batch.transferCmd;
+		submitInfo.pSignalSemaphores = &uploadTransferTimeline;
+		vkQueueSubmit(transferQueue, 1, &submitInfo, VK_NULL_HANDLE);
+
+		submitInfo.pCommandBuffers = &batch.graphicsCmd;
+		submitInfo.pSignalSemaphores = &uploadGraphicsTimeline;
 		vkQueueSubmit(primaryQueue, 1, &submitInfo, VK_NULL_HANDLE);
-		vkQueueWaitIdle(primaryQueue);
 
-		vkFreeCommandBuffers(device, primaryCommandPool, 1, &temp);
+		uploadSubmittedValue = batch.timelineValue;
+		uploadBatchOpen = false;
 	}
 
-	void Vulkan::CopyRawDataToBuffer(void* src, const VkBuffer& dst, VkDeviceSize size) {
-		Buffer stagingBuffer{};
-		AllocateBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer);
+	void Vulkan::RetireUploads() {
+		u64 transferValue, graphicsValue;
+		vkGetSemaphoreCounterValue(device, uploadTransferTimeline, &transferValue);
+		vkGetSemaphoreCounterValue(device, uploadGraphicsTimeline, &graphicsValue);
+		const u64 completedValue = MIN(transferValue, graphicsValue);
 
-		void* data;
-		vkMapMemory(device, stagingBuffer.memory, 0, size, 0, &data);
-		memcpy(data, src, size);
-		vkUnmapMemory(device, stagingBuffer.memory);
+		while (uploadCompletedValue < completedValue) {
+			uploadCompletedValue++;
+			UploadBatch& batch = uploadBatches[uploadCompletedValue % uploadBatchCount];
 
-		CopyBuffer(stagingBuffer.buffer, dst, size);
+			for (const Buffer& buffer : batch.overflowBuffers) {
+				FreeBuffer(buffer);
+			}
+			batch.overflowBuffers.clear();
 
-		FreeBuffer(stagingBuffer);
+			uploadStagingTail = MAX(uploadStagingTail, batch.stagingEnd);
+		}
+	}
+
+	void Vulkan::WaitForUploads(u64 value) {
+		// The value may belong to the batch that's still being recorded
+		if (value > uploadSubmittedValue) {
+			FlushUploads();
+		}
+		if (value <= uploadCompletedValue) {
+			return;
+		}
+
+		VkSemaphore semaphores[2] = { uploadTransferTimeline, uploadGraphicsTimeline };
+		u64 values[2] = { value, value };
+
+		VkSemaphoreWaitInfo waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.semaphoreCount = 2;
+		waitInfo.pSemaphores = semaphores;
+		waitInfo.pValues = values;
+		vkWaitSemaphores(device, &waitInfo, UINT64_MAX);
+
+		RetireUploads();
 	}
 
 	void Vulkan::FreeBuffer(const Buffer& buffer) {
 		vkDestroyBuffer(device, buffer.buffer, nullptr);
-		vkFreeMemory(device, buffer.memory, nullptr);
+		FreeMemory(buffer.allocation);
 	}
 
 	VkShaderModule Vulkan::CreateShaderModule(const char* code, const u32 size) {
@@ -1010,6 +2283,9 @@ namespace Rendering {
 		createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
 		createInfo.codeSize = size;
 		createInfo.pCode = (const u32*)code;
+		if (code == nullptr) {
+			DEBUG_ERROR("Shader file not found!");
+		}
 
 		VkShaderModule module;
 		VkResult err = vkCreateShaderModule(device, &createInfo, nullptr, &module);
@@ -1019,6 +2295,59 @@ namespace Rendering {
 		return module;
 	}
 
+	// FNV-1a, only used to find identical SPIR-V
+	static u64 HashBytes(const char* data, u32 length) {
+		u64 hash = 14695981039346656037ull;
+		for (u32 i = 0; i < length; i++) {
+			hash ^= (u8)data[i];
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	u64 Vulkan::AcquireShaderModule(const char* path) {
+		auto pathHash = shaderPathHashes.find(path);
+		if (pathHash != shaderPathHashes.end()) {
+			auto module = shaderModules.find(pathHash->second);
+			if (module != shaderModules.end()) {
+				module->second.refCount++;
+				return pathHash->second;
+			}
+		}
+
+		u32 length;
+		char* bytes = AllocFileBytes(path, length);
+		if (bytes == nullptr) {
+			DEBUG_ERROR("Shader file %s not found!", path);
+		}
+		// Different files can still hold the same SPIR-V. Different SPIR-V with the same hash moves on to the next key.
+		u64 hash = HashBytes(bytes, length);
+		auto module = shaderModules.find(hash);
+		while (module != shaderModules.end() && (module->second.code.size() != length || memcmp(module->second.code.data(), bytes, length) != 0)) {
+			module = shaderModules.find(++hash);
+		}
+		if (module != shaderModules.end()) {
+			module->second.refCount++;
+		}
+		else {
+			shaderModules[hash] = { CreateShaderModule(bytes, length), 1, std::vector<char>(bytes, bytes + length) };
+		}
+		shaderPathHashes[path] = hash;
+		free(bytes);
+		return hash;
+	}
+	void Vulkan::ReleaseShaderModule(u64 hash) {
+		ShaderModule& module = shaderModules[hash];
+		if (--module.refCount == 0) {
+			vkDestroyShaderModule(device, module.module, nullptr);
+			shaderModules.erase(hash);
+			// The key can be handed to different SPIR-V later
+			for (auto it = shaderPathHashes.begin(); it != shaderPathHashes.end();) {
+				it = it->second == hash ? shaderPathHashes.erase(it) : std::next(it);
+			}
+		}
+	}
+
 	void Vulkan::CreateDescriptorSetLayout(VkDescriptorSetLayout& layout, const DescriptorSetLayoutInfo& info) {
 		if (info.samplerCount > maxSamplerCount) {
 			DEBUG_ERROR("Max sampler count exceeded");
@@ -1032,7 +2361,7 @@ namespace Rendering {
 		if ((info.flags & DSF_CAMERADATA) == DSF_CAMERADATA)
 		{
 			bindings[bindingIndex].binding = cameraDataBinding;
-			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 			bindings[bindingIndex].descriptorCount = 1;
 			bindings[bindingIndex].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 			bindings[bindingIndex].pImmutableSamplers = nullptr;
@@ -1044,7 +2373,7 @@ namespace Rendering {
 		if ((info.flags & DSF_LIGHTINGDATA) == DSF_LIGHTINGDATA)
 		{
 			bindings[bindingIndex].binding = lightingDataBinding;
-			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 			bindings[bindingIndex].descriptorCount = 1;
 			bindings[bindingIndex].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 			bindings[bindingIndex].pImmutableSamplers = nullptr;
@@ -1056,7 +2385,15 @@ namespace Rendering {
 		if ((info.flags & DSF_INSTANCEDATA) == DSF_INSTANCEDATA)
 		{
 			bindings[bindingIndex].binding = perInstanceDataBinding;
-			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+			bindings[bindingIndex].descriptorCount = 1;
+			bindings[bindingIndex].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+			bindings[bindingIndex].pImmutableSamplers = nullptr;
+
+			bindingIndex++;
+
+			bindings[bindingIndex].binding = instanceIndexBinding;
+			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
 			bindings[bindingIndex].descriptorCount = 1;
 			bindings[bindingIndex].stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 			bindings[bindingIndex].pImmutableSamplers = nullptr;
@@ -1068,7 +2405,7 @@ namespace Rendering {
 		if ((info.flags & DSF_SHADERDATA) == DSF_SHADERDATA)
 		{
 			bindings[bindingIndex].binding = shaderDataBinding;
-			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			bindings[bindingIndex].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
 			bindings[bindingIndex].descriptorCount = 1;
 			bindings[bindingIndex].stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
 			bindings[bindingIndex].pImmutableSamplers = nullptr;
@@ -1145,15 +2482,7 @@ namespace Rendering {
 		vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &layout);
 	}
 
-	void Vulkan::CreateShaderRenderPipeline(VkPipelineLayout& outLayout, VkPipeline& outPipeline, const VkDescriptorSetLayout &descSetLayout, VertexAttribFlags vertexInputs, const char* vert, const char* frag) {
-		// Create shader modules
-		u32 vertShaderLength;
-		char* vertShaderBytes = AllocFileBytes(vert, vertShaderLength);
-		u32 fragShaderLength;
-		char* fragShaderBytes = AllocFileBytes(frag, fragShaderLength);
-
-		VkShaderModule vertShader = CreateShaderModule(vertShaderBytes, vertShaderLength);
-
+	void Vulkan::CreateShaderRenderPipeline(VkPipelineLayout layout, VkPipeline& outPipeline, VertexAttribFlags vertexInputs, VertexLayout vertexLayout, VkShaderModule vertShader, VkShaderModule fragShader) const {
 		VkPipelineShaderStageCreateInfo vertShaderStageInfo;
 		vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 		vertShaderStageInfo.pNext = nullptr;
@@ -1163,8 +2492,6 @@ namespace Rendering {
 		vertShaderStageInfo.pName = "main";
 		vertShaderStageInfo.pSpecializationInfo = nullptr;
 
-		VkShaderModule fragShader = CreateShaderModule(fragShaderBytes, fragShaderLength);
-
 		VkPipelineShaderStageCreateInfo fragShaderStageInfo;
 		fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
 		fragShaderStageInfo.pNext = nullptr;
@@ -1179,74 +2506,95 @@ namespace Rendering {
 		// Vertex input
 		VkVertexInputBindingDescription vertDescriptions[10];
 		VkVertexInputAttributeDescription attributeDescriptions[10];
+		u32 vertexBindingCount = 0;
 		u32 vertexInputCount = 0;
 
-		if (vertexInputs & VERTEX_POSITION_BIT) {
-			vertDescriptions[vertexInputCount].binding = 0;
-			vertDescriptions[vertexInputCount].stride = sizeof(glm::vec3);
-			vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		if (vertexLayout == VERTEX_LAYOUT_PACKED) {
+			vertDescriptions[0].binding = 0;
+			vertDescriptions[0].stride = sizeof(PackedVertex);
+			vertDescriptions[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+			vertexBindingCount = 1;
+
+			const VkVertexInputAttributeDescription packedAttributes[5] = {
+				{ 0, 0, VK_FORMAT_R32G32B32_SFLOAT, offsetof(PackedVertex, position) },
+				{ 1, 0, VK_FORMAT_R16G16_SFLOAT, offsetof(PackedVertex, texcoord0) },
+				{ 2, 0, VK_FORMAT_R16G16_SNORM, offsetof(PackedVertex, normal) },
+				{ 3, 0, VK_FORMAT_R16G16_SNORM, offsetof(PackedVertex, tangent) },
+				{ 4, 0, VK_FORMAT_R8G8B8A8_UNORM, offsetof(PackedVertex, color) },
+			};
+			for (const VkVertexInputAttributeDescription& attribute : packedAttributes) {
+				attributeDescriptions[vertexInputCount++] = attribute;
+			}
+		}
+		else {
+			if (vertexInputs & VERTEX_POSITION_BIT) {
+				vertDescriptions[vertexInputCount].binding = 0;
+				vertDescriptions[vertexInputCount].stride = sizeof(glm::vec3);
+				vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-			attributeDescriptions[vertexInputCount].binding = 0;
-			attributeDescriptions[vertexInputCount].location = 0;
-			attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32_SFLOAT;
-			attributeDescriptions[vertexInputCount].offset = 0;
+				attributeDescriptions[vertexInputCount].binding = 0;
+				attributeDescriptions[vertexInputCount].location = 0;
+				attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32_SFLOAT;
+				attributeDescriptions[vertexInputCount].offset = 0;
 
-			vertexInputCount++;
-		}
-		if (vertexInputs & VERTEX_TEXCOORD_0_BIT) {
-			vertDescriptions[vertexInputCount].binding = 1;
-			vertDescriptions[vertexInputCount].stride = sizeof(glm::vec2);
-			vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+				vertexInputCount++;
+			}
+			if (vertexInputs & VERTEX_TEXCOORD_0_BIT) {
+				vertDescriptions[vertexInputCount].binding = 1;
+				vertDescriptions[vertexInputCount].stride = sizeof(glm::vec2);
+				vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-			attributeDescriptions[vertexInputCount].binding = 1;
-			attributeDescriptions[vertexInputCount].location = 1;
-			attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32_SFLOAT;
-			attributeDescriptions[vertexInputCount].offset = 0;
+				attributeDescriptions[vertexInputCount].binding = 1;
+				attributeDescriptions[vertexInputCount].location = 1;
+				attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32_SFLOAT;
+				attributeDescriptions[vertexInputCount].offset = 0;
 
-			vertexInputCount++;
-		}
-		if (vertexInputs & VERTEX_NORMAL_BIT) {
-			vertDescriptions[vertexInputCount].binding = 2;
-			vertDescriptions[vertexInputCount].stride = sizeof(glm::vec3);
-			vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+				vertexInputCount++;
+			}
+			if (vertexInputs & VERTEX_NORMAL_BIT) {
+				vertDescriptions[vertexInputCount].binding = 2;
+				vertDescriptions[vertexInputCount].stride = sizeof(glm::vec3);
+				vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-			attributeDescriptions[vertexInputCount].binding = 2;
-			attributeDescriptions[vertexInputCount].location = 2;
-			attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32_SFLOAT;
-			attributeDescriptions[vertexInputCount].offset = 0;
+				attributeDescriptions[vertexInputCount].binding = 2;
+				attributeDescriptions[vertexInputCount].location = 2;
+				attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32_SFLOAT;
+				attributeDescriptions[vertexInputCount].offset = 0;
 
-			vertexInputCount++;
-		}
-		if (vertexInputs & VERTEX_TANGENT_BIT) {
-			vertDescriptions[vertexInputCount].binding = 3;
-			vertDescriptions[vertexInputCount].stride = sizeof(glm::vec4);
-			vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+				vertexInputCount++;
+			}
+			if (vertexInputs & VERTEX_TANGENT_BIT) {
+				vertDescriptions[vertexInputCount].binding = 3;
+				vertDescriptions[vertexInputCount].stride = sizeof(glm::vec4);
+				vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-			attributeDescriptions[vertexInputCount].binding = 3;
-			attributeDescriptions[vertexInputCount].location = 3;
-			attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-			attributeDescriptions[vertexInputCount].offset = 0;
+				attributeDescriptions[vertexInputCount].binding = 3;
+				attributeDescriptions[vertexInputCount].location = 3;
+				attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+				attributeDescriptions[vertexInputCount].offset = 0;
 
-			vertexInputCount++;
-		}
-		if (vertexInputs & VERTEX_COLOR_BIT) {
-			vertDescriptions[vertexInputCount].binding = 4;
-			vertDescriptions[vertexInputCount].stride = sizeof(glm::vec4);
-			vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+				vertexInputCount++;
+			}
+			if (vertexInputs & VERTEX_COLOR_BIT) {
+				vertDescriptions[vertexInputCount].binding = 4;
+				vertDescriptions[vertexInputCount].stride = sizeof(glm::vec4);
+				vertDescriptions[vertexInputCount].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
-			attributeDescriptions[vertexInputCount].binding = 4;
-			attributeDescriptions[vertexInputCount].location = 4;
-			attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32A32_SFLOAT;
-			attributeDescriptions[vertexInputCount].offset = 0;
+				attributeDescriptions[vertexInputCount].binding = 4;
+				attributeDescriptions[vertexInputCount].location = 4;
+				attributeDescriptions[vertexInputCount].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+				attributeDescriptions[vertexInputCount].offset = 0;
 
-			vertexInputCount++;
+				vertexInputCount++;
+			}
+			vertexBindingCount = vertexInputCount;
 		}
 
 		VkPipelineVertexInputStateCreateInfo vertexInputInfo;
 		vertexInputInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
 		vertexInputInfo.pNext = nullptr;
 		vertexInputInfo.flags = 0;
-		vertexInputInfo.vertexBindingDescriptionCount = vertexInputCount;
+		vertexInputInfo.vertexBindingDescriptionCount = vertexBindingCount;
 		vertexInputInfo.pVertexBindingDescriptions = vertDescriptions;
 		vertexInputInfo.vertexAttributeDescriptionCount = vertexInputCount;
 		vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions;
@@ -1290,7 +2638,7 @@ namespace Rendering {
 		multisampling.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
 		multisampling.pNext = nullptr;
 		multisampling.flags = 0;
-		multisampling.rasterizationSamples = VK_SAMPLE_COUNT_8_BIT;
+		multisampling.rasterizationSamples = msaaSamples;
 		multisampling.sampleShadingEnable = VK_FALSE;
 		multisampling.minSampleShading = 1.0f; // Optional
 		multisampling.pSampleMask = nullptr; // Optional
@@ -1338,19 +2686,6 @@ namespace Rendering {
 
 		////////////////////////////////////////////////////////
 
-		VkPipelineLayoutCreateInfo pipelineLayoutInfo;
-		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-		pipelineLayoutInfo.pNext = nullptr;
-		pipelineLayoutInfo.flags = 0;
-		pipelineLayoutInfo.setLayoutCount = 1;
-		pipelineLayoutInfo.pSetLayouts = &descSetLayout;
-		pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-		pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
-
-		vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &outLayout);
-
-		////////////////////////////////////////////////////////
-
 		// Dynamic viewport and scissor, as the window size might change
 		// (Although it shouldn't change very often)
 		VkDynamicState dynamicStates[] = {
@@ -1377,16 +2712,16 @@ namespace Rendering {
 		pipelineInfo.pDepthStencilState = &depthStencil;
 		pipelineInfo.pColorBlendState = &colorBlending;
 		pipelineInfo.pDynamicState = &dynamicStateInfo;
-		pipelineInfo.layout = outLayout;
+		pipelineInfo.layout = layout;
 		pipelineInfo.renderPass = forwardRenderPass;
 		pipelineInfo.subpass = 0;
 		pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 		pipelineInfo.basePipelineIndex = -1; // Optional
 
-		vkCreateGraphicsPipelines(device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &outPipeline);
-
-		vkDestroyShaderModule(device, vertShader, nullptr);
-		vkDestroyShaderModule(device, fragShader, nullptr);
+		// The pipeline cache is synchronized internally
+		if (vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineInfo, nullptr, &outPipeline) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to create graphics pipeline!");
+		}
 	}
 
 	void Vulkan::InitializeDescriptorSet(VkDescriptorSet descriptorSet, const DescriptorSetLayoutInfo& info, const MaterialHandle matHandle, const TextureHandle* texHandles) {
@@ -1395,9 +2730,9 @@ namespace Rendering {
 			VkDescriptorBufferInfo bufferInfo{};
 			bufferInfo.buffer = cameraDataBuffer.buffer;
 			bufferInfo.offset = 0;
-			bufferInfo.range = VK_WHOLE_SIZE;
+			bufferInfo.range = sizeof(CameraData);
 
-			UpdateDescriptorSetBuffer(descriptorSet, cameraDataBinding, bufferInfo);
+			UpdateDescriptorSetBuffer(descriptorSet, cameraDataBinding, bufferInfo, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
 		}
 
 		if ((info.flags & DSF_LIGHTINGDATA) == DSF_LIGHTINGDATA)
@@ -1405,9 +2740,9 @@ namespace Rendering {
 			VkDescriptorBufferInfo bufferInfo{};
 			bufferInfo.buffer = lightingDataBuffer.buffer;
 			bufferInfo.offset = 0;
-			bufferInfo.range = VK_WHOLE_SIZE;
+			bufferInfo.range = sizeof(LightingData);
 
-			UpdateDescriptorSetBuffer(descriptorSet, lightingDataBinding, bufferInfo);
+			UpdateDescriptorSetBuffer(descriptorSet, lightingDataBinding, bufferInfo, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
 		}
 
 		if ((info.flags & DSF_INSTANCEDATA) == DSF_INSTANCEDATA)
@@ -1415,9 +2750,13 @@ namespace Rendering {
 			VkDescriptorBufferInfo bufferInfo{};
 			bufferInfo.buffer = perInstanceBuffer.buffer;
 			bufferInfo.offset = 0;
-			bufferInfo.range = VK_WHOLE_SIZE;
+			bufferInfo.range = perInstanceFrameSize;
+
+			UpdateDescriptorSetBuffer(descriptorSet, perInstanceDataBinding, bufferInfo, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
 
-			UpdateDescriptorSetBuffer(descriptorSet, perInstanceDataBinding, bufferInfo, true);
+			bufferInfo.buffer = instanceIndexBuffer.buffer;
+			bufferInfo.range = instanceIndexFrameSize;
+			UpdateDescriptorSetBuffer(descriptorSet, instanceIndexBinding, bufferInfo, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC);
 		}
 
 		if ((info.flags & DSF_SHADERDATA) == DSF_SHADERDATA)
@@ -1427,10 +2766,10 @@ namespace Rendering {
 			}
 			VkDescriptorBufferInfo bufferInfo{};
 			bufferInfo.buffer = shaderDataBuffer.buffer;
-			bufferInfo.offset = maxShaderDataBlockSize * matHandle;
+			bufferInfo.offset = maxShaderDataBlockSize * PoolHandleIndex(matHandle);
 			bufferInfo.range = maxShaderDataBlockSize;
 
-			UpdateDescriptorSetBuffer(descriptorSet, shaderDataBinding, bufferInfo, false);
+			UpdateDescriptorSetBuffer(descriptorSet, shaderDataBinding, bufferInfo, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC);
 		}
 
 		if (info.samplerCount > 0 && texHandles == nullptr) {
@@ -1511,7 +2850,7 @@ namespace Rendering {
 		vkUpdateDescriptorSets(device, 1, &descriptorWrite, 0, nullptr);
 	}
 
-	void Vulkan::UpdateDescriptorSetBuffer(VkDescriptorSet descriptorSet, u32 binding, VkDescriptorBufferInfo info, bool dynamic) {
+	void Vulkan::UpdateDescriptorSetBuffer(VkDescriptorSet descriptorSet, u32 binding, VkDescriptorBufferInfo info, VkDescriptorType type) {
 		VkWriteDescriptorSet descriptorWrite{};
 		descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 		descriptorWrite.pNext = nullptr;
@@ -1519,7 +2858,7 @@ namespace Rendering {
 		descriptorWrite.dstBinding = binding;
 		descriptorWrite.dstArrayElement = 0;
 		descriptorWrite.descriptorCount = 1;
-		descriptorWrite.descriptorType = dynamic ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		descriptorWrite.descriptorType = type;
 		descriptorWrite.pBufferInfo = &info;
 		descriptorWrite.pImageInfo = nullptr;
 		descriptorWrite.pTexelBufferView = nullptr;
@@ -1528,6 +2867,13 @@ namespace Rendering {
 	}
 
 	TextureHandle Vulkan::CreateTexture(const TextureCreateInfo& info) {
+		TextureHandle handle = CreateTextureAsync(info);
+		if (handle >= 0) {
+			WaitForUploads(textures[handle].uploadValue);
+		}
+		return handle;
+	}
+	TextureHandle Vulkan::CreateTextureAsync(const TextureCreateInfo& info) {
 		VkFormat format = VK_FORMAT_UNDEFINED;
 		u32 layerCount = info.type == TEXTURE_CUBEMAP ? 6 : 1;
 
@@ -1570,8 +2916,8 @@ namespace Rendering {
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(device, texture.image, &memRequirements);
 
-		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, texture.memory);
-		vkBindImageMemory(device, texture.image, texture.memory, 0);
+		AllocateMemory(memRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, GPU_MEMORY_TEXTURE, texture.allocation);
+		vkBindImageMemory(device, texture.image, texture.allocation.memory, texture.allocation.offset);
 
 		VkImageViewCreateInfo viewInfo{};
 		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -1609,27 +2955,17 @@ namespace Rendering {
 		vkCreateSampler(device, &samplerInfo, nullptr, &texture.sampler);
 
 		// Copy data
-		Buffer stagingBuffer;
 		VkDeviceSize imageBytes = info.width * info.height * 4;
 		if (info.type == TEXTURE_CUBEMAP) {
 			imageBytes *= 6;
 		}
-		AllocateBuffer(imageBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer);
+		VkBuffer stagingBuffer;
+		VkDeviceSize stagingOffset;
+		StageUploadData(info.pixels, imageBytes, stagingBuffer, stagingOffset);
 
-		void* data;
-		vkMapMemory(device, stagingBuffer.memory, 0, imageBytes, 0, &data);
-		memcpy(data, info.pixels, imageBytes);
-		vkUnmapMemory(device, stagingBuffer.memory);
-
-		VkCommandBuffer temp = GetTemporaryCommandBuffer();
-
-		VkCommandBufferBeginInfo beginInfo;
-		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-		beginInfo.pNext = nullptr;
-		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-		beginInfo.pInheritanceInfo = nullptr;
-
-		vkBeginCommandBuffer(temp, &beginInfo);
+		// Mip generation uses blits, so the whole texture upload goes on the graphics queue
+		UploadBatch& batch = GetUploadBatch();
+		VkCommandBuffer temp = batch.graphicsCmd;
 
 		//cmds
 		VkImageMemoryBarrier barrier;
@@ -1651,7 +2987,7 @@ namespace Rendering {
 		vkCmdPipelineBarrier(temp, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
 
 		VkBufferImageCopy region;
-		region.bufferOffset = 0;
+		region.bufferOffset = stagingOffset;
 		region.bufferRowLength = 0;
 		region.bufferImageHeight = 0;
 		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -1661,7 +2997,7 @@ namespace Rendering {
 		region.imageOffset = { 0,0,0 };
 		region.imageExtent = { info.width,info.height,1 };
 
-		vkCmdCopyBufferToImage(temp, stagingBuffer.buffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+		vkCmdCopyBufferToImage(temp, stagingBuffer, texture.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
 
 		// Generate mipmaps
 		// This needs to be done even if there are no mipmaps, to convert the texture into the correct format
@@ -1726,78 +3062,191 @@ namespace Rendering {
 
 		vkCmdPipelineBarrier(temp, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &mipBarrier);
 
-		vkEndCommandBuffer(temp);
-
-		VkSubmitInfo submitInfo{};
-		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &temp;
-
-		vkQueueSubmit(primaryQueue, 1, &submitInfo, VK_NULL_HANDLE);
-		vkQueueWaitIdle(primaryQueue);
-
-		vkFreeCommandBuffers(device, primaryCommandPool, 1, &temp);
-
-		FreeBuffer(stagingBuffer);
+		texture.uploadValue = batch.timelineValue;
 		
 		return textures.Add(texture);
 	}
+	bool Vulkan::IsTextureReady(TextureHandle handle) {
+		return textures[handle].uploadValue <= uploadCompletedValue;
+	}
 	void Vulkan::FreeTexture(TextureHandle handle) {
 		const TextureImpl& texture = textures[handle];
+		WaitForUploads(texture.uploadValue);
 
 		vkDestroySampler(device, texture.sampler, nullptr);
 		vkDestroyImageView(device, texture.view, nullptr);
 		vkDestroyImage(device, texture.image, nullptr);
-		vkFreeMemory(device, texture.memory, nullptr);
+		FreeMemory(texture.allocation);
 
 		textures.Remove(handle);
 	}
 
+	static constexpr u32 packVertexGrainSize = 4096;
+
+	// Missing attributes get defaults, so that every packed mesh fits the same vertex input state
+	static void PackVertices(const MeshCreateInfo& data, u32 first, u32 last, PackedVertex* outVertices) {
+		for (u32 i = first; i < last; i++) {
+			PackedVertex& vertex = outVertices[i];
+
+			vertex.position = data.position != nullptr ? data.position[i] : glm::vec3(0.0f);
+			vertex.texcoord0 = glm::packHalf2x16(data.texcoord0 != nullptr ? data.texcoord0[i] : glm::vec2(0.0f));
+			vertex.normal = glm::packSnorm2x16(OctEncode(data.normal != nullptr ? data.normal[i] : glm::vec3(0.0f, 0.0f, 1.0f)));
+
+			const VertexTangent tangent = data.tangent != nullptr ? data.tangent[i] : VertexTangent(1.0f, 0.0f, 0.0f, 1.0f);
+			glm::vec2 octTangent = OctEncode(glm::vec3(tangent));
+			// Remap y to [0, 1] so its sign can carry the bitangent sign, kept above zero so the sign survives quantization
+			octTangent.y = MAX(octTangent.y * 0.5f + 0.5f, 1.0f / 32767.0f) * (tangent.w < 0.0f ? -1.0f : 1.0f);
+			vertex.tangent = glm::packSnorm2x16(octTangent);
+
+			vertex.color = glm::packUnorm4x8(data.color != nullptr ? data.color[i] : Color(1.0f));
+		}
+	}
+
 	MeshHandle Vulkan::CreateMesh(const MeshCreateInfo& data) {
+		MeshHandle handle = CreateMeshAsync(data);
+		if (handle >= 0) {
+			WaitForUploads(meshes[handle].uploadValue);
+		}
+		return handle;
+	}
+	MeshHandle Vulkan::CreateMeshAsync(const MeshCreateInfo& data) {
 		MeshImpl mesh{};
 
-		if (data.position != nullptr) {
-			const VkDeviceSize posBytes = sizeof(glm::vec3) * data.vertexCount;
-			AllocateBuffer(posBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexPositionBuffer);
-			CopyRawDataToBuffer(data.position, mesh.vertexPositionBuffer.buffer, posBytes);
+		mesh.vertexLayout = data.layout;
+		const u32 indexCount = data.triangleCount * 3;
+
+		// Indices are widened to 32 bits to be optimized, then narrowed back down if every vertex can be reached with 16 bits
+		mesh.indexType = data.vertexCount <= 65536 ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+		const void* indexData = data.triangles32 != nullptr ? (const void*)data.triangles32 : (const void*)data.triangles;
+		u32* indices32 = nullptr;
+		u16* indices16 = nullptr;
+		if (data.triangles32 != nullptr || data.optimizeIndices || mesh.indexType == VK_INDEX_TYPE_UINT32) {
+			indices32 = (u32*)calloc(indexCount, sizeof(u32));
+			for (u32 i = 0; i < indexCount; i++) {
+				indices32[i] = data.triangles32 != nullptr ? data.triangles32[i / 3].index[i % 3] : data.triangles[i / 3].index[i % 3];
+			}
+
+			if (data.optimizeIndices) {
+				OptimizeVertexCache(indices32, indexCount, data.vertexCount);
+				OptimizeOverdraw(indices32, indexCount, data.position, data.vertexCount);
+			}
+
+			if (mesh.indexType == VK_INDEX_TYPE_UINT16) {
+				indices16 = (u16*)calloc(indexCount, sizeof(u16));
+				for (u32 i = 0; i < indexCount; i++) {
+					indices16[i] = (u16)indices32[i];
+				}
+				indexData = indices16;
+			}
+			else {
+				indexData = indices32;
+			}
 		}
+		const VkDeviceSize indexSize = mesh.indexType == VK_INDEX_TYPE_UINT16 ? sizeof(u16) : sizeof(u32);
+		RangeAllocator& sharedIndices = mesh.indexType == VK_INDEX_TYPE_UINT16 ? sharedIndexRanges : sharedIndex32Ranges;
 
-		if (data.texcoord0 != nullptr) {
-			const VkDeviceSize uvBytes = sizeof(glm::vec2) * data.vertexCount;
-			AllocateBuffer(uvBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexTexcoord0Buffer);
-			CopyRawDataToBuffer(data.texcoord0, mesh.vertexTexcoord0Buffer.buffer, uvBytes);
+		// Packed meshes go to the shared buffers, unless they're full
+		if (data.layout == VERTEX_LAYOUT_PACKED && sharedVertexRanges.Allocate(data.vertexCount, mesh.baseVertex)) {
+			if (sharedIndices.Allocate(indexCount, mesh.firstIndex)) {
+				mesh.sharedGeometry = true;
+			}
+			else {
+				sharedVertexRanges.Free(mesh.baseVertex, data.vertexCount);
+				mesh.baseVertex = 0;
+			}
+		}
+		if (data.layout == VERTEX_LAYOUT_PACKED && !mesh.sharedGeometry) {
+			DEBUG_LOG("Shared geometry buffers full, mesh with %d vertices gets its own buffers", data.vertexCount);
 		}
 
-		if (data.normal != nullptr) {
-			const VkDeviceSize normalBytes = sizeof(glm::vec3) * data.vertexCount;
-			AllocateBuffer(normalBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexNormalBuffer);
-			CopyRawDataToBuffer(data.normal, mesh.vertexNormalBuffer.buffer, normalBytes);
+		if (data.layout == VERTEX_LAYOUT_PACKED) {
+			PackedVertex* packedVertices = (PackedVertex*)calloc(data.vertexCount, sizeof(PackedVertex));
+			// Vertices are independent, large meshes are packed in parallel
+			jobs->ParallelFor(data.vertexCount, packVertexGrainSize, [&](u32 begin, u32 end) {
+				PackVertices(data, begin, end, packedVertices);
+			});
+
+			const VkDeviceSize packedBytes = sizeof(PackedVertex) * data.vertexCount;
+			if (mesh.sharedGeometry) {
+				UploadToBuffer(packedVertices, packedBytes, sharedVertexBuffer.buffer, sizeof(PackedVertex) * mesh.baseVertex);
+			}
+			else {
+				AllocateBuffer(packedBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.packedVertexBuffer);
+				UploadToBuffer(packedVertices, packedBytes, mesh.packedVertexBuffer.buffer);
+			}
+
+			free(packedVertices);
 		}
+		else {
+			if (data.position != nullptr) {
+				const VkDeviceSize posBytes = sizeof(glm::vec3) * data.vertexCount;
+				AllocateBuffer(posBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.vertexPositionBuffer);
+				UploadToBuffer(data.position, posBytes, mesh.vertexPositionBuffer.buffer);
+			}
+
+			if (data.texcoord0 != nullptr) {
+				const VkDeviceSize uvBytes = sizeof(glm::vec2) * data.vertexCount;
+				AllocateBuffer(uvBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.vertexTexcoord0Buffer);
+				UploadToBuffer(data.texcoord0, uvBytes, mesh.vertexTexcoord0Buffer.buffer);
+			}
+
+			if (data.normal != nullptr) {
+				const VkDeviceSize normalBytes = sizeof(glm::vec3) * data.vertexCount;
+				AllocateBuffer(normalBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.vertexNormalBuffer);
+				UploadToBuffer(data.normal, normalBytes, mesh.vertexNormalBuffer.buffer);
+			}
+
+			if (data.tangent != nullptr) {
+				const VkDeviceSize tangentBytes = sizeof(glm::vec4) * data.vertexCount;
+				AllocateBuffer(tangentBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.vertexTangentBuffer);
+				UploadToBuffer(data.tangent, tangentBytes, mesh.vertexTangentBuffer.buffer);
+			}
 
-		if (data.tangent != nullptr) {
-			const VkDeviceSize tangentBytes = sizeof(glm::vec4) * data.vertexCount;
-			AllocateBuffer(tangentBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexTangentBuffer);
-			CopyRawDataToBuffer(data.tangent, mesh.vertexTangentBuffer.buffer, tangentBytes);
+			if (data.color != nullptr) {
+				const VkDeviceSize colorBytes = sizeof(Color) * data.vertexCount;
+				AllocateBuffer(colorBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.vertexColorBuffer);
+				UploadToBuffer(data.color, colorBytes, mesh.vertexColorBuffer.buffer);
+			}
 		}
 
-		if (data.color != nullptr) {
-			const VkDeviceSize colorBytes = sizeof(Color) * data.vertexCount;
-			AllocateBuffer(colorBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.vertexColorBuffer);
-			CopyRawDataToBuffer(data.color, mesh.vertexColorBuffer.buffer, colorBytes);
+		const VkDeviceSize indexBytes = indexSize * indexCount;
+		if (mesh.sharedGeometry) {
+			const Buffer& sharedIndexTarget = mesh.indexType == VK_INDEX_TYPE_UINT16 ? sharedIndexBuffer : sharedIndex32Buffer;
+			UploadToBuffer(indexData, indexBytes, sharedIndexTarget.buffer, indexSize * mesh.firstIndex);
+		}
+		else {
+			AllocateBuffer(indexBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, GPU_MEMORY_MESH, mesh.indexBuffer);
+			UploadToBuffer(indexData, indexBytes, mesh.indexBuffer.buffer);
 		}
 
-		const VkDeviceSize indexBytes = sizeof(Triangle) * data.triangleCount;
-		AllocateBuffer(indexBytes, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mesh.indexBuffer);
-		CopyRawDataToBuffer(data.triangles, mesh.indexBuffer.buffer, indexBytes);
+		free(indices32);
+		free(indices16);
 
 		mesh.vertexCount = data.vertexCount;
-		mesh.indexCount = data.triangleCount * 3;
+		mesh.indexCount = indexCount;
+		// Batches complete in order, so the batch holding the last copy covers the whole mesh
+		mesh.uploadValue = uploadSubmittedValue + 1;
 
 		return meshes.Add(mesh);
 	}
+	bool Vulkan::IsMeshReady(MeshHandle handle) {
+		return meshes[handle].uploadValue <= uploadCompletedValue;
+	}
 	void Vulkan::FreeMesh(MeshHandle handle) {
 		const MeshImpl& mesh = meshes[handle];
+		WaitForUploads(mesh.uploadValue);
+
+		if (mesh.sharedGeometry) {
+			sharedVertexRanges.Free(mesh.baseVertex, mesh.vertexCount);
+			if (mesh.indexType == VK_INDEX_TYPE_UINT16) {
+				sharedIndexRanges.Free(mesh.firstIndex, mesh.indexCount);
+			}
+			else {
+				sharedIndex32Ranges.Free(mesh.firstIndex, mesh.indexCount);
+			}
+		}
 
+		FreeBuffer(mesh.packedVertexBuffer);
 		FreeBuffer(mesh.vertexPositionBuffer);
 		FreeBuffer(mesh.vertexTexcoord0Buffer);
 		FreeBuffer(mesh.vertexNormalBuffer);
@@ -1809,24 +3258,98 @@ namespace Rendering {
 	}
 
 	ShaderHandle Vulkan::CreateShader(const ShaderCreateInfo& info) {
+		ShaderHandle handle = CreateShaderAsync(info);
+		CompilePendingShaders();
+		return handle;
+	}
+	ShaderHandle Vulkan::CreateShaderAsync(const ShaderCreateInfo& info) {
 		ShaderImpl shader{};
 
 		shader.layoutInfo.flags = (DescriptorSetLayoutFlags)(DSF_CAMERADATA | DSF_LIGHTINGDATA | DSF_INSTANCEDATA | DSF_SHADERDATA | DSF_SHADOWMAP | DSF_CUBEMAP);
 		shader.layoutInfo.samplerCount = info.samplerCount;
-		shader.layoutInfo.bindingCount = 6 + info.samplerCount;
+		shader.layoutInfo.bindingCount = 7 + info.samplerCount;
 		shader.vertexInputs = info.vertexInputs;
+		shader.vertexLayout = info.vertexLayout;
+		shader.pipeline = VK_NULL_HANDLE;
 
+		// Layouts are cheap, materials can be created before the pipeline is done
 		CreateDescriptorSetLayout(shader.descriptorSetLayout, shader.layoutInfo);
-		CreateShaderRenderPipeline(shader.pipelineLayout, shader.pipeline, shader.descriptorSetLayout, shader.vertexInputs, info.vert, info.frag);
 
-		return shaders.Add(shader);
+		VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+		pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineLayoutInfo.setLayoutCount = 1;
+		pipelineLayoutInfo.pSetLayouts = &shader.descriptorSetLayout;
+		vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &shader.pipelineLayout);
+
+		shader.vertHash = AcquireShaderModule(info.vert);
+		shader.fragHash = AcquireShaderModule(info.frag);
+
+		ShaderHandle handle = shaders.Add(shader);
+		if (handle < 0) {
+			DEBUG_LOG("Too many shaders");
+			ReleaseShaderModule(shader.vertHash);
+			ReleaseShaderModule(shader.fragHash);
+			vkDestroyPipelineLayout(device, shader.pipelineLayout, nullptr);
+			vkDestroyDescriptorSetLayout(device, shader.descriptorSetLayout, nullptr);
+			return -1;
+		}
+		pendingShaders.push_back(handle);
+		return handle;
+	}
+	bool Vulkan::IsShaderReady(ShaderHandle handle) {
+		return shaders[handle].pipeline != VK_NULL_HANDLE;
+	}
+	void Vulkan::CompilePendingShaders() {
+		if (pendingShaders.empty()) {
+			return;
+		}
+		PROFILE_ZONE("Vulkan::CompilePendingShaders");
+
+		// Drivers compile pipelines independently of each other, so one per job
+		struct PipelineJob {
+			VkPipelineLayout layout;
+			VertexAttribFlags vertexInputs;
+			VertexLayout vertexLayout;
+			VkShaderModule vertShader;
+			VkShaderModule fragShader;
+			VkPipeline pipeline;
+		};
+		std::vector<PipelineJob> pipelineJobs(pendingShaders.size());
+		for (u32 i = 0; i < pendingShaders.size(); i++) {
+			const ShaderImpl& shader = shaders[pendingShaders[i]];
+			pipelineJobs[i] = { shader.pipelineLayout, shader.vertexInputs, shader.vertexLayout, shaderModules[shader.vertHash].module, shaderModules[shader.fragHash].module, VK_NULL_HANDLE };
+		}
+
+		const auto compileStart = std::chrono::steady_clock::now();
+		jobs->ParallelFor((u32)pipelineJobs.size(), 1, [&](u32 begin, u32 end) {
+			for (u32 i = begin; i < end; i++) {
+				PROFILE_ZONE("Compile pipeline");
+				PipelineJob& job = pipelineJobs[i];
+				CreateShaderRenderPipeline(job.layout, job.pipeline, job.vertexInputs, job.vertexLayout, job.vertShader, job.fragShader);
+			}
+		});
+		pipelineCreateMilliseconds += std::chrono::duration<r64, std::milli>(std::chrono::steady_clock::now() - compileStart).count();
+
+		for (u32 i = 0; i < pendingShaders.size(); i++) {
+			shaders[pendingShaders[i]].pipeline = pipelineJobs[i].pipeline;
+		}
+		pendingShaders.clear();
 	}
 	void Vulkan::FreeShader(ShaderHandle handle) {
 		const ShaderImpl& shader = shaders[handle];
 
+		for (u32 i = 0; i < pendingShaders.size(); i++) {
+			if (pendingShaders[i] == handle) {
+				pendingShaders.erase(pendingShaders.begin() + i);
+				break;
+			}
+		}
+
 		vkDestroyPipelineLayout(device, shader.pipelineLayout, nullptr);
 		vkDestroyPipeline(device, shader.pipeline, nullptr);
 		vkDestroyDescriptorSetLayout(device, shader.descriptorSetLayout, nullptr);
+		ReleaseShaderModule(shader.vertHash);
+		ReleaseShaderModule(shader.fragHash);
 
 		shaders.Remove(handle);
 	}
@@ -1847,6 +3370,13 @@ namespace Rendering {
 			DEBUG_ERROR("Oh noes... (%d)", res);
 		}
 
+		// Bound textures may still be uploading
+		for (u32 i = 0; i < shader.layoutInfo.samplerCount; i++) {
+			if (textures.Contains(info.data.textures[i])) {
+				material.uploadValue = MAX(material.uploadValue, textures[info.data.textures[i]].uploadValue);
+			}
+		}
+
 		auto handle = materials.Add(material);
 
 		InitializeDescriptorSet(material.descriptorSet, shader.layoutInfo, handle, info.data.textures);
@@ -1863,18 +3393,35 @@ namespace Rendering {
 			return;
 		}
 		
-		void* temp;
-		vkMapMemory(device, shaderDataBuffer.memory, handle * maxShaderDataBlockSize + offset, size, 0, &temp);
-		memcpy(temp, data, size);
-		vkUnmapMemory(device, shaderDataBuffer.memory);
+		// Frames in flight may still read the old data, each frame's region is updated by BeginRenderCommands
+		const u32 slot = PoolHandleIndex(handle);
+		memcpy(materialShadowData + slot * maxShaderDataBlockSize + offset, data, size);
+		if (materialDirtyFrames[slot] == 0) {
+			dirtyMaterialSlots.push_back(slot);
+		}
+		materialDirtyFrames[slot] = COMMAND_BUFFER_COUNT;
+	}
+	void Vulkan::UploadMaterialData() {
+		PROFILE_ZONE("Vulkan::UploadMaterialData");
+		u8* frameData = (u8*)shaderDataBuffer.allocation.mapped + shaderDataFrameSize * currentCbIndex;
+		frameStats.uniformBytesWritten += (u64)maxShaderDataBlockSize * dirtyMaterialSlots.size();
+		u32 stillDirtyCount = 0;
+		for (u32 slot : dirtyMaterialSlots) {
+			memcpy(frameData + slot * maxShaderDataBlockSize, materialShadowData + slot * maxShaderDataBlockSize, maxShaderDataBlockSize);
+			if (--materialDirtyFrames[slot] > 0) {
+				dirtyMaterialSlots[stillDirtyCount++] = slot;
+			}
+		}
+		dirtyMaterialSlots.resize(stillDirtyCount);
 	}
 	void Vulkan::UpdateMaterialTexture(MaterialHandle handle, u32 index, TextureHandle texHandle) {
 		if (index >= maxSamplerCount) {
 			DEBUG_ERROR("Invalid sampler index %d", index);
 		}
 
-		const MaterialImpl& material = materials[handle];
+		MaterialImpl& material = materials[handle];
 		const TextureImpl& texture = textures[texHandle];
+		material.uploadValue = MAX(material.uploadValue, texture.uploadValue);
 
 		VkDescriptorImageInfo imageInfo{};
 		imageInfo.sampler = texture.sampler;
@@ -1895,39 +3442,86 @@ namespace Rendering {
 		return extent.width / (r32)extent.height;
 	}
 
-	void Vulkan::SetInstanceData(PerInstanceData* instances, u32 length) {
-		for (u32 i = 0; i < length; i++) {
-			void* data;
-			vkMapMemory(device, perInstanceBuffer.memory, i * 256, sizeof(PerInstanceData), 0, &data);
-			memcpy(data, &instances[i], sizeof(PerInstanceData));
-			vkUnmapMemory(device, perInstanceBuffer.memory);
+	// Has to be called after BeginRenderCommands, so that the GPU is done reading this frame's region
+	void Vulkan::SetInstanceData(const PerInstanceData* instances, u32 length) {
+		PROFILE_ZONE("Vulkan::SetInstanceData");
+		if (length > maxInstanceCount) {
+			DEBUG_ERROR("Too many instances (%d)", length);
+		}
+
+		PerInstanceData* frameData = (PerInstanceData*)((u8*)perInstanceBuffer.allocation.mapped + perInstanceFrameSize * currentCbIndex);
+		memcpy(frameData + immediateInstanceOffset, instances, sizeof(PerInstanceData) * length);
+		frameStats.instanceBytesWritten += sizeof(PerInstanceData) * length;
+	}
+	PerInstanceData* Vulkan::GetInstanceDataRange(u32 offset, u32 count) {
+		if (offset + count > maxInstanceCount) {
+			DEBUG_ERROR("Too many instances (%d)", offset + count);
+		}
+
+		// Counted as written, the caller fills the whole range
+		frameStats.instanceBytesWritten += sizeof(PerInstanceData) * count;
+		PerInstanceData* frameData = (PerInstanceData*)((u8*)perInstanceBuffer.allocation.mapped + perInstanceFrameSize * currentCbIndex);
+		return frameData + immediateInstanceOffset + offset;
+	}
+	void Vulkan::SetObjectInstanceData(const u32* slots, const PerInstanceData* instances, u32 count) {
+		PROFILE_ZONE("Vulkan::SetObjectInstanceData");
+		PerInstanceData* frameData = (PerInstanceData*)((u8*)perInstanceBuffer.allocation.mapped + perInstanceFrameSize * currentCbIndex);
+		for (u32 i = 0; i < count; i++) {
+			if (slots[i] >= immediateInstanceOffset) {
+				DEBUG_ERROR("Invalid object instance slot (%d)", slots[i]);
+			}
+			frameData[slots[i]] = instances[i];
 		}
+		frameStats.instanceBytesWritten += sizeof(PerInstanceData) * count;
+	}
+	void Vulkan::SetInstanceIndices(const u32* indices, u32 offset, u32 count) {
+		PROFILE_ZONE("Vulkan::SetInstanceIndices");
+		if (offset + count > maxInstanceSlotCount) {
+			DEBUG_ERROR("Too many instances (%d)", offset + count);
+		}
+
+		u32* frameIndices = (u32*)((u8*)instanceIndexBuffer.allocation.mapped + instanceIndexFrameSize * currentCbIndex);
+		memcpy(frameIndices + offset, indices, sizeof(u32) * count);
+		frameStats.instanceBytesWritten += sizeof(u32) * count;
+	}
+	u32 Vulkan::GetFrameSlot() const {
+		return currentCbIndex;
 	}
 	void Vulkan::SetCameraData(CameraData cameraData) {
-		void* data;
-		vkMapMemory(device, cameraDataBuffer.memory, 0, sizeof(CameraData), 0, &data);
-		memcpy(data, &cameraData, sizeof(CameraData));
-		vkUnmapMemory(device, cameraDataBuffer.memory);
+		memcpy((u8*)cameraDataBuffer.allocation.mapped + cameraDataFrameSize * currentCbIndex, &cameraData, sizeof(CameraData));
+		frameStats.uniformBytesWritten += sizeof(CameraData);
 	}
 	void Vulkan::SetLightingData(LightingData lightingData) {
-		void* data;
-		vkMapMemory(device, lightingDataBuffer.memory, 0, sizeof(LightingData), 0, &data);
-		memcpy(data, &lightingData, sizeof(LightingData));
-		vkUnmapMemory(device, lightingDataBuffer.memory);
+		memcpy((u8*)lightingDataBuffer.allocation.mapped + lightingDataFrameSize * currentCbIndex, &lightingData, sizeof(LightingData));
+		frameStats.uniformBytesWritten += sizeof(LightingData);
 	}
 
 	void Vulkan::BeginRenderCommands() {
+		PROFILE_ZONE("Vulkan::BeginRenderCommands");
 		CommandBuffer& cmd = primaryCommandBuffers[currentCbIndex];
 		// Wait for drawing to finish if it hasn't
-		vkWaitForFences(device, 1, &cmd.cmdFence, VK_TRUE, UINT64_MAX);
+		{
+			PROFILE_ZONE("Wait for frame fence");
+			vkWaitForFences(device, 1, &cmd.cmdFence, VK_TRUE, UINT64_MAX);
+		}
+		RetireUploads();
+		ResolveGpuZones(currentCbIndex);
+		frameStats = {};
 
-		// Get next swapchain image index
-		VkResult err = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, cmd.imageAcquiredSemaphore, VK_NULL_HANDLE, &currentSwapchainImageIndex);
-		if (err != VK_SUCCESS) {
+		// Get next swapchain image index, the offscreen target only has the one
+		if (!headless) {
+			VkResult err = vkAcquireNextImageKHR(device, swapchain, UINT64_MAX, cmd.imageAcquiredSemaphore, VK_NULL_HANDLE, &currentSwapchainImageIndex);
+			if (err != VK_SUCCESS) {
+			}
 		}
 
+		UploadMaterialData();
+
 		vkResetFences(device, 1, &cmd.cmdFence);
 		vkResetCommandBuffer(cmd.cmdBuffer, 0);
+		for (u32 i = 0; i < recordThreadCount; i++) {
+			vkResetCommandPool(device, recordContexts[currentCbIndex][i].pool, 0);
+		}
 
 		VkCommandBufferBeginInfo beginInfo{};
 		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -1938,6 +3532,13 @@ namespace Rendering {
 			DEBUG_ERROR("failed to begin recording command buffer!");
 		}
 
+		if (gpuZonePool != VK_NULL_HANDLE) {
+			vkCmdResetQueryPool(cmd.cmdBuffer, gpuZonePool, currentCbIndex * maxGpuZonesPerFrame * 2, maxGpuZonesPerFrame * 2);
+		}
+		gpuZoneCounts[currentCbIndex] = 0;
+		gpuZoneFrames[currentCbIndex] = gpuFrameNumber++;
+		BeginGpuZone("Frame");
+
 		// Should be ready to draw now!
 	}
 	// This could be just generic...
@@ -1957,8 +3558,31 @@ namespace Rendering {
 		renderPassInfo.clearValueCount = 2;
 		renderPassInfo.pClearValues = clearColors;
 
-		vkCmdBeginRenderPass(cmd.cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		// Timestamps can't be written inside a pass recorded into secondaries, so the zone includes the MSAA resolve at its end
+		BeginGpuZone("Forward pass");
+		vkCmdBeginRenderPass(cmd.cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		passSecondaryCount = 0;
+		passDrawsRecorded = false;
+	}
+	void Vulkan::BeginSecondaryCommands(VkCommandBuffer cmdBuffer) {
+		VkExtent2D extent = surfaceCapabilities.currentExtent;
 
+		VkCommandBufferInheritanceInfo inheritanceInfo{};
+		inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+		inheritanceInfo.renderPass = forwardRenderPass;
+		inheritanceInfo.subpass = 0;
+		inheritanceInfo.framebuffer = primaryFramebuffer;
+
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+		if (vkBeginCommandBuffer(cmdBuffer, &beginInfo) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to begin recording secondary command buffer!");
+		}
+
+		// Dynamic state isn't inherited from the primary command buffer
 		VkViewport viewport{};
 		viewport.x = 0.0f;
 		viewport.y = 0.0f;
@@ -1966,43 +3590,299 @@ namespace Rendering {
 		viewport.height = (float)(extent.height);
 		viewport.minDepth = 0.0f;
 		viewport.maxDepth = 1.0f;
-		vkCmdSetViewport(cmd.cmdBuffer, 0, 1, &viewport);
+		vkCmdSetViewport(cmdBuffer, 0, 1, &viewport);
 
 		VkRect2D scissor{};
 		scissor.offset = { 0, 0 };
 		scissor.extent = extent;
-		vkCmdSetScissor(cmd.cmdBuffer, 0, 1, &scissor);
+		vkCmdSetScissor(cmdBuffer, 0, 1, &scissor);
+	}
+	void Vulkan::BindDrawPipeline(VkCommandBuffer cmdBuffer, BoundDrawState& state, const ShaderImpl& shader, const MaterialImpl& material, FrameStats& outStats) const {
+		if (state.pipeline != shader.pipeline) {
+			vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader.pipeline);
+			state.pipeline = shader.pipeline;
+			outStats.pipelineBinds++;
+		}
+		// The dynamic offsets only select this frame's regions, so they're the same for every bind in the command buffer
+		if (state.descriptorSet != material.descriptorSet) {
+			vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader.pipelineLayout, 0, 1, &material.descriptorSet, frameDynamicOffsetCount, frameDynamicOffsets[currentCbIndex]);
+			state.descriptorSet = material.descriptorSet;
+			outStats.descriptorSetBinds++;
+		}
+	}
+	void Vulkan::BindDrawVertexBuffers(VkCommandBuffer cmdBuffer, BoundDrawState& state, const VkBuffer* buffers, u32 bindingMask, FrameStats& outStats) const {
+		s32 first = -1;
+		s32 last = -1;
+		for (u32 i = 0; i < vertexBindingCount; i++) {
+			if ((bindingMask & (1 << i)) && state.vertexBuffers[i] != buffers[i]) {
+				first = first < 0 ? i : first;
+				last = i;
+			}
+		}
+		if (first < 0) {
+			return;
+		}
+
+		// Unused bindings between changed ones keep their buffer, or get any valid one if nothing was bound there yet
+		VkBuffer bindBuffers[vertexBindingCount];
+		const VkDeviceSize offsets[vertexBindingCount] = {};
+		for (s32 i = first; i <= last; i++) {
+			if (bindingMask & (1 << i)) {
+				bindBuffers[i] = buffers[i];
+			}
+			else {
+				bindBuffers[i] = state.vertexBuffers[i] != VK_NULL_HANDLE ? state.vertexBuffers[i] : buffers[first];
+			}
+			state.vertexBuffers[i] = bindBuffers[i];
+		}
+
+		vkCmdBindVertexBuffers(cmdBuffer, first, last - first + 1, bindBuffers + first, offsets);
+		outStats.vertexBufferBinds++;
+	}
+	void Vulkan::BindDrawIndexBuffer(VkCommandBuffer cmdBuffer, BoundDrawState& state, VkBuffer buffer, VkIndexType indexType, FrameStats& outStats) const {
+		if (state.indexBuffer == buffer && state.indexType == indexType) {
+			return;
+		}
+
+		vkCmdBindIndexBuffer(cmdBuffer, buffer, 0, indexType);
+		state.indexBuffer = buffer;
+		state.indexType = indexType;
+		outStats.indexBufferBinds++;
+	}
+	void Vulkan::DrawMeshes(const MeshDraw* draws, u32 drawCount) {
+		PROFILE_ZONE("Vulkan::DrawMeshes");
+		if (passDrawsRecorded) {
+			DEBUG_ERROR("Draws were already recorded for this pass");
+		}
+		passDrawsRecorded = true;
+		if (drawCount == 0) {
+			return;
+		}
+
+		const u32 taskCount = MIN(recordThreadCount, (drawCount + minDrawsPerRecordTask - 1) / minDrawsPerRecordTask);
+		RecordContext* contexts = recordContexts[currentCbIndex];
+		u64 uploadWaitValues[maxRecordThreadCount] = {};
+		FrameStats taskStats[maxRecordThreadCount] = {};
+
+		auto recordTask = [&](u32 task) {
+			const u32 first = (u32)((u64)drawCount * task / taskCount);
+			const u32 last = (u32)((u64)drawCount * (task + 1) / taskCount);
+			VkCommandBuffer cmdBuffer = contexts[task].cmdBuffer;
+			BeginSecondaryCommands(cmdBuffer);
+			RecordDraws(cmdBuffer, draws + first, last - first, uploadWaitValues[task], taskStats[task]);
+			if (vkEndCommandBuffer(cmdBuffer) != VK_SUCCESS) {
+				DEBUG_ERROR("failed to record secondary command buffer!");
+			}
+		};
+
+		// One task per range, each task has its own pool
+		jobs->ParallelFor(taskCount, 1, [&](u32 begin, u32 end) {
+			for (u32 task = begin; task < end; task++) {
+				recordTask(task);
+			}
+		});
+
+		for (u32 i = 0; i < taskCount; i++) {
+			passSecondaryBuffers[passSecondaryCount++] = contexts[i].cmdBuffer;
+			frameUploadWaitValue = MAX(frameUploadWaitValue, uploadWaitValues[i]);
+			frameStats.drawcalls += taskStats[i].drawcalls;
+			frameStats.pipelineBinds += taskStats[i].pipelineBinds;
+			frameStats.descriptorSetBinds += taskStats[i].descriptorSetBinds;
+			frameStats.vertexBufferBinds += taskStats[i].vertexBufferBinds;
+			frameStats.indexBufferBinds += taskStats[i].indexBufferBinds;
+		}
+	}
+	void Vulkan::RecordDraws(VkCommandBuffer cmdBuffer, const MeshDraw* draws, u32 drawCount, u64& outUploadWaitValue, FrameStats& outStats) {
+		PROFILE_ZONE("Vulkan::RecordDraws");
+		// The dynamic offsets only select this frame's regions, instance indices are read with gl_InstanceIndex
+		BoundDrawState state;
+
+		for (u32 i = 0; i < drawCount; i++) {
+			const MeshDraw& draw = draws[i];
+			const ShaderImpl& shader = shaders[draw.shader];
+			const MaterialImpl& material = materials[draw.material];
+			const MeshImpl& mesh = meshes[draw.mesh];
+
+			if (mesh.vertexLayout != shader.vertexLayout) {
+				DEBUG_ERROR("Mesh vertex layout (%d) doesn't match the shader (%d)", mesh.vertexLayout, shader.vertexLayout);
+			}
+
+			// Draws arrive sorted by pipeline, material and mesh, so most of these are skipped
+			BindDrawPipeline(cmdBuffer, state, shader, material, outStats);
+
+			VkBuffer vertexBuffers[vertexBindingCount] = {};
+			u32 bindingMask = 1;
+			if (mesh.sharedGeometry) {
+				vertexBuffers[0] = sharedVertexBuffer.buffer;
+				const Buffer& sharedIndexTarget = mesh.indexType == VK_INDEX_TYPE_UINT16 ? sharedIndexBuffer : sharedIndex32Buffer;
+				BindDrawIndexBuffer(cmdBuffer, state, sharedIndexTarget.buffer, mesh.indexType, outStats);
+			}
+			else {
+				if (shader.vertexLayout == VERTEX_LAYOUT_PACKED) {
+					vertexBuffers[0] = mesh.packedVertexBuffer.buffer;
+				}
+				else {
+					vertexBuffers[0] = mesh.vertexPositionBuffer.buffer;
+					vertexBuffers[1] = mesh.vertexTexcoord0Buffer.buffer;
+					vertexBuffers[2] = mesh.vertexNormalBuffer.buffer;
+					vertexBuffers[3] = mesh.vertexTangentBuffer.buffer;
+					vertexBuffers[4] = mesh.vertexColorBuffer.buffer;
+					bindingMask = ((shader.vertexInputs & VERTEX_POSITION_BIT) ? 1 << 0 : 0) |
+						((shader.vertexInputs & VERTEX_TEXCOORD_0_BIT) ? 1 << 1 : 0) |
+						((shader.vertexInputs & VERTEX_NORMAL_BIT) ? 1 << 2 : 0) |
+						((shader.vertexInputs & VERTEX_TANGENT_BIT) ? 1 << 3 : 0) |
+						((shader.vertexInputs & VERTEX_COLOR_BIT) ? 1 << 4 : 0);
+				}
+				BindDrawIndexBuffer(cmdBuffer, state, mesh.indexBuffer.buffer, mesh.indexType, outStats);
+			}
+			BindDrawVertexBuffers(cmdBuffer, state, vertexBuffers, bindingMask, outStats);
+
+			vkCmdDrawIndexed(cmdBuffer, mesh.indexCount, draw.instanceCount, mesh.firstIndex, mesh.baseVertex, draw.instanceOffset);
+			outStats.drawcalls++;
+
+			outUploadWaitValue = MAX(outUploadWaitValue, MAX(mesh.uploadValue, material.uploadValue));
+		}
+	}
+	bool Vulkan::SupportsIndirectDraws() const {
+		return indirectDrawSupported;
+	}
+	bool Vulkan::CanDrawIndirect(MeshHandle handle) {
+		// Commands can only pick a range of the index buffer, so the mesh has to be in the shared buffers
+		return indirectDrawSupported && meshes[handle].sharedGeometry;
+	}
+	void Vulkan::SetIndirectDrawData(const IndirectDraw* draws, u32 drawCount, const IndirectObject* objects, u32 objectCount, u32 firstInstance) {
+		if (firstInstance + objectCount > maxInstanceSlotCount) {
+			DEBUG_ERROR("Too many instances (%d)", firstInstance + objectCount);
+		}
+
+		indirectDrawCount = drawCount;
+		indirectObjectCount = objectCount;
+		indirectGroupCount = 0;
+		if (objectCount == 0) {
+			return;
+		}
+
+		u8* objectData = (u8*)indirectObjectBuffer.allocation.mapped + indirectObjectFrameSize * currentCbIndex;
+		memcpy(objectData, objects, sizeof(IndirectObject) * objectCount);
+
+		// Group draws by material and index type, each group gets as many command slots as it has draws
+		memset(indirectGroupLookup, 0xFF, sizeof(indirectGroupLookup));
+		IndirectDrawInfo* drawData = (IndirectDrawInfo*)((u8*)indirectDrawBuffer.allocation.mapped + indirectDrawFrameSize * currentCbIndex);
+		for (u32 i = 0; i < drawCount; i++) {
+			const IndirectDraw& draw = draws[i];
+			const MeshImpl& mesh = meshes[draw.mesh];
+			const u32 lookupIndex = PoolHandleIndex(draw.material) * 2 + (mesh.indexType == VK_INDEX_TYPE_UINT32 ? 1 : 0);
+			if (indirectGroupLookup[lookupIndex] < 0) {
+				indirectGroupLookup[lookupIndex] = indirectGroupCount;
+				indirectGroups[indirectGroupCount++] = { draw.shader, draw.material, mesh.indexType, 0, 0 };
+			}
+
+			drawData[i].group = indirectGroupLookup[lookupIndex];
+			indirectGroups[drawData[i].group].commandCount++;
+		}
+
+		u32 firstCommand = 0;
+		for (u32 i = 0; i < indirectGroupCount; i++) {
+			indirectGroups[i].firstCommand = firstCommand;
+			firstCommand += indirectGroups[i].commandCount;
+		}
+
+		// Each draw gets an instance range as large as the number of objects referencing it
+		u32 instance = firstInstance;
+		for (u32 i = 0; i < drawCount; i++) {
+			const MeshImpl& mesh = meshes[draws[i].mesh];
+			IndirectDrawInfo& info = drawData[i];
+			info.indexCount = mesh.indexCount;
+			info.firstIndex = mesh.firstIndex;
+			info.vertexOffset = (s32)mesh.baseVertex;
+			info.firstInstance = instance;
+			info.instanceCount = 0;
+			info.firstCommand = indirectGroups[info.group].firstCommand;
+			instance += draws[i].maxInstanceCount;
+		}
+
+		u8* countData = (u8*)indirectCountBuffer.allocation.mapped + indirectCountFrameSize * currentCbIndex;
+		memset(countData, 0, sizeof(u32) * indirectGroupCount);
+		frameStats.instanceBytesWritten += sizeof(IndirectObject) * objectCount + sizeof(IndirectDrawInfo) * drawCount + sizeof(u32) * indirectGroupCount;
 	}
-	void Vulkan::DrawMesh(MeshHandle meshHandle, ShaderHandle shaderHandle, MaterialHandle matHandle, u16 instanceOffset, u16 instanceCount) {
+	void Vulkan::BuildIndirectDraws() {
+		if (indirectObjectCount == 0) {
+			return;
+		}
+
 		CommandBuffer& cmd = primaryCommandBuffers[currentCbIndex];
-		const ShaderImpl& shader = shaders[shaderHandle];
-		const MaterialImpl& material = materials[matHandle];
-		const MeshImpl& mesh = meshes[meshHandle];
+		BeginGpuZone("Build indirect draws");
+		vkCmdBindPipeline(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, indirectPipeline);
+		vkCmdBindDescriptorSets(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, indirectPipelineLayout, 0, 1, &indirectDescriptorSets[currentCbIndex], 0, nullptr);
+
+		// First pass scatters objects into their draws' instance ranges, the second emits the commands
+		const u32 groupSize = 64;
+		u32 pushConstants[3] = { indirectObjectCount, indirectDrawCount, 0 };
+		vkCmdPushConstants(cmd.cmdBuffer, indirectPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), pushConstants);
+		vkCmdDispatch(cmd.cmdBuffer, (indirectObjectCount + groupSize - 1) / groupSize, 1, 1);
+
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+
+		pushConstants[2] = 1;
+		vkCmdPushConstants(cmd.cmdBuffer, indirectPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), pushConstants);
+		vkCmdDispatch(cmd.cmdBuffer, (indirectDrawCount + groupSize - 1) / groupSize, 1, 1);
+
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+		vkCmdPipelineBarrier(cmd.cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+		EndGpuZone();
+	}
+	void Vulkan::DrawIndirect() {
+		if (indirectObjectCount == 0) {
+			return;
+		}
+
+		VkCommandBuffer cmdBuffer = indirectSecondaryBuffers[currentCbIndex];
+		BeginSecondaryCommands(cmdBuffer);
+
+		const VkDeviceSize commandOffset = indirectCommandFrameSize * currentCbIndex;
+		const VkDeviceSize countOffset = indirectCountFrameSize * currentCbIndex;
+		BoundDrawState state;
 
-		vkCmdBindPipeline(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader.pipeline);
+		for (u32 i = 0; i < indirectGroupCount; i++) {
+			const IndirectGroup& group = indirectGroups[i];
+			const ShaderImpl& shader = shaders[group.shader];
+			const MaterialImpl& material = materials[group.material];
 
-		u32 dynamicOffset = perInstanceDynamicOffset * instanceOffset;
-		vkCmdBindDescriptorSets(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, shader.pipelineLayout, 0, 1, &material.descriptorSet, 1, &dynamicOffset);
+			if (shader.vertexLayout != VERTEX_LAYOUT_PACKED) {
+				DEBUG_ERROR("Indirect draws need a shader with the packed vertex layout");
+			}
+
+			BindDrawPipeline(cmdBuffer, state, shader, material, frameStats);
+			BindDrawVertexBuffers(cmdBuffer, state, &sharedVertexBuffer.buffer, 1, frameStats);
+			const Buffer& sharedIndexTarget = group.indexType == VK_INDEX_TYPE_UINT16 ? sharedIndexBuffer : sharedIndex32Buffer;
+			BindDrawIndexBuffer(cmdBuffer, state, sharedIndexTarget.buffer, group.indexType, frameStats);
 
-		VkDeviceSize offset = 0;
-		if (shader.vertexInputs & VERTEX_POSITION_BIT)
-			vkCmdBindVertexBuffers(cmd.cmdBuffer, 0, 1, &mesh.vertexPositionBuffer.buffer, &offset);
-		if (shader.vertexInputs & VERTEX_TEXCOORD_0_BIT)
-			vkCmdBindVertexBuffers(cmd.cmdBuffer, 1, 1, &mesh.vertexTexcoord0Buffer.buffer, &offset);
-		if (shader.vertexInputs & VERTEX_NORMAL_BIT)
-			vkCmdBindVertexBuffers(cmd.cmdBuffer, 2, 1, &mesh.vertexNormalBuffer.buffer, &offset);
-		if (shader.vertexInputs & VERTEX_TANGENT_BIT)
-			vkCmdBindVertexBuffers(cmd.cmdBuffer, 3, 1, &mesh.vertexTangentBuffer.buffer, &offset);
-		if (shader.vertexInputs & VERTEX_COLOR_BIT)
-			vkCmdBindVertexBuffers(cmd.cmdBuffer, 4, 1, &mesh.vertexColorBuffer.buffer, &offset);
+			vkCmdDrawIndexedIndirectCount(cmdBuffer,
+				indirectCommandBuffer.buffer, commandOffset + sizeof(VkDrawIndexedIndirectCommand) * group.firstCommand,
+				indirectCountBuffer.buffer, countOffset + sizeof(u32) * i,
+				group.commandCount, sizeof(VkDrawIndexedIndirectCommand));
+			frameStats.indirectDrawcalls++;
 
-		vkCmdBindIndexBuffer(cmd.cmdBuffer, mesh.indexBuffer.buffer, 0, VK_INDEX_TYPE_UINT16);
+			frameUploadWaitValue = MAX(frameUploadWaitValue, material.uploadValue);
+		}
 
-		vkCmdDrawIndexed(cmd.cmdBuffer, mesh.indexCount, instanceCount, 0, 0, 0);
+		if (vkEndCommandBuffer(cmdBuffer) != VK_SUCCESS) {
+			DEBUG_ERROR("failed to record secondary command buffer!");
+		}
+		passSecondaryBuffers[passSecondaryCount++] = cmdBuffer;
 	}
 	void Vulkan::EndRenderPass() {
 		CommandBuffer& cmd = primaryCommandBuffers[currentCbIndex];
+		if (passSecondaryCount > 0) {
+			vkCmdExecuteCommands(cmd.cmdBuffer, passSecondaryCount, passSecondaryBuffers);
+		}
 		vkCmdEndRenderPass(cmd.cmdBuffer);
+		EndGpuZone(); // Begun with the pass
 	}
 	void Vulkan::DoFinalBlit() {
 		CommandBuffer& cmd = primaryCommandBuffers[currentCbIndex];
@@ -2021,49 +3901,75 @@ namespace Rendering {
 		renderPassInfo.clearValueCount = 1;
 		renderPassInfo.pClearValues = &clearColor;
 
+		BeginGpuZone("Final blit");
 		vkCmdBeginRenderPass(cmd.cmdBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
 
 		vkCmdBindPipeline(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, blitPipeline);
-		vkCmdBindDescriptorSets(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, blitPipelineLayout, 0, 1, &blitDescriptorSet, 0, nullptr);
+		vkCmdBindDescriptorSets(cmd.cmdBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, blitPipelineLayout, 0, 1, &blitDescriptorSet, 1, &frameDynamicOffsets[currentCbIndex][0]);
 		vkCmdDraw(cmd.cmdBuffer, 4, 1, 0, 0);
 
 		vkCmdEndRenderPass(cmd.cmdBuffer);
+		EndGpuZone();
 	}
 	void Vulkan::EndRenderCommands() {
+		PROFILE_ZONE("Vulkan::EndRenderCommands");
 		CommandBuffer& cmd = primaryCommandBuffers[currentCbIndex];
 
+		EndGpuZone(); // Frame
+
 		if (vkEndCommandBuffer(cmd.cmdBuffer) != VK_SUCCESS) {
 			DEBUG_ERROR("failed to record command buffer!");
 		}
 
+		// Uploads recorded during the frame have to be submitted before it
+		FlushUploads();
+
 		// Submit the above commands
+		// The frame waits on the upload timelines only if it draws something that was uploaded
+		// Headless frames have no acquire to wait on and nothing to present, so only the upload timelines are waited on
+		const u32 firstWait = headless ? 1 : 0;
+		VkSemaphore waitSemaphores[] = { cmd.imageAcquiredSemaphore, uploadTransferTimeline, uploadGraphicsTimeline };
+		VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT };
+		u64 waitValues[] = { 0, frameUploadWaitValue, frameUploadWaitValue };
+		const u32 waitSemaphoreCount = (frameUploadWaitValue > 0 ? 3 : 1) - firstWait;
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineInfo.waitSemaphoreValueCount = waitSemaphoreCount;
+		timelineInfo.pWaitSemaphoreValues = waitValues + firstWait;
+
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-		VkSemaphore waitSemaphores[] = { cmd.imageAcquiredSemaphore };
-		VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = waitSemaphores;
-		submitInfo.pWaitDstStageMask = waitStages;
+		submitInfo.pNext = &timelineInfo;
+		submitInfo.waitSemaphoreCount = waitSemaphoreCount;
+		submitInfo.pWaitSemaphores = waitSemaphores + firstWait;
+		submitInfo.pWaitDstStageMask = waitStages + firstWait;
 		submitInfo.commandBufferCount = 1;
 		submitInfo.pCommandBuffers = &cmd.cmdBuffer;
 		VkSemaphore signalSemaphores[] = { cmd.drawCompleteSemaphore };
-		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.signalSemaphoreCount = headless ? 0 : 1;
 		submitInfo.pSignalSemaphores = signalSemaphores;
 
 		VkResult err = vkQueueSubmit(primaryQueue, 1, &submitInfo, cmd.cmdFence);
+		if (err != VK_SUCCESS) {
+			DEBUG_ERROR("Failed to submit frame (%d)", err);
+		}
+		frameUploadWaitValue = 0;
 
 		// Present to swapchain
-		VkPresentInfoKHR presentInfo{};
-		presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-		presentInfo.waitSemaphoreCount = 1;
-		presentInfo.pWaitSemaphores = signalSemaphores;
-		VkSwapchainKHR swapchains[] = { swapchain };
-		presentInfo.swapchainCount = 1;
-		presentInfo.pSwapchains = swapchains;
-		presentInfo.pImageIndices = &currentSwapchainImageIndex;
-		presentInfo.pResults = nullptr; // Optional
-
-		vkQueuePresentKHR(primaryQueue, &presentInfo);
+		if (!headless) {
+			VkPresentInfoKHR presentInfo{};
+			presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+			presentInfo.waitSemaphoreCount = 1;
+			presentInfo.pWaitSemaphores = signalSemaphores;
+			VkSwapchainKHR swapchains[] = { swapchain };
+			presentInfo.swapchainCount = 1;
+			presentInfo.pSwapchains = swapchains;
+			presentInfo.pImageIndices = &currentSwapchainImageIndex;
+			presentInfo.pResults = nullptr; // Optional
+
+			vkQueuePresentKHR(primaryQueue, &presentInfo);
+		}
 
 		// Advance cb index
 		currentCbIndex = (currentCbIndex + 1) % COMMAND_BUFFER_COUNT;
@@ -1,28 +1,55 @@
 #pragma once
+#ifdef _WIN32
 #include <windows.h>
-#include <vector>
 #define VK_USE_PLATFORM_WIN32_KHR
+#endif
+#include <vector>
+#include <string>
+#include <unordered_map>
 #include <vulkan/vulkan.h>
 #include "rendering.h"
 #include "material.h"
 #include "memory_pool.h"
+#include "range_allocator.h"
+#include "job_system.h"
 
+// Frames the CPU can record ahead of the GPU. Every buffer the CPU writes per frame has one region per command buffer.
+#ifndef COMMAND_BUFFER_COUNT
 #define COMMAND_BUFFER_COUNT 2
+#endif
+static_assert(COMMAND_BUFFER_COUNT >= 2 && COMMAND_BUFFER_COUNT <= 4, "Between two and four frames in flight are supported");
 #define SWAPCHAIN_MIN_IMAGE_COUNT 3
 
 namespace Rendering {
 	class Vulkan {
 	public:
-		Vulkan(HINSTANCE hInst, HWND hWindow);
+		// Draws are recorded on the job system's threads
+#ifdef _WIN32
+		Vulkan(HINSTANCE hInst, HWND hWindow, JobSystem& jobs);
+#endif
+		// Renders into an offscreen image of the given size instead of a swapchain, needs no window system at all
+		Vulkan(u32 width, u32 height, JobSystem& jobs);
 		~Vulkan();
 
 		void RecreateSwapchain();
 		void WaitForAllCommands();
+		// The async variants return as soon as the data is copied to staging memory.
+		// The GPU copy goes out with the next flush, at the latest when the frame is submitted.
 		TextureHandle CreateTexture(const TextureCreateInfo& info);
+		TextureHandle CreateTextureAsync(const TextureCreateInfo& info);
+		bool IsTextureReady(TextureHandle handle);
 		void FreeTexture(TextureHandle handle);
 		MeshHandle CreateMesh(const MeshCreateInfo& info);
+		MeshHandle CreateMeshAsync(const MeshCreateInfo& info);
+		bool IsMeshReady(MeshHandle handle);
 		void FreeMesh(MeshHandle handle);
+		void FlushUploads();
+		// Pipelines of async shaders are compiled in one parallel batch by CompilePendingShaders, the synchronous version compiles right away.
+		// Shader modules are shared between shaders with the same SPIR-V.
 		ShaderHandle CreateShader(const ShaderCreateInfo& info);
+		ShaderHandle CreateShaderAsync(const ShaderCreateInfo& info);
+		bool IsShaderReady(ShaderHandle handle);
+		void CompilePendingShaders();
 		void FreeShader(ShaderHandle handle);
 		MaterialHandle CreateMaterial(const MaterialCreateInfo& info);
 		void UpdateMaterialData(MaterialHandle handle, void* data, u32 offset, u32 size);
@@ -30,31 +57,111 @@ namespace Rendering {
 		void FreeMaterial(MaterialHandle handle);
 
 		r32 GetSurfaceAspect() const;
-
-		void SetInstanceData(PerInstanceData* instances, u32 length);
+		GpuMemoryStats GetMemoryStats() const;
+		// Commands and bytes written since the last BeginRenderCommands, and the memory allocated right now.
+		// The instance counts are left for the renderer to fill in.
+		FrameStats GetFrameStats() const;
+		bool IsHeadless() const;
+		// Waits for the GPU and copies the last rendered frame out as tightly packed BGRA8 rows, width * height * 4 bytes.
+		// Headless only, and only after at least one frame.
+		void ReadbackFrame(u8* outPixels);
+		// Waits for the GPU and appends the arguments of the last frame's draws: the given draws as DrawMeshes recorded them,
+		// which have to be the ones it was passed, then the commands the compute shader built for each indirect group.
+		// Lets tests compare the GPU-driven path with the CPU one.
+		void ReadbackDrawCommands(const MeshDraw* draws, u32 drawCount, std::vector<VkDrawIndexedIndirectCommand>& outCommands);
+		// GPU time of the most recent frame whose command buffer has finished, COMMAND_BUFFER_COUNT frames behind.
+		// Negative until then, or if the queue doesn't support timestamps.
+		r64 GetGpuFrameMilliseconds() const;
+		// Named, nestable GPU timings on the primary command buffer, between BeginRenderCommands and EndRenderCommands.
+		// Every pass opens one, the frame itself is the outermost. Names have to stay valid, they're meant to be string literals.
+		// A frame's zones are read back when its command buffer comes around again, so nothing ever waits for them.
+		void BeginGpuZone(const char* name);
+		void EndGpuZone();
+		// Rolling statistics of every zone seen so far, over its last gpuZoneHistoryLength frames
+		void GetGpuProfile(std::vector<GpuZoneStats>& outZones) const;
+		// Collects every zone resolved until StopGpuTrace, which writes them as Chrome trace JSON (chrome://tracing, Perfetto)
+		void StartGpuTrace();
+		bool StopGpuTrace(const char* path);
+
+		// Draws index instance data through this frame's instance indices, so persistent slots never have to be reordered
+		void SetInstanceData(const PerInstanceData* instances, u32 length); // Written from immediateInstanceOffset on
+		// This frame's mapped instance data from immediateInstanceOffset + offset on, to be written in place until EndRenderCommands
+		PerInstanceData* GetInstanceDataRange(u32 offset, u32 count);
+		void SetObjectInstanceData(const u32* slots, const PerInstanceData* instances, u32 count);
+		void SetInstanceIndices(const u32* indices, u32 offset, u32 count);
+		// Index of the per-frame regions written this frame, they're used round robin
+		u32 GetFrameSlot() const;
+		// Camera and lighting go to this frame's region, so they have to be set after BeginRenderCommands too
 		void SetCameraData(CameraData cameraData);
 		void SetLightingData(LightingData lightingData);
 		void BeginRenderCommands();
+		// Everything inside the forward pass is recorded into secondary command buffers, executed in call order by EndRenderPass
 		void BeginForwardRenderPass();
-		void DrawMesh(MeshHandle mesh, ShaderHandle shader, MaterialHandle mat, u16 instanceOffset, u16 instanceCount);
+		// Draws are split into contiguous ranges that worker threads record in parallel, so the order is kept. Once per pass.
+		void DrawMeshes(const MeshDraw* draws, u32 drawCount);
+		// GPU-driven draws, for meshes in the shared geometry buffers. A compute shader groups the objects into
+		// indirect commands, and the forward pass draws every material with one vkCmdDrawIndexedIndirectCount.
+		bool SupportsIndirectDraws() const;
+		bool CanDrawIndirect(MeshHandle mesh);
+		// Instance indices are written from firstInstance on, after the ones from SetInstanceIndices
+		void SetIndirectDrawData(const IndirectDraw* draws, u32 drawCount, const IndirectObject* objects, u32 objectCount, u32 firstInstance);
+		void BuildIndirectDraws(); // Outside of the render pass
+		void DrawIndirect();
 		void EndRenderPass();
 		void DoFinalBlit();
 		void EndRenderCommands();
 	private:
+		// Device memory is sub-allocated from large blocks with a buddy allocator.
+		// Nodes are powers of two aligned to their own size, which covers any alignment requirement up to the node size.
+		static constexpr VkDeviceSize memoryBlockSize = 64 * 1024 * 1024;
+		static constexpr VkDeviceSize minAllocationSize = 256;
+		static constexpr u32 memoryBlockOrderCount = 19; // log2(memoryBlockSize / minAllocationSize) + 1
+		static_assert((minAllocationSize << (memoryBlockOrderCount - 1)) == memoryBlockSize);
+
+		struct MemoryBlock {
+			VkDeviceMemory memory;
+			VkDeviceSize size;
+			void* mapped; // Persistently mapped if host visible
+			u32 memoryType;
+			bool linear; // Buffers and optimal tiling images never share a block, so bufferImageGranularity doesn't matter
+			bool dedicated;
+			u32 allocationCount;
+			VkDeviceSize usedBytes;
+			std::vector<u32> freeLists[memoryBlockOrderCount]; // Free nodes of each order, as offsets in minAllocationSize units
+			std::vector<u8> freeNodeOrders; // Per unit: order + 1 if a free node starts there, 0 otherwise
+			std::vector<u32> freeNodePositions; // Per unit: index of the free node in its free list
+		};
+
+		struct Allocation {
+			VkDeviceMemory memory;
+			VkDeviceSize offset;
+			VkDeviceSize size;
+			void* mapped; // Null if not host visible
+			u32 block;
+			u32 order;
+			GpuMemoryCategory category;
+		};
+
 		struct Buffer {
 			VkBuffer buffer;
-			VkDeviceMemory memory;
+			Allocation allocation;
 		};
 
 		struct TextureImpl {
 			VkImage image;
 			VkImageView view;
-			VkDeviceMemory memory;
+			Allocation allocation;
 			VkSampler sampler;
+			u64 uploadValue; // Ready once the upload timelines reach this
 		};
 
 		struct MeshImpl {
+			VertexLayout vertexLayout;
+			bool sharedGeometry; // Lives in the shared vertex and index buffers at baseVertex and firstIndex
+			u32 baseVertex;
+			u32 firstIndex;
 			u32 vertexCount;
+			Buffer packedVertexBuffer;
 			Buffer vertexPositionBuffer;
 			Buffer vertexTexcoord0Buffer;
 			Buffer vertexNormalBuffer;
@@ -62,7 +169,22 @@ namespace Rendering {
 			Buffer vertexColorBuffer;
 
 			u32 indexCount;
+			VkIndexType indexType; // 16 bit whenever the vertex count allows
 			Buffer indexBuffer;
+
+			u64 uploadValue; // Ready once the upload timelines reach this
+		};
+
+		// Separate layout attributes each have their own binding, packed vertices only use the first
+		static constexpr u32 vertexBindingCount = 5;
+
+		// What's bound in one command buffer while its draws are recorded. Secondary buffers start out with nothing bound.
+		struct BoundDrawState {
+			VkPipeline pipeline = VK_NULL_HANDLE;
+			VkDescriptorSet descriptorSet = VK_NULL_HANDLE; // Materials never change shaders, so the layout matches too
+			VkBuffer vertexBuffers[vertexBindingCount] = {};
+			VkBuffer indexBuffer = VK_NULL_HANDLE;
+			VkIndexType indexType = VK_INDEX_TYPE_MAX_ENUM;
 		};
 
 		enum DescriptorSetLayoutFlags
@@ -87,14 +209,18 @@ namespace Rendering {
 
 		struct ShaderImpl {
 			VkPipelineLayout pipelineLayout;
-			VkPipeline pipeline;
+			VkPipeline pipeline; // VK_NULL_HANDLE until compiled
+			u64 vertHash; // Keys into shaderModules
+			u64 fragHash;
 			VkDescriptorSetLayout descriptorSetLayout;
 			DescriptorSetLayoutInfo layoutInfo;
 			VertexAttribFlags vertexInputs;
+			VertexLayout vertexLayout;
 		};
 
 		struct MaterialImpl {
 			VkDescriptorSet descriptorSet;
+			u64 uploadValue; // Latest upload of any texture bound to it
 		};
 
 		struct CommandBuffer {
@@ -104,6 +230,40 @@ namespace Rendering {
 			VkSemaphore drawCompleteSemaphore;
 		};
 
+		// Uploads are recorded into batches that are submitted together, rather than waiting on the queue after every copy.
+		// Each batch signals both upload timelines with its own value, so a batch is done once both have reached it.
+		static constexpr VkDeviceSize uploadStagingSize = 32 * 1024 * 1024;
+		static constexpr u32 uploadBatchCount = 4;
+
+		struct UploadBatch {
+			VkCommandBuffer transferCmd; // Buffer copies, on the transfer queue
+			VkCommandBuffer graphicsCmd; // Image copies and mip generation, blits need a graphics queue
+			u64 timelineValue;
+			u64 stagingEnd; // Staging ring head when the batch was submitted
+			std::vector<Buffer> overflowBuffers; // Staging for uploads that don't fit in the ring
+		};
+
+		// Matches build_draws_comp.glsl, instanceCount is counted up by the compute shader
+		struct IndirectDrawInfo {
+			u32 indexCount;
+			u32 firstIndex;
+			s32 vertexOffset;
+			u32 firstInstance;
+			u32 instanceCount;
+			u32 group;
+			u32 firstCommand;
+			u32 padding;
+		};
+
+		// Draws that share a pipeline, descriptor set and index buffer, drawn with a single indirect call
+		struct IndirectGroup {
+			ShaderHandle shader;
+			MaterialHandle material;
+			VkIndexType indexType;
+			u32 firstCommand;
+			u32 commandCount;
+		};
+
 		struct SwapchainImage {
 			VkImage image;
 			VkImageView view;
@@ -113,20 +273,42 @@ namespace Rendering {
 		struct FramebufferAttachemnt {
 			VkImage image;
 			VkImageView view;
-			VkDeviceMemory memory;
+			Allocation allocation;
 		};
 
 		void GetSuitablePhysicalDevice();
-		bool IsPhysicalDeviceSuitable(VkPhysicalDevice physicalDevice, u32& outQueueFamilyIndex);
+		bool IsPhysicalDeviceSuitable(VkPhysicalDevice physicalDevice, u32& outQueueFamilyIndex, u32& outTransferQueueFamilyIndex);
 		void CreateLogicalDevice();
+		// Loaded from disk if it was saved on the same device and driver, saved again on destruction
+		void CreatePipelineCache();
+		void SavePipelineCache();
 		void CreateForwardRenderPass();
 		void CreateFinalBlitRenderPass();
+		void CreateInstance(const char* const* extensionNames, u32 extensionCount);
+		void Initialize();
 		void CreateRenderPasses();
 		void FreeRenderPasses();
 		void CreateSwapchain(VkRenderPass renderPass);
 		void FreeSwapchain();
+		void CreateOffscreenTarget(VkRenderPass renderPass);
+		void FreeOffscreenTarget();
+		void CreateGpuProfiler();
+		void FreeGpuProfiler();
+		void ResolveGpuZones(u32 cbIndex);
+		void AddGpuZoneSample(const char* name, r64 milliseconds);
 		void CreatePrimaryCommandPoolAndBuffers();
 		void FreePrimaryCommandPoolAndBuffers();
+		void CreateRecordCommandPools();
+		void FreeRecordCommandPools();
+		void BeginSecondaryCommands(VkCommandBuffer cmdBuffer);
+		// Binds are skipped when the state they'd set is already bound in the command buffer, binds that are issued go to outStats
+		void BindDrawPipeline(VkCommandBuffer cmdBuffer, BoundDrawState& state, const ShaderImpl& shader, const MaterialImpl& material, FrameStats& outStats) const;
+		// Only the bindings in bindingMask are used, changed ones are set with a single call
+		void BindDrawVertexBuffers(VkCommandBuffer cmdBuffer, BoundDrawState& state, const VkBuffer* buffers, u32 bindingMask, FrameStats& outStats) const;
+		void BindDrawIndexBuffer(VkCommandBuffer cmdBuffer, BoundDrawState& state, VkBuffer buffer, VkIndexType indexType, FrameStats& outStats) const;
+		// Tracks bound state only within cmdBuffer, so ranges can be recorded on any thread
+		// Command counts are added to outStats, each task has its own.
+		void RecordDraws(VkCommandBuffer cmdBuffer, const MeshDraw* draws, u32 drawCount, u64& outUploadWaitValue, FrameStats& outStats);
 		void CreateFramebufferAttachments();
 		void FreeFramebufferAttachments();
 		void CreatePrimaryFramebuffer();
@@ -135,20 +317,40 @@ namespace Rendering {
 		void FreeBlitPipeline();
 		void CreateUniformBuffers();
 		void FreeUniformBuffers();
+		void UploadMaterialData();
+		void CreateUploadQueue();
+		void FreeUploadQueue();
+		void CreateIndirectDrawResources();
+		void FreeIndirectDrawResources();
 
 		s32 GetDeviceMemoryTypeIndex(u32 typeFilter, VkMemoryPropertyFlags propertyFlags);
-		VkCommandBuffer GetTemporaryCommandBuffer();
-		void AllocateMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, VkDeviceMemory& outMemory);
-		void AllocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memProps, Buffer& outBuffer);
-		void CopyBuffer(const VkBuffer& src, const VkBuffer& dst, VkDeviceSize size);
-		void CopyRawDataToBuffer(void* src, const VkBuffer& dst, VkDeviceSize size);
+		u32 CreateMemoryBlock(u32 memoryType, VkDeviceSize size, bool linear, bool dedicated);
+		void PushFreeNode(MemoryBlock& block, u32 unitOffset, u32 order);
+		void RemoveFreeNode(MemoryBlock& block, u32 unitOffset);
+		bool AllocateFromBlock(MemoryBlock& block, u32 order, u32& outUnitOffset);
+		void FreeToBlock(MemoryBlock& block, u32 unitOffset, u32 order);
+		void FreeMemoryBlocks();
+		void AllocateMemory(VkMemoryRequirements requirements, VkMemoryPropertyFlags properties, bool linear, GpuMemoryCategory category, Allocation& outAllocation);
+		void FreeMemory(const Allocation& allocation);
+		void AllocateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags memProps, GpuMemoryCategory category, Buffer& outBuffer);
+		UploadBatch& GetUploadBatch();
+		void StageUploadData(const void* data, VkDeviceSize size, VkBuffer& outBuffer, VkDeviceSize& outOffset);
+		void UploadToBuffer(const void* data, VkDeviceSize size, const VkBuffer& dst, VkDeviceSize dstOffset = 0);
+		void CreateSharedGeometryBuffers();
+		void FreeSharedGeometryBuffers();
+		void RetireUploads();
+		void WaitForUploads(u64 value);
 		void FreeBuffer(const Buffer& buffer);
 		VkShaderModule CreateShaderModule(const char* code, const u32 size);
+		// Reads the file only the first time a path is seen, and returns the content hash that keeps a reference to the module
+		u64 AcquireShaderModule(const char* path);
+		void ReleaseShaderModule(u64 hash);
 		void CreateDescriptorSetLayout(VkDescriptorSetLayout& layout, const DescriptorSetLayoutInfo& info);
-		void CreateShaderRenderPipeline(VkPipelineLayout& outLayout, VkPipeline &outPipeline, const VkDescriptorSetLayout &descSetLayout, VertexAttribFlags vertexInputs, const char* vert, const char* frag);
+		// Only reads state that doesn't change after construction, so it's called from worker threads
+		void CreateShaderRenderPipeline(VkPipelineLayout layout, VkPipeline& outPipeline, VertexAttribFlags vertexInputs, VertexLayout vertexLayout, VkShaderModule vertShader, VkShaderModule fragShader) const;
 		void InitializeDescriptorSet(VkDescriptorSet descriptorSet, const DescriptorSetLayoutInfo& info, const MaterialHandle matHandle, const TextureHandle* textures);
 		void UpdateDescriptorSetSampler(VkDescriptorSet descriptorSet, u32 binding, VkDescriptorImageInfo info);
-		void UpdateDescriptorSetBuffer(VkDescriptorSet descriptorSet, u32 binding, VkDescriptorBufferInfo info, bool dynamic = false);
+		void UpdateDescriptorSetBuffer(VkDescriptorSet descriptorSet, u32 binding, VkDescriptorBufferInfo info, VkDescriptorType type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
 
 		VkInstance vkInstance;
 
@@ -165,20 +367,96 @@ namespace Rendering {
 		} physicalDeviceInfo;
 
 		VkDevice device;
+		VkPipelineCache pipelineCache;
+		r64 pipelineCreateMilliseconds; // Spent in vkCreate*Pipelines, to compare runs with and without a cache
+		std::vector<MemoryBlock> memoryBlocks;
+		u64 categoryMemoryBytes[GPU_MEMORY_CATEGORY_COUNT];
+		FrameStats frameStats; // Command and upload counters of the frame being recorded
 		u32 primaryQueueFamilyIndex = 0;
 		VkQueue primaryQueue;
+		u32 transferQueueFamilyIndex = 0; // Same as the primary family if there's no dedicated transfer queue
+		VkQueue transferQueue;
+
+		VkCommandPool uploadTransferCommandPool;
+		VkCommandPool uploadGraphicsCommandPool;
+		VkSemaphore uploadTransferTimeline;
+		VkSemaphore uploadGraphicsTimeline;
+		UploadBatch uploadBatches[uploadBatchCount]; // The batch with timeline value v is at v % uploadBatchCount
+		bool uploadBatchOpen;
+		u64 uploadSubmittedValue;
+		u64 uploadCompletedValue;
+		Buffer uploadStagingBuffer;
+		u64 uploadStagingHead; // Ring positions, these only ever increase
+		u64 uploadStagingTail;
+		u64 frameUploadWaitValue; // Latest upload used by the frame being recorded
 
 		VkCommandPool primaryCommandPool;
 		u32 currentCbIndex;
 		CommandBuffer primaryCommandBuffers[COMMAND_BUFFER_COUNT];
 
+		// Every recording thread gets its own pool per frame, pools can't be used from two threads at once.
+		// Pools are reset as a whole once the frame's fence has signaled.
+		static constexpr u32 maxRecordThreadCount = 16;
+		static constexpr u32 minDrawsPerRecordTask = 128; // Fewer aren't worth waking a thread for
+		struct RecordContext {
+			VkCommandPool pool;
+			VkCommandBuffer cmdBuffer;
+		};
+		JobSystem* jobs;
+		u32 recordThreadCount;
+		RecordContext recordContexts[COMMAND_BUFFER_COUNT][maxRecordThreadCount];
+		VkCommandBuffer indirectSecondaryBuffers[COMMAND_BUFFER_COUNT]; // From the first context's pool
+		VkCommandBuffer passSecondaryBuffers[maxRecordThreadCount + 1]; // Recorded for the current pass, in execution order
+		u32 passSecondaryCount;
+		bool passDrawsRecorded;
+
 		VkSwapchainKHR swapchain;
 		u32 currentSwapchainImageIndex;
 		std::vector<SwapchainImage> swapchainImages;
+		// Headless mode has a single offscreen image in swapchainImages instead, and no surface or swapchain
+		bool headless;
+		Allocation offscreenAllocation;
+		Buffer readbackBuffer;
+
+		// GPU zones, a begin and end timestamp each in the command buffer's range of the pool
+		static constexpr u32 maxGpuZonesPerFrame = 32;
+		static constexpr u32 gpuZoneHistoryLength = 128;
+		struct GpuZone {
+			const char* name;
+			u32 depth;
+		};
+		struct GpuZoneHistory {
+			const char* name;
+			r64 samples[gpuZoneHistoryLength]; // Milliseconds, used round robin
+			u32 sampleCount;
+			u32 next;
+		};
+		struct GpuTraceEvent {
+			const char* name;
+			u64 frame;
+			r64 startMicroseconds;
+			r64 durationMicroseconds;
+			u32 depth;
+		};
+		VkQueryPool gpuZonePool; // Null if timestamps aren't supported
+		u32 timestampValidBits;
+		GpuZone gpuZones[COMMAND_BUFFER_COUNT][maxGpuZonesPerFrame]; // In the order they were begun
+		u32 gpuZoneCounts[COMMAND_BUFFER_COUNT];
+		u64 gpuZoneFrames[COMMAND_BUFFER_COUNT]; // Frame number the command buffer was last recorded for
+		s32 gpuZoneStack[maxGpuZonesPerFrame]; // Zones open in the frame being recorded, -1 for ones past the limit
+		u32 gpuZoneStackDepth;
+		u64 gpuFrameNumber;
+		std::vector<GpuZoneHistory> gpuZoneHistories;
+		r64 gpuFrameMilliseconds;
+		bool gpuTraceActive;
+		bool gpuTraceOriginSet;
+		u64 gpuTraceOrigin; // Timestamp the trace's times are relative to
+		std::vector<GpuTraceEvent> gpuTraceEvents;
 
 		VkDescriptorPool descriptorPool;
 
 		// Render passes
+		VkSampleCountFlagBits msaaSamples; // Of the forward pass color and depth
 		VkRenderPass forwardRenderPass;
 		VkRenderPass finalBlitRenderPass;
 
@@ -190,26 +468,80 @@ namespace Rendering {
 		VkDescriptorSet blitDescriptorSet;
 		VkDescriptorSetLayout blitDescriptorSetLayout;
 
-		// Shader bindings
+		// Shader bindings. The buffers written by the CPU have one region per command buffer, selected with dynamic offsets.
 		static constexpr u32 cameraDataBinding = 0;
 		Buffer cameraDataBuffer;
+		VkDeviceSize cameraDataFrameSize;
 
 		static constexpr u32 lightingDataBinding = 1;
 		Buffer lightingDataBuffer;
+		VkDeviceSize lightingDataFrameSize;
 
 		static constexpr u32 perInstanceDataBinding = 2;
-		Buffer perInstanceBuffer;
-		u32 perInstanceDynamicOffset;
+		Buffer perInstanceBuffer; // One region per command buffer
+		VkDeviceSize perInstanceFrameSize;
+		static constexpr u32 instanceIndexBinding = 16;
+		Buffer instanceIndexBuffer; // Slot in perInstanceBuffer of every drawn instance, one region per command buffer
+		VkDeviceSize instanceIndexFrameSize;
 
 		static constexpr u32 shaderDataBinding = 3;
 		Buffer shaderDataBuffer;
+		VkDeviceSize shaderDataFrameSize;
+		// Material data can change at any time, so it's written here and copied to each frame's region once that frame is free
+		u8* materialShadowData;
+		u8* materialDirtyFrames; // By slot, regions that don't have the latest data yet
+		std::vector<u32> dirtyMaterialSlots;
 
-		static constexpr u32 samplerBinding = 4; // 4 - 11 reserved for generic samplers
-		MemoryPool<TextureImpl> textures = MemoryPool<TextureImpl>(maxTextureCount);
+		// In binding order: camera, lighting, instance data, material data, instance indices. The blit only uses the camera's.
+		static constexpr u32 frameDynamicOffsetCount = 5;
+		u32 frameDynamicOffsets[COMMAND_BUFFER_COUNT][frameDynamicOffsetCount];
 
-		MemoryPool<MeshImpl> meshes = MemoryPool<MeshImpl>(maxVertexBufferCount);
-		MemoryPool<ShaderImpl> shaders = MemoryPool<ShaderImpl>(maxShaderCount);
-		MemoryPool<MaterialImpl> materials = MemoryPool<MaterialImpl>(maxMaterialCount);
+		static constexpr u32 samplerBinding = 4; // 4 - 11 reserved for generic samplers
+		MemoryPool<TextureImpl> textures = MemoryPool<TextureImpl>(64, maxTextureCount);
+
+		MemoryPool<MeshImpl> meshes = MemoryPool<MeshImpl>(64, maxVertexBufferCount);
+		MemoryPool<ShaderImpl> shaders = MemoryPool<ShaderImpl>(16, maxShaderCount);
+		std::vector<ShaderHandle> pendingShaders;
+		struct ShaderModule {
+			VkShaderModule module;
+			u32 refCount;
+			std::vector<char> code; // Compared on a hash hit, equal hashes don't mean equal SPIR-V
+		};
+		std::unordered_map<u64, ShaderModule> shaderModules; // By content hash, the next free key on a collision
+		std::unordered_map<std::string, u64> shaderPathHashes;
+		MemoryPool<MaterialImpl> materials = MemoryPool<MaterialImpl>(64, maxMaterialCount);
+
+		// Packed meshes are sub-allocated from shared vertex and index buffers, so they can all be drawn without rebinding
+		static constexpr u32 sharedVertexCapacity = 1 << 20;
+		static constexpr u32 sharedIndexCapacity = 1 << 22;
+		static constexpr u32 sharedIndex32Capacity = 1 << 21;
+		Buffer sharedVertexBuffer;
+		Buffer sharedIndexBuffer;
+		Buffer sharedIndex32Buffer;
+		RangeAllocator sharedVertexRanges;
+		RangeAllocator sharedIndexRanges;
+		RangeAllocator sharedIndex32Ranges;
+
+		// GPU-driven draws, every buffer has one region per command buffer
+		static constexpr u32 maxIndirectGroupCount = maxMaterialCount * 2; // One per material and index type
+		bool indirectDrawSupported; // Needs drawIndirectCount and drawIndirectFirstInstance
+		Buffer indirectObjectBuffer;
+		VkDeviceSize indirectObjectFrameSize;
+		Buffer indirectDrawBuffer;
+		VkDeviceSize indirectDrawFrameSize;
+		Buffer indirectCountBuffer;
+		VkDeviceSize indirectCountFrameSize;
+		Buffer indirectCommandBuffer;
+		VkDeviceSize indirectCommandFrameSize;
+		VkDescriptorSetLayout indirectDescriptorSetLayout;
+		VkDescriptorSet indirectDescriptorSets[COMMAND_BUFFER_COUNT];
+		VkPipelineLayout indirectPipelineLayout;
+		VkPipeline indirectPipeline;
+		IndirectGroup indirectGroups[maxIndirectGroupCount];
+		s32 indirectGroupLookup[maxIndirectGroupCount]; // By material slot and index type
+		u32 indirectGroupCount;
+		u32 indirectDrawCount;
+		u32 indirectObjectCount;
 
 		static constexpr u32 shadowMapBinding = 12;
 		static constexpr u32 envMapBinding = 13;